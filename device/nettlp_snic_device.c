@@ -7,6 +7,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
 #include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <arpa/inet.h>
@@ -15,247 +17,3800 @@
 #include <signal.h>
 #include <poll.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stddef.h>
+#include <limits.h>
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+#include <netinet/ip6.h>
+#include <net/ethernet.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <libtlp.h>
 #include <nettlp_snic.h>
+#include <nettlp_msg_all.h>
+#include <nettlp_shm.h>
+#include <nettlp_pcap.h>
 
 static int caught_signal = 0;
+static int verbose = 1;	/* print per-packet messages, -q to disable */
+
+#define pr_pkt(fmt, ...) do {				\
+		if (verbose)				\
+			printf(fmt, ##__VA_ARGS__);	\
+	} while (0)
+
+struct snic_pktgen {
+	int enabled;
+	int blast;	/* wait for RX buffers instead of dropping */
+
+	int min_len, max_len;	/* packet size range */
+	int nflows;		/* number of UDP source ports */
+	uint64_t rate;		/* packets per second, 0 means unlimited */
+	uint64_t count;		/* packets to be sent, 0 means infinite */
+
+	struct snic_bar0 cfg;	/* addresses for the templated headers */
+
+	uint64_t sent, bytes, dropped;
+};
+
+#define PKTGEN_MIN_LEN		60
+#define PKTGEN_MAX_LEN		1514
+#define PKTGEN_HDR_LEN		(sizeof(struct ether_header) +		\
+				 sizeof(struct ip) + sizeof(struct udphdr))
+#define PKTGEN_SPORT_BASE	49152
+#define PKTGEN_DPORT		9
+
+/* per-queue RX thread configuration */
+struct snic_rxq_conf {
+	int busy_poll;	/* usec to spin on the backend after a packet */
+	int cpu;	/* cpu to pin the RX thread, -1 means no pinning */
+};
+
+/* Pipelined TX engine. A doorbell wakes the descriptor fetch stage,
+ * and each descriptor goes through the stages in a slot indexed by
+ * its sequence number:
+ *
+ *   fetch    -> payload  -> backend -> complete
+ *   (1 thread)  (workers)   (1 thread) (1 thread)
+ *
+ * Payload workers have their own DMA contexts so that multiple
+ * payload reads are outstanding. Stages hand slots over by lock-free
+ * sequence counters, and sleep on events when there is no work. */
+#define SNIC_TXP_MAX_WORKERS	8
+#define SNIC_TXP_SPIN		2048
+
+#define SNIC_TXP_FETCHED	1
+#define SNIC_TXP_PAYLOAD	2
+#define SNIC_TXP_SENT		3
+
+struct snic_txp_event {
+	uint32_t seq;		/* futex word */
+	uint32_t waiters;
+};
+
+/* Per-packet timestamps at the steps in the header comment of
+ * nettlp_snic.h, enabled by -T. Intervals between the steps and the
+ * total are aggregated into latency histograms, which are dumped via
+ * the stats socket.
+ *
+ *   TX: doorbell, desc fetched, payload fetched, backend written, irq
+ *   RX: backend read, buffer available, payload written, desc written
+ *       back, irq
+ *
+ * The doorbell time of a TX packet is the last doorbell before its
+ * descriptor is fetched. */
+#define SNIC_TS_STEPS		5	/* 4 intervals and the total */
+
+struct snic_ts_hist {
+	uint64_t tx[SNIC_TS_STEPS][SNIC_LAT_HIST_BUCKETS];
+	uint64_t rx[SNIC_TS_STEPS][SNIC_LAT_HIST_BUCKETS];
+};
+
+static const char *snic_ts_tx_names[SNIC_TS_STEPS] = {
+	"desc_fetch", "payload_fetch", "backend_write", "irq", "total",
+};
+
+static const char *snic_ts_rx_names[SNIC_TS_STEPS] = {
+	"buffer_wait", "payload_write", "desc_writeback", "irq", "total",
+};
+
+struct snic_txp_slot {
+	struct descriptor desc;
+	uint32_t idx;		/* index on the TX ring */
+	int wrap;		/* wrap counter at idx */
+	int drop;		/* failed to fetch desc or payload */
+	uint32_t state;		/* SNIC_TXP_* */
+	uint64_t ts[SNIC_TS_STEPS];
+	struct snic_pktbuf *pb;	/* payload, from payload to backend */
+};
+
+struct nettlp_snic;
+
+struct snic_txp_worker {
+	struct nettlp_snic *snic;
+	int id;
+	struct nettlp nt;	/* DMA context for payload reads */
+};
+
+struct snic_txp {
+	int nworkers;		/* 0 disables the pipeline */
+	int cpu;		/* first cpu for the stages, -1 not pinned */
+
+	struct snic_txp_slot *slots;	/* SNIC_DESC_RING_LEN slots */
+
+	/* next descriptor to fetch. under tx_mutex */
+	uint32_t fetch_idx;
+	int fetch_wrap;
+
+	/* sequence numbers of slots done by each stage */
+	uint32_t fetched, claimed, sent, completed;
+
+	struct snic_txp_event ev_db;		/* doorbell */
+	struct snic_txp_event ev_fetched;
+	struct snic_txp_event ev_payload;
+	struct snic_txp_event ev_sent;
+
+	struct snic_txp_worker workers[SNIC_TXP_MAX_WORKERS];
+};
+
+/* RX descriptor prefetch cache. Descriptors are fetched in bulk once
+ * SNIC_RX_DESC_PREFETCH are posted, or as soon as any is posted if the
+ * cache is empty, so that a packet is DMA'd to the host without a
+ * descriptor read on the critical path. */
+#define SNIC_RX_DESC_CACHE	32	/* power of 2, divides ring len */
+#define SNIC_RX_DESC_PREFETCH	8
+
+/* Completed RX descriptors stay in the cache, and are written back
+ * by one DMA write followed by one interrupt when SNIC_RX_WB_BATCH of
+ * them complete, or when the reader of the backend runs out of
+ * packets and calls nettlp_snic_rx_flush(). */
+#define SNIC_RX_WB_BATCH	8
+
+/* Receive coalescing (SNIC_F_LRO). Up to SNIC_LRO_FLOWS flows are
+ * merged at a time, and a flow is delivered SNIC_LRO_TIMEOUT after
+ * its first segment at the latest. */
+#define SNIC_LRO_FLOWS		4
+#define SNIC_LRO_TIMEOUT	(50 * 1000)	/* nsec */
+
+struct snic_lro_flow {
+	int len;		/* 0 if unused */
+	int hlen;		/* L2 to L4 headers */
+	int segs;
+	int mss;		/* payload of the first segment */
+	uint32_t next_seq;
+	uint64_t start;		/* when the first segment arrived */
+	uint8_t buf[SNIC_LRO_MAX_BYTES];
+};
+
+/* Flow rules. Rules exactly matching the IPv4 5-tuple are looked up
+ * in an open addressing hash table of SNIC_FLOW_HT_SIZE entries, and
+ * the others are scanned in location order. Both are rebuilt by a
+ * flow command under the write lock. */
+#define SNIC_FLOW_HT_SIZE	2048	/* power of 2 */
+
+struct snic_flow_rule {
+	int valid;
+	uint32_t action;
+	struct snic_flow_match key, mask;
+};
+
+struct snic_flow_table {
+	pthread_rwlock_t lock;
+	int nrules;	/* read without the lock to skip lookups */
+	struct snic_flow_rule rules[SNIC_FLOW_RULES];
+
+	struct {
+		uint32_t hash;
+		int loc;	/* -1 if empty */
+	} ht[SNIC_FLOW_HT_SIZE];
+
+	int nwild;
+	uint16_t wild[SNIC_FLOW_RULES];	/* wildcard rules by location */
+};
 
 struct nettlp_snic {
 
+	int id;		/* instance number in this process */
+	char *ifname;	/* tap interface name */
 	int fd;		/* tun fd */
 
 	/* filled by message API */
 	uintptr_t bar4_start;
+	struct snic_bar4 regs;	/* shadow of BAR4 control registers */
+	int enabled;		/* by the driver */
+	int nqueues;		/* in use by the driver, 0 if not told */
 	struct nettlp_msix tx_irq, rx_irq;
 
+	/* device info from NETTLP_MSG_GET_ALL or the cache file */
+	struct in_addr host;
+	struct nettlp_msg_all boot;
+	char *cache_path;	/* NULL disables the cache */
+	int no_cache;
+
 	/* descriptor base */
 	uintptr_t tx_desc_base;
 	uintptr_t rx_desc_base;
+	uint32_t desc_version;	/* notified by driver */
+	uint32_t features;	/* SNIC_F_* requested by driver */
+	int packed;		/* packed ring mode, applied on ring reset */
+	int hdr_split;		/* header split, applied on RX ring reset */
+	uintptr_t rx_hdr_base;	/* header buffers on the host */
+	uint32_t irq_mask;	/* SNIC_IRQ_* masked by driver */
+	uint32_t irq_pending;	/* SNIC_IRQ_* not sent due to the mask */
+
+	/* TX ring. Doorbells on any callback thread update tx_tail,
+	 * and a thread holding tx_mutex processes descriptors from
+	 * tx_head to tx_tail */
+	uint32_t tx_head, tx_tail;
+	int tx_wrap;	/* wrap counter for the packed ring */
+	pthread_mutex_t tx_mutex;
+	struct snic_txp txp;	/* pipelined TX engine, if enabled */
 
-	/* XXX: should be protected among threads by mutex */
-	int rx_state;
-#define RX_STATE_INIT	0
-#define	RX_STATE_READY	1
-#define RX_STATE_BUSY	2
-#define RX_STATE_DONE	3
-	uintptr_t rx_desc_addr;
-	struct descriptor rx_desc;
+	/* RX ring. Posted descriptors from rx_head are prefetched into
+	 * rx_cache, indexed by the ring index. rx_fetch is the next
+	 * descriptor to be fetched */
+	uint32_t rx_head, rx_tail;
+	int rx_wrap;	/* wrap counter for the packed ring */
+	uint32_t rx_fetch;
+	int rx_fetch_wrap;
+	int rx_cached;	/* descriptors from rx_head in rx_cache */
+	int rx_wb_pending;	/* completed ones before rx_head */
+	struct descriptor rx_cache[SNIC_RX_DESC_CACHE];
+	uint64_t rx_ts[SNIC_RX_DESC_CACHE][SNIC_TS_STEPS];
+	pthread_mutex_t rx_mutex;
+
+	/* flow rules, applied by the tap worker */
+	uintptr_t flow_cmd_base;
+	struct snic_flow_table flow;
+
+	/* segments being coalesced, touched only by the tap worker */
+	struct snic_lro_flow lro[SNIC_LRO_FLOWS];
 
 	struct nettlp nt;	/* For DMA issued from this LibTLP */
 	pthread_mutex_t mutex;	/* Lock for the nt */
+
+	/* shared-memory transport used instead of libtlp if not NULL.
+	 * shm_lock serializes threads producing to the req ring */
+	struct nettlp_shm *shm;
+	pthread_mutex_t shm_lock;
+
+	struct snic_pktgen pktgen;	/* RX packet generator */
+	struct snic_rxq_conf rxq[SNIC_MAX_QUEUES];
+
+	/* counters. DMA-written to stats_base on the host, and dumped
+	 * as JSON to clients of the stats socket */
+	struct snic_stats stats;
+	uintptr_t stats_base;
+	char *stats_sock_path;
+	int stats_interval;	/* msec */
+
+	/* per-packet stage timestamps */
+	int timestamps;
+	uint64_t tx_db_ts;	/* last TX doorbell */
+	struct snic_ts_hist ts;
+};
+
+/* A device process serves multiple snic instances. BAR4 writes from
+ * the adapters are dispatched to instances by address, and the taps
+ * are read by a pool of worker threads shared among instances. */
+#define SNIC_MAX_INSTANCES	16	/* limited by TLP tags for DMA */
+
+struct snic_worker {
+	int id;
+	int n;
+	struct nettlp_snic *snics[SNIC_MAX_INSTANCES];
+};
+
+struct snic_daemon {
+	int ninst;
+	struct nettlp_snic *inst[SNIC_MAX_INSTANCES];
+
+	int nworkers;
+	struct snic_worker workers[SNIC_MAX_INSTANCES];
 };
 #define SNIC_DMA_LOCK(s) pthread_mutex_lock(&(s)->mutex)
 #define SNIC_DMA_UNLOCK(s) pthread_mutex_unlock(&(s)->mutex)
 
+#define SNIC_STATS_INTERVAL	1000	/* msec */
 
-#define BAR4_TX_DESC_OFFSET	0
-#define BAR4_RX_DESC_OFFSET	8
-#define BAR4_TX_INDEX_OFFSET	16
-#define BAR4_RX_INDEX_OFFSET	20
+#define SNIC_STAT_ADD(s, qn, f, n)					\
+	__atomic_fetch_add(&(s)->stats.q[qn].f, n, __ATOMIC_RELAXED)
+#define SNIC_STAT_INC(s, qn, f)	SNIC_STAT_ADD(s, qn, f, 1)
 
-#define is_mwr_addr_tx_desc_ptr(bar4, a)  (a - bar4 == BAR4_TX_DESC_OFFSET)
-#define is_mwr_addr_rx_desc_ptr(bar4, a)  (a - bar4 == BAR4_RX_DESC_OFFSET)
-#define is_mwr_addr_tx_index_ptr(bar4, a) (a - bar4 == BAR4_TX_INDEX_OFFSET)
-#define is_mwr_addr_rx_index_ptr(bar4, a) (a - bar4 == BAR4_RX_INDEX_OFFSET)
+/* queues served to the driver: those it uses, or all the device has
+ * until the driver tells */
+#define snic_nqueues(s)	((s)->nqueues ? (s)->nqueues : (int)(s)->stats.nqueues)
 
-int nettlp_snic_mwr(struct nettlp *nt, struct tlp_mr_hdr *mh,
-		    void *m, size_t count, void *arg)
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()	__builtin_ia32_pause()
+#else
+#define cpu_relax()	__asm__ __volatile__("" ::: "memory")
+#endif
+
+
+static uint64_t now_ns(void)
 {
-	int ret;
-	struct nettlp_snic *snic = arg;
-	struct descriptor desc;
-	uint32_t idx;
-	uintptr_t dma_addr, addr;
-	char buf[4096];
-
-	dma_addr = tlp_mr_addr(mh);
-	printf("%s: dma_addr is %#lx\n", __func__, dma_addr);
-
-	if (is_mwr_addr_tx_desc_ptr(snic->bar4_start, dma_addr)) {
-		/* save tx desc base */
-		memcpy(&snic->tx_desc_base, m, 8);
-		printf("TX desc base is %#lx\n", snic->tx_desc_base);
-	} else if (is_mwr_addr_rx_desc_ptr(snic->bar4_start, dma_addr)) {
-		/* save rx desc base */
-		memcpy(&snic->rx_desc_base, m, 8);
-		printf("RX desc base is %#lx\n", snic->rx_desc_base);
-	} else if (is_mwr_addr_tx_index_ptr(snic->bar4_start, dma_addr)) {
-
-		if (snic->tx_desc_base == 0) {
-			fprintf(stderr, "tx_desc_base is 0\n");
-			goto tx_end;
-		}
-
-		memcpy(&idx, m, sizeof(idx));
-		addr = snic->tx_desc_base + (sizeof(struct descriptor) * idx);
-		/* 1. TX descriptor is updated. start TX process */
-		printf("idx %u, dma to %#lx, tx desc ptr is %#lx\n",
-		       idx, dma_addr, addr);
-
-		/* 2. Read tx descriptor from the specified address */
-		SNIC_DMA_LOCK(snic);
-		ret = dma_read(&snic->nt, addr, &desc, sizeof(desc));
-		SNIC_DMA_UNLOCK(snic);
-		if (ret < sizeof(desc)) {
-			fprintf(stderr, "failed to read tx desc from %#lx\n",
-				addr);
-			goto tx_end;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* timestamp for stage latencies, 0 if disabled */
+static inline uint64_t snic_ts_now(struct nettlp_snic *snic)
+{
+	struct timespec ts;
+
+	if (!snic->timestamps)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* aggregate the intervals of SNIC_TS_STEPS timestamps */
+static void snic_ts_record(uint64_t (*hist)[SNIC_LAT_HIST_BUCKETS],
+			   uint64_t *t)
+{
+	int n;
+	uint64_t v;
+
+	for (n = 0; n < SNIC_TS_STEPS; n++) {
+		v = (n < SNIC_TS_STEPS - 1) ? t[n + 1] - t[n] : t[n] - t[0];
+		__atomic_fetch_add(&hist[n][snic_lat_hist_index(v)], 1,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Packet buffer pool.
+ *
+ * Packet buffers are carved out of 2MB hugepages, or transparent
+ * hugepages if none are reserved, preferring the NUMA node of the
+ * pinned threads, so that touching buffers of many slots does not
+ * miss the TLB at high packet rates. A thread allocates and frees
+ * buffers through its own cache without locks, and the cache
+ * exchanges SNIC_POOL_BATCH buffers at a time with the central free
+ * list. A buffer has a single owner, and a stage hands it over to
+ * the next one by pointer instead of copying the packet.
+ */
+#define SNIC_PKTBUF_SIZE	4096	/* max TX packet */
+#define SNIC_POOL_CACHE		64
+#define SNIC_POOL_BATCH		32
+#define SNIC_HUGEPAGE_SIZE	(2UL << 20)
+
+/* TX pipeline slots and a full cache of each thread of an instance */
+#define SNIC_POOL_BUFS_PER_INST	(SNIC_DESC_RING_LEN +			\
+				 SNIC_POOL_CACHE * (SNIC_TXP_MAX_WORKERS + 4))
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB		(21 << MAP_HUGE_SHIFT)
+#endif
+
+struct snic_pktbuf {
+	char data[SNIC_PKTBUF_SIZE];
+	struct snic_pktbuf *next;	/* on the central free list */
+} __attribute__((aligned(64)));
+
+struct snic_pool {
+	pthread_mutex_t lock;
+	struct snic_pktbuf *free;
+	int nbufs;
+	int node;	/* preferred NUMA node, -1 if any */
+	int hugetlb;	/* on reserved hugepages, otherwise THP */
+};
+
+struct snic_pool_cache {
+	int n;
+	struct snic_pktbuf *bufs[SNIC_POOL_CACHE];
+};
+
+static struct snic_pool snic_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static __thread struct snic_pool_cache snic_pool_cache;
+
+/* NUMA node of the cpu, or -1 if unknown */
+static int snic_cpu_node(int cpu)
+{
+	int node = -1;
+	char path[64];
+	DIR *dir;
+	struct dirent *e;
+
+	if (cpu < 0)
+		return -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	while ((e = readdir(dir))) {
+		if (sscanf(e->d_name, "node%d", &node) == 1)
+			break;
+	}
+	closedir(dir);
+
+	return node;
+}
+
+static int snic_pool_init(int nbufs, int cpu)
+{
+	int n;
+	char *base;
+	size_t len;
+	unsigned long mask;
+	struct snic_pool *p = &snic_pool;
+	struct snic_pktbuf *pb;
+
+	len = (nbufs * sizeof(*pb) + SNIC_HUGEPAGE_SIZE - 1) &
+		~(SNIC_HUGEPAGE_SIZE - 1);
+
+	base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB,
+		    -1, 0);
+	p->hugetlb = (base != MAP_FAILED);
+	if (!p->hugetlb) {
+		/* no hugepages reserved. align to use THP */
+		base = mmap(NULL, len + SNIC_HUGEPAGE_SIZE,
+			    PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+		base = (char *)(((uintptr_t)base + SNIC_HUGEPAGE_SIZE - 1) &
+				~(SNIC_HUGEPAGE_SIZE - 1));
+		madvise(base, len, MADV_HUGEPAGE);
+	}
+
+	/* before the pages are touched below */
+	p->node = snic_cpu_node(cpu);
+	if (p->node >= 0 && p->node < sizeof(mask) * 8) {
+		mask = 1UL << p->node;
+		if (syscall(SYS_mbind, base, len, MPOL_PREFERRED, &mask,
+			    sizeof(mask) * 8 + 1, 0) < 0) {
+			perror("mbind");
+			p->node = -1;
 		}
+	} else
+		p->node = -1;
+
+	for (n = nbufs - 1; n >= 0; n--) {
+		pb = (struct snic_pktbuf *)base + n;
+		pb->next = p->free;
+		p->free = pb;
+	}
+	p->nbufs = nbufs;
+
+	printf("packet pool: %d buffers, %zu MB on %s, node %d\n", nbufs,
+	       len >> 20, p->hugetlb ? "hugepages" : "THP", p->node);
+
+	return 0;
+}
+
+/* move buffers between the central free list and the cache of this
+ * thread, until the cache has n buffers */
+static void snic_pool_exchange(struct snic_pool_cache *c, int n)
+{
+	struct snic_pool *p = &snic_pool;
+	struct snic_pktbuf *pb;
+
+	pthread_mutex_lock(&p->lock);
+	while (c->n < n && p->free) {
+		c->bufs[c->n++] = p->free;
+		p->free = p->free->next;
+	}
+	while (c->n > n) {
+		pb = c->bufs[--c->n];
+		pb->next = p->free;
+		p->free = pb;
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* returns NULL if the pool is exhausted */
+static struct snic_pktbuf *snic_pktbuf_alloc(void)
+{
+	struct snic_pool_cache *c = &snic_pool_cache;
+
+	if (c->n == 0)
+		snic_pool_exchange(c, SNIC_POOL_BATCH);
+	if (c->n == 0)
+		return NULL;
+
+	return c->bufs[--c->n];
+}
+
+static void snic_pktbuf_free(struct snic_pktbuf *pb)
+{
+	struct snic_pool_cache *c = &snic_pool_cache;
 
-		printf("TX: pkt length is %lu, addr is %#lx\n",
-		       desc.length, desc.addr);
+	if (c->n == SNIC_POOL_CACHE)
+		snic_pool_exchange(c, SNIC_POOL_CACHE - SNIC_POOL_BATCH);
+	c->bufs[c->n++] = pb;
+}
+
+/* spin count before sleeping on a shm ring */
+#define SNIC_SHM_SPIN		4096
+
+/* NetTLP carries TLPs over UDP, and a MRd or its completion may be
+ * lost. A DMA read that fails or times out (after SNIC_DMA_TIMEOUT on
+ * the shm transport, and after the timeout of libtlp otherwise) is
+ * retried up to SNIC_DMA_RETRIES times before the caller sees the
+ * error. MWr is posted, and lost ones are recovered by the driver. */
+#define SNIC_DMA_TIMEOUT	100	/* msec */
+#define SNIC_DMA_RETRIES	3
+
+/* DMA read over the shm transport. Called with SNIC_DMA_LOCK, so that
+ * only one MRd is outstanding and this thread owns the cpl ring. */
+static ssize_t snic_shm_dma_read(struct nettlp_snic *snic, uintptr_t addr,
+				 void *buf, size_t count)
+{
+	int wait;
+	size_t done = 0, len;
+	struct nettlp_shm_ent *e;
+
+	while (done < count) {
+		len = count - done;
+		if (len > NETTLP_SHM_MAX_PAYLOAD)
+			len = NETTLP_SHM_MAX_PAYLOAD;
 
-		/* 3. read packet from the pointer in the tx descriptor */
-		SNIC_DMA_LOCK(snic);
-		ret = dma_read(&snic->nt, desc.addr, buf, desc.length);
-		SNIC_DMA_UNLOCK(snic);
-		if (ret < desc.length) {
-			fprintf(stderr, "failed to read tx pkt form %#lx, "
-				"%lu-byte\n", desc.addr, desc.length);
-			goto tx_end;
+		pthread_mutex_lock(&snic->shm_lock);
+		e = nettlp_shm_ring_reserve(&snic->shm->req);
+		e->type = NETTLP_SHM_MRD;
+		e->addr = addr + done;
+		e->len = len;
+		nettlp_shm_ring_push(&snic->shm->req);
+		pthread_mutex_unlock(&snic->shm_lock);
+
+		for (wait = 0; ; wait += 10) {
+			e = nettlp_shm_ring_wait(&snic->shm->cpl,
+						 SNIC_SHM_SPIN, 10);
+			if (e && e->addr != addr + done) {
+				/* late one for a read that timed out */
+				nettlp_shm_ring_pop(&snic->shm->cpl);
+				continue;
+			}
+			if (e)
+				break;
+			if (caught_signal || wait >= SNIC_DMA_TIMEOUT) {
+				errno = ETIMEDOUT;
+				return done ? (ssize_t)done : -1;
+			}
 		}
 
-		/* 3.5 ok, we got the packet to be xmitted. xmit to tap */
-		ret = write(snic->fd, buf, desc.length);
-		if (ret < 0) {
-			fprintf(stderr, "failed to tx pkt to tap\n");
-			perror("write");
-			goto tx_end;
+		if (e->status < 0 || e->len != len) {
+			errno = e->status < 0 ? -e->status : EIO;
+			nettlp_shm_ring_pop(&snic->shm->cpl);
+			return done ? (ssize_t)done : -1;
 		}
 
-	tx_end:
-		/* 4. Generate TX interrupt */
-		printf("TX: generate interrupt to %#lx\n", snic->tx_irq.addr);
-		ret = dma_write(nt, snic->tx_irq.addr, &snic->tx_irq.data,
-				sizeof(snic->tx_irq.data));
-		if (ret < 0) {
-			fprintf(stderr, "failed to send TX interrupt\n");
-			perror("dma_write");
+		memcpy(buf + done, e->data, len);
+		nettlp_shm_ring_pop(&snic->shm->cpl);
+		done += len;
+	}
+
+	return done;
+}
+
+/* DMA write over the shm transport. MWr is posted */
+static ssize_t snic_shm_dma_write(struct nettlp_snic *snic, uintptr_t addr,
+				  void *buf, size_t count)
+{
+	size_t done = 0, len;
+	struct nettlp_shm_ent *e;
+
+	pthread_mutex_lock(&snic->shm_lock);
+	while (done < count) {
+		len = count - done;
+		if (len > NETTLP_SHM_MAX_PAYLOAD)
+			len = NETTLP_SHM_MAX_PAYLOAD;
+
+		e = nettlp_shm_ring_reserve(&snic->shm->req);
+		e->type = NETTLP_SHM_MWR;
+		e->addr = addr + done;
+		e->len = len;
+		memcpy(e->data, buf + done, len);
+		nettlp_shm_ring_push(&snic->shm->req);
+		done += len;
+	}
+	pthread_mutex_unlock(&snic->shm_lock);
+
+	return done;
+}
+
+/* TLP capture to pcapng (-p), see nettlp_pcap.h. Threads issuing or
+ * receiving TLPs copy them to a ring under a spinlock, and a writer
+ * thread drains the ring to the file, so that file I/O is never on
+ * the packet path. TLPs are dropped and counted if the ring is full. */
+#define SNIC_PCAP_RING_LEN	4096	/* must be power of 2 */
+#define SNIC_PCAP_SNAPLEN	128
+
+struct snic_pcap_ent {
+	uint64_t ts;		/* now_ns() */
+	uint32_t ifid;		/* instance id */
+	uint32_t flags;		/* NETTLP_PCAP_INBOUND or OUTBOUND */
+	uint32_t caplen;
+	uint32_t origlen;
+	uint8_t data[SNIC_PCAP_SNAPLEN];
+};
+
+struct snic_pcap {
+	FILE *fp;		/* NULL if capture is disabled */
+	pthread_t tid;
+	pthread_spinlock_t lock;
+	uint64_t ts_offset;	/* CLOCK_REALTIME - now_ns() */
+	uint16_t seq;
+	uint64_t drops;
+
+	uint32_t prod;
+	uint32_t cons;
+	struct snic_pcap_ent ring[SNIC_PCAP_RING_LEN];
+};
+
+static struct snic_pcap snic_pcap;
+
+static void snic_pcap_tlp(struct nettlp_snic *snic, uint64_t ts, int dir,
+			  void *hdr, int hlen, void *data, uint32_t len)
+{
+	struct snic_pcap *pc = &snic_pcap;
+	struct snic_pcap_ent *e;
+	struct nettlp_hdr *nh;
+	uint32_t n;
+
+	pthread_spin_lock(&pc->lock);
+	if (pc->prod - __atomic_load_n(&pc->cons, __ATOMIC_ACQUIRE) ==
+	    SNIC_PCAP_RING_LEN) {
+		pc->drops++;
+		pthread_spin_unlock(&pc->lock);
+		return;
+	}
+
+	e = &pc->ring[pc->prod & (SNIC_PCAP_RING_LEN - 1)];
+	e->ts = ts;
+	e->ifid = snic->id;
+	e->flags = dir;
+
+	nh = (struct nettlp_hdr *)e->data;
+	nh->seq = htons(pc->seq++);
+	nh->tstamp = htonl(ts & 0xffffffff);
+	memcpy(e->data + NETTLP_PCAP_NETTLP_HDR, hdr, hlen);
+
+	n = SNIC_PCAP_SNAPLEN - NETTLP_PCAP_NETTLP_HDR - hlen;
+	if (!data)
+		n = 0;
+	else if (n > len)
+		n = len;
+	memcpy(e->data + NETTLP_PCAP_NETTLP_HDR + hlen, data, n);
+	e->caplen = NETTLP_PCAP_NETTLP_HDR + hlen + n;
+	e->origlen = NETTLP_PCAP_NETTLP_HDR + hlen + len;
+
+	__atomic_store_n(&pc->prod, pc->prod + 1, __ATOMIC_RELEASE);
+	pthread_spin_unlock(&pc->lock);
+}
+
+/* capture a DMA issued by the device, and its completion for read */
+static void snic_pcap_dma(struct nettlp_snic *snic, struct nettlp *nt,
+			  int write, uint64_t start, uint64_t end,
+			  uintptr_t addr, void *buf, size_t count, ssize_t ret)
+{
+	uint8_t hdr[NETTLP_PCAP_TLP_HDR_MAX];
+	int hlen;
+
+	hlen = nettlp_tlp_build_mr(hdr, write, nt->requester, nt->tag,
+				   addr, count);
+	snic_pcap_tlp(snic, start, NETTLP_PCAP_OUTBOUND, hdr, hlen,
+		      write ? buf : NULL, write ? count : 0);
+
+	if (write || ret < (ssize_t)count)
+		return;
+
+	hlen = nettlp_tlp_build_cpld(hdr, nt->requester, nt->tag, addr,
+				     count);
+	snic_pcap_tlp(snic, end, NETTLP_PCAP_INBOUND, hdr, hlen, buf, count);
+}
+
+void *snic_pcap_writer_thread(void *arg)
+{
+	struct snic_pcap *pc = arg;
+	struct snic_pcap_ent *e;
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+	uint32_t prod;
+	uint64_t written = 0;
+
+	while (1) {
+		prod = __atomic_load_n(&pc->prod, __ATOMIC_ACQUIRE);
+		if (pc->cons == prod) {
+			if (caught_signal)
+				break;
+			nanosleep(&ts, NULL);
+			continue;
+		}
+
+		for (; pc->cons != prod; written++) {
+			e = &pc->ring[pc->cons & (SNIC_PCAP_RING_LEN - 1)];
+			if (pcapng_write_epb(pc->fp, e->ifid,
+					     e->ts + pc->ts_offset, e->flags,
+					     e->data, e->caplen,
+					     e->origlen) < 0) {
+				perror("pcapng_write_epb");
+				caught_signal = 1;
+			}
+			__atomic_store_n(&pc->cons, pc->cons + 1,
+					 __ATOMIC_RELEASE);
 		}
+	}
 
-		printf("TX done\n\n");
+	fclose(pc->fp);
+	printf("pcap: %lu TLPs captured, %lu dropped\n", written, pc->drops);
 
-	} else if (is_mwr_addr_rx_index_ptr(snic->bar4_start, dma_addr)) {
+	return NULL;
+}
 
-		if (snic->rx_desc_base == 0) {
-			fprintf(stderr, "rx_desc_base is 0\n");
-			return -1;
+static int snic_pcap_start(struct snic_daemon *d, char *path)
+{
+	int n;
+	struct snic_pcap *pc = &snic_pcap;
+	struct timespec rt;
+
+	pc->fp = fopen(path, "w");
+	if (!pc->fp) {
+		perror("fopen");
+		return -1;
+	}
+	setvbuf(pc->fp, NULL, _IOFBF, 1 << 20);
+
+	if (pcapng_write_shb(pc->fp) < 0)
+		goto err;
+	for (n = 0; n < d->ninst; n++) {
+		if (pcapng_write_idb(pc->fp, d->inst[n]->ifname,
+				     SNIC_PCAP_SNAPLEN) < 0)
+			goto err;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &rt);
+	pc->ts_offset = rt.tv_sec * 1000000000ULL + rt.tv_nsec - now_ns();
+	pthread_spin_init(&pc->lock, PTHREAD_PROCESS_PRIVATE);
+
+	if (pthread_create(&pc->tid, NULL, snic_pcap_writer_thread, pc) != 0)
+		goto err;
+
+	printf("capture TLPs to %s\n", path);
+	return 0;
+
+err:
+	perror("pcap");
+	fclose(pc->fp);
+	pc->fp = NULL;
+	return -1;
+}
+
+/* DMA read through nt, recording the latency. snic->nt and the shm
+ * transport are shared among threads, and used under the lock */
+static ssize_t snic_dma_read_nt(struct nettlp_snic *snic, struct nettlp *nt,
+				uintptr_t addr, void *buf, size_t count)
+{
+	int n;
+	char dummy[64];
+	ssize_t ret;
+	uint64_t start, lat;
+	int locked = (snic->shm || nt == &snic->nt);
+
+	for (n = 0; n <= SNIC_DMA_RETRIES; n++) {
+		if (n > 0)
+			SNIC_STAT_INC(snic, 0, dma_read_retries);
+
+		if (locked)
+			SNIC_DMA_LOCK(snic);
+		/* drop completions of the read that timed out, not to
+		 * take them for this one */
+		while (n > 0 && !snic->shm &&
+		       recv(nt->sockfd, dummy, sizeof(dummy),
+			    MSG_DONTWAIT) > 0)
+			;
+		start = now_ns();
+		if (snic->shm)
+			ret = snic_shm_dma_read(snic, addr, buf, count);
+		else
+			ret = dma_read(nt, addr, buf, count);
+		lat = now_ns() - start;
+		if (locked)
+			SNIC_DMA_UNLOCK(snic);
+
+		if (snic_pcap.fp)
+			snic_pcap_dma(snic, locked ? &snic->nt : nt, 0, start,
+				      start + lat, addr, buf, count, ret);
+
+		if (ret == (ssize_t)count || caught_signal)
+			break;
+	}
+
+	if (ret < (ssize_t)count) {
+		SNIC_STAT_INC(snic, 0, dma_read_errors);
+		return ret;
+	}
+
+	__atomic_fetch_add(&snic->stats.dma_read_lat[snic_lat_hist_index(lat)],
+			   1, __ATOMIC_RELAXED);
+	return ret;
+}
+
+static ssize_t snic_dma_read(struct nettlp_snic *snic, uintptr_t addr,
+			     void *buf, size_t count)
+{
+	return snic_dma_read_nt(snic, &snic->nt, addr, buf, count);
+}
+
+static ssize_t snic_dma_write(struct nettlp_snic *snic, struct nettlp *nt,
+			      uintptr_t addr, void *buf, size_t count)
+{
+	ssize_t ret;
+	uint64_t start = snic_pcap.fp ? now_ns() : 0;
+
+	if (snic->shm)
+		ret = snic_shm_dma_write(snic, addr, buf, count);
+	else
+		ret = dma_write(nt, addr, buf, count);
+	if (snic_pcap.fp)
+		snic_pcap_dma(snic, snic->shm ? &snic->nt : nt, 1, start, 0,
+			      addr, buf, count, ret);
+	if (ret < (ssize_t)count)
+		SNIC_STAT_INC(snic, 0, dma_write_errors);
+
+	return ret;
+}
+
+
+/* features this device implements */
+#define SNIC_FEATURES		(SNIC_F_PACKED_RING | SNIC_F_HDR_SPLIT | \
+				 SNIC_F_LRO | SNIC_F_RXCSUM | SNIC_F_VLAN_STRIP)
+
+/* descriptors fetched by one DMA read: 64 bytes */
+#define SNIC_DESC_BATCH		4
+
+#define desc_addr(base, idx)	((base) + sizeof(struct descriptor) * (idx))
+
+
+/* mark a descriptor done in the format of the ring mode */
+static inline void snic_desc_done(struct nettlp_snic *snic,
+				  struct descriptor *d, int wrap)
+{
+	d->flags |= SNIC_DESC_F_DD;
+	if (snic->packed)
+		d->flags = ((d->flags & ~(SNIC_DESC_F_AVAIL |
+					  SNIC_DESC_F_USED)) |
+			    snic_pdesc_used_flags(wrap));
+}
+
+static int snic_irq_send(struct nettlp_snic *snic, struct nettlp *nt,
+			 uint32_t vec)
+{
+	int ret;
+	struct nettlp_msix *irq;
+
+	irq = (vec == SNIC_IRQ_TX) ? &snic->tx_irq : &snic->rx_irq;
+	pr_pkt("generate %s interrupt to %#lx\n",
+	       vec == SNIC_IRQ_TX ? "TX" : "RX", irq->addr);
+
+	ret = snic_dma_write(snic, nt, irq->addr, &irq->data,
+			     sizeof(irq->data));
+	if (ret < 0) {
+		fprintf(stderr, "failed to send %s interrupt\n",
+			vec == SNIC_IRQ_TX ? "TX" : "RX");
+		perror("dma_write");
+	} else if (vec == SNIC_IRQ_TX)
+		SNIC_STAT_INC(snic, 0, tx_irqs);
+	else
+		SNIC_STAT_INC(snic, 0, rx_irqs);
+
+	return ret;
+}
+
+/* Generate the interrupt vec (SNIC_IRQ_TX or RX) unless the driver
+ * masks it. A masked interrupt is left pending. Either this or the
+ * unmask in nettlp_snic_bar4_write claims a pending interrupt, so that
+ * it is sent exactly once. Returns 0 if left pending. */
+static int snic_irq(struct nettlp_snic *snic, struct nettlp *nt,
+		   uint32_t vec)
+{
+	if (__atomic_load_n(&snic->irq_mask, __ATOMIC_SEQ_CST) & vec) {
+		__atomic_fetch_or(&snic->irq_pending, vec, __ATOMIC_SEQ_CST);
+
+		/* recheck not to miss an unmask raced with this */
+		if ((__atomic_load_n(&snic->irq_mask, __ATOMIC_SEQ_CST) &
+		     vec) ||
+		    !(__atomic_fetch_and(&snic->irq_pending, ~vec,
+					 __ATOMIC_SEQ_CST) & vec)) {
+			SNIC_STAT_INC(snic, 0, irqs_masked);
+			return 0;
 		}
+	}
+
+	return snic_irq_send(snic, nt, vec);
+}
+
+/* advance a ring index by n, flipping the wrap counter on wrap */
+static inline uint32_t snic_ring_advance(uint32_t idx, int n, int *wrap)
+{
+	idx += n;
+	if (idx >= SNIC_DESC_RING_LEN) {
+		idx -= SNIC_DESC_RING_LEN;
+		*wrap = !*wrap;
+	}
+	return idx;
+}
+
+/* step 3.5 of TX: transmit a packet to the tap, inserting the VLAN
+ * tag of the descriptor */
+static int snic_tap_write(struct nettlp_snic *snic, struct descriptor *d,
+			  char *pkt)
+{
+	uint16_t tag[2];
+	struct iovec iov[3];
+
+	if (!(d->flags & SNIC_DESC_F_VLAN) || d->length < 12)
+		return write(snic->fd, pkt, d->length);
+
+	tag[0] = htons(ETHERTYPE_VLAN);
+	tag[1] = htons(d->vlan);
+	iov[0].iov_base = pkt;
+	iov[0].iov_len = 12;
+	iov[1].iov_base = tag;
+	iov[1].iov_len = sizeof(tag);
+	iov[2].iov_base = pkt + 12;
+	iov[2].iov_len = d->length - 12;
+
+	return writev(snic->fd, iov, 3);
+}
+
+/* Process TX descriptors from tx_head to tx_tail, or while they are
+ * available in the packed ring mode. Descriptors are fetched up to
+ * SNIC_DESC_BATCH at once, written back as done by one DMA write,
+ * and then one TX interrupt is generated for the batch. Called with
+ * tx_mutex held. */
+static void nettlp_snic_tx(struct nettlp_snic *snic, struct nettlp *nt)
+{
+	int ret, n, batch;
+	uint32_t head, tail;
+	uintptr_t addr;
+	struct descriptor desc[SNIC_DESC_BATCH], *d;
+	uint64_t ts[SNIC_DESC_BATCH][SNIC_TS_STEPS];
+	struct snic_pktbuf *pb;
+	char *buf;
+
+	/* descriptors stay posted until the next doorbell */
+	pb = snic_pktbuf_alloc();
+	if (!pb) {
+		fprintf(stderr, "packet pool exhausted\n");
+		return;
+	}
+	buf = pb->data;
+
+	while (1) {
+		ts[0][0] = __atomic_load_n(&snic->tx_db_ts, __ATOMIC_RELAXED);
+		head = snic->tx_head;
+		tail = __atomic_load_n(&snic->tx_tail, __ATOMIC_ACQUIRE);
+		if (!snic->packed && head == tail)
+			break;
+
+		/* do not cross the end of the ring. in the packed ring
+		 * mode, the tail is unknown until descriptors are read */
+		batch = snic->packed ? SNIC_DESC_BATCH :
+			snic_ring_count(head, tail);
+		if (batch > SNIC_DESC_BATCH)
+			batch = SNIC_DESC_BATCH;
+		if (batch > SNIC_DESC_RING_LEN - head)
+			batch = SNIC_DESC_RING_LEN - head;
+
+		/* 2. Read tx descriptors from the specified address */
+		addr = desc_addr(snic->tx_desc_base, head);
+		pr_pkt("TX: head %u, tail %u, read %d desc from %#lx\n",
+		       head, tail, batch, addr);
+
+		ret = snic_dma_read(snic, addr, desc, sizeof(*d) * batch);
+		if (ret < (int)(sizeof(*d) * batch)) {
+			fprintf(stderr, "failed to read tx desc from %#lx\n",
+				addr);
+			/* availability is unknown. retry on next doorbell */
+			if (snic->packed)
+				break;
+			SNIC_STAT_ADD(snic, 0, tx_drops, batch);
+			/* skip them to avoid stalling the ring */
+			memset(desc, 0, sizeof(*d) * batch);
+			goto writeback;
+		}
+
+		if (snic->packed) {
+			/* process only available descriptors in order */
+			for (n = 0; n < batch; n++) {
+				if (!snic_pdesc_is_avail(desc[n].flags,
+							 snic->tx_wrap))
+					break;
+			}
+			if (n == 0)
+				break;
+			batch = n;
+		}
+		SNIC_STAT_ADD(snic, 0, tx_desc_fetched, batch);
+		ts[0][1] = snic_ts_now(snic);
+
+		for (n = 0; n < batch; n++) {
+			d = &desc[n];
+			ts[n][0] = ts[0][0];
+			ts[n][1] = ts[0][1];
+			ts[n][3] = 0;	/* not transmitted */
+
+			pr_pkt("TX: pkt length is %u, addr is %#lx\n",
+			       d->length, d->addr);
+
+			if (d->length > SNIC_PKTBUF_SIZE) {
+				fprintf(stderr, "too long tx pkt %u-byte\n",
+					d->length);
+				SNIC_STAT_INC(snic, 0, tx_drops);
+				continue;
+			}
+
+			/* 3. read packet from the pointer in the desc */
+			ret = snic_dma_read(snic, d->addr, buf, d->length);
+			if (ret < d->length) {
+				fprintf(stderr, "failed to read tx pkt form "
+					"%#lx, %u-byte\n", d->addr, d->length);
+				SNIC_STAT_INC(snic, 0, tx_drops);
+				continue;
+			}
+			ts[n][2] = snic_ts_now(snic);
+
+			/* 3.5 ok, we got the packet to be xmitted.
+			 * xmit to tap */
+			ret = snic_tap_write(snic, d, buf);
+			if (ret < 0) {
+				fprintf(stderr, "failed to tx pkt to tap\n");
+				perror("write");
+				SNIC_STAT_INC(snic, 0, tx_drops);
+				continue;
+			}
+			SNIC_STAT_INC(snic, 0, tx_packets);
+			SNIC_STAT_ADD(snic, 0, tx_bytes, d->length);
+			ts[n][3] = snic_ts_now(snic);
+		}
+
+	writeback:
+		/* 3.9 write back the descriptors as done */
+		for (n = 0; n < batch; n++)
+			snic_desc_done(snic, &desc[n], snic->tx_wrap);
+		ret = snic_dma_write(snic, nt, addr, desc, sizeof(*d) * batch);
+		if (ret < 0)
+			fprintf(stderr, "failed to write back tx desc to "
+				"%#lx\n", addr);
+
+		snic->tx_head = snic_ring_advance(head, batch, &snic->tx_wrap);
+
+		/* 4. Generate TX interrupt */
+		ret = snic_irq(snic, nt, SNIC_IRQ_TX);
+
+		if (snic->timestamps && ret >= 0) {
+			for (n = 0; n < batch; n++) {
+				if (!ts[n][3])
+					continue;
+				ts[n][4] = snic_ts_now(snic);
+				snic_ts_record(snic->ts.tx, ts[n]);
+			}
+		}
+
+		pr_pkt("TX done\n\n");
+	}
+
+	snic_pktbuf_free(pb);
+}
+
+static void snic_pin_cpu(int cpu, const char *name)
+{
+	int ret;
+	cpu_set_t cpus;
+
+	if (cpu < 0)
+		return;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (ret != 0)
+		fprintf(stderr, "failed to pin %s thread to cpu %d: %s\n",
+			name, cpu, strerror(ret));
+}
+
+static uint32_t snic_ev_read(struct snic_txp_event *ev)
+{
+	return __atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE);
+}
+
+static void snic_ev_signal(struct snic_txp_event *ev)
+{
+	__atomic_fetch_add(&ev->seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ev->waiters, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &ev->seq, FUTEX_WAKE_PRIVATE, INT_MAX,
+			NULL, NULL, 0);
+}
+
+/* wait until the event is signaled after old is read */
+static void snic_ev_wait(struct snic_txp_event *ev, uint32_t old)
+{
+	int n;
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+
+	for (n = 0; n < SNIC_TXP_SPIN; n++) {
+		if (snic_ev_read(ev) != old)
+			return;
+		cpu_relax();
+	}
+
+	/* timeout to check caught_signal */
+	__atomic_fetch_add(&ev->waiters, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ev->seq, __ATOMIC_SEQ_CST) == old)
+		syscall(SYS_futex, &ev->seq, FUTEX_WAIT_PRIVATE, old, &ts,
+			NULL, 0);
+	__atomic_fetch_sub(&ev->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+#define txp_slot(txp, seq)	(&(txp)->slots[(seq) & (SNIC_DESC_RING_LEN - 1)])
+
+/* fetch stage: read descriptors into free slots. Called with
+ * tx_mutex held. returns the number of fetched descriptors */
+static int snic_txp_fetch(struct nettlp_snic *snic)
+{
+	int ret, n, batch, total = 0;
+	uint32_t head, tail, seq;
+	uintptr_t addr;
+	struct snic_txp *txp = &snic->txp;
+	struct snic_txp_slot *slot;
+	struct descriptor desc[SNIC_DESC_BATCH];
+	uint64_t db_ts, fetch_ts;
+
+	while (!caught_signal) {
+		db_ts = __atomic_load_n(&snic->tx_db_ts, __ATOMIC_RELAXED);
+		head = txp->fetch_idx;
+		tail = __atomic_load_n(&snic->tx_tail, __ATOMIC_ACQUIRE);
+		if (!snic->packed && head == tail)
+			break;
+
+		seq = txp->fetched;
+		batch = SNIC_DESC_RING_LEN -
+			(seq - __atomic_load_n(&txp->completed,
+					       __ATOMIC_ACQUIRE));
+		if (!snic->packed && snic_ring_count(head, tail) < batch)
+			batch = snic_ring_count(head, tail);
+		if (batch > SNIC_DESC_BATCH)
+			batch = SNIC_DESC_BATCH;
+		if (batch > SNIC_DESC_RING_LEN - head)
+			batch = SNIC_DESC_RING_LEN - head;
+		if (batch == 0)
+			break;	/* no free slot */
+
+		/* 2. Read tx descriptors from the specified address */
+		addr = desc_addr(snic->tx_desc_base, head);
+		ret = snic_dma_read(snic, addr, desc, sizeof(desc[0]) * batch);
+		if (ret < (int)(sizeof(desc[0]) * batch)) {
+			fprintf(stderr, "failed to read tx desc from %#lx\n",
+				addr);
+			if (snic->packed)
+				break;
+			/* skip them to avoid stalling the ring */
+			memset(desc, 0, sizeof(desc[0]) * batch);
+			for (n = 0; n < batch; n++)
+				desc[n].flags = SNIC_DESC_F_EOP;
+			ret = -1;
+		}
+
+		if (snic->packed) {
+			for (n = 0; n < batch; n++) {
+				if (!snic_pdesc_is_avail(desc[n].flags,
+							 txp->fetch_wrap))
+					break;
+			}
+			if (n == 0)
+				break;
+			batch = n;
+		}
+		SNIC_STAT_ADD(snic, 0, tx_desc_fetched, batch);
+		fetch_ts = snic_ts_now(snic);
+
+		for (n = 0; n < batch; n++) {
+			slot = txp_slot(txp, seq + n);
+			slot->ts[0] = db_ts;
+			slot->ts[1] = fetch_ts;
+			slot->desc = desc[n];
+			slot->idx = head + n;
+			slot->wrap = txp->fetch_wrap;
+			slot->drop = (ret < 0);
+			slot->state = SNIC_TXP_FETCHED;
+		}
+
+		txp->fetch_idx = snic_ring_advance(head, batch,
+						   &txp->fetch_wrap);
+		__atomic_store_n(&txp->fetched, seq + batch, __ATOMIC_RELEASE);
+		snic_ev_signal(&txp->ev_fetched);
+		total += batch;
+	}
+
+	return total;
+}
+
+void *snic_txp_fetch_thread(void *arg)
+{
+	uint32_t ev;
+	struct nettlp_snic *snic = arg;
+	struct snic_txp *txp = &snic->txp;
+
+	snic_pin_cpu(txp->cpu, "tx fetch");
+
+	while (!caught_signal) {
+		ev = snic_ev_read(&txp->ev_db);
+
+		pthread_mutex_lock(&snic->tx_mutex);
+		snic_txp_fetch(snic);
+		pthread_mutex_unlock(&snic->tx_mutex);
+
+		snic_ev_wait(&txp->ev_db, ev);
+	}
+
+	return NULL;
+}
+
+/* payload stage: read packets of fetched slots. multiple workers
+ * claim slots, and their reads are outstanding at the same time */
+void *snic_txp_payload_thread(void *arg)
+{
+	int ret;
+	uint32_t ev, seq;
+	struct snic_txp_worker *w = arg;
+	struct nettlp_snic *snic = w->snic;
+	struct snic_txp *txp = &snic->txp;
+	struct snic_txp_slot *slot;
+	struct descriptor *d;
+
+	snic_pin_cpu(txp->cpu < 0 ? -1 : txp->cpu + 1 + w->id, "tx payload");
+
+	while (!caught_signal) {
+		ev = snic_ev_read(&txp->ev_fetched);
+		seq = __atomic_load_n(&txp->claimed, __ATOMIC_ACQUIRE);
+		if (seq == __atomic_load_n(&txp->fetched, __ATOMIC_ACQUIRE)) {
+			snic_ev_wait(&txp->ev_fetched, ev);
+			continue;
+		}
+
+		if (!__atomic_compare_exchange_n(&txp->claimed, &seq, seq + 1,
+						 0, __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE))
+			continue;
+
+		slot = txp_slot(txp, seq);
+		d = &slot->desc;
+
+		if (!slot->drop && d->length > SNIC_PKTBUF_SIZE) {
+			fprintf(stderr, "too long tx pkt %u-byte\n", d->length);
+			slot->drop = 1;
+		}
+
+		/* freed by the backend stage */
+		slot->pb = slot->drop ? NULL : snic_pktbuf_alloc();
+		if (!slot->drop && !slot->pb) {
+			fprintf(stderr, "packet pool exhausted\n");
+			slot->drop = 1;
+		}
+
+		/* 3. read packet from the pointer in the desc */
+		if (!slot->drop) {
+			ret = snic_dma_read_nt(snic, snic->shm ? NULL : &w->nt,
+					       d->addr, slot->pb->data,
+					       d->length);
+			if (ret < d->length) {
+				fprintf(stderr, "failed to read tx pkt form "
+					"%#lx, %u-byte\n", d->addr, d->length);
+				slot->drop = 1;
+			}
+		}
+		slot->ts[2] = snic_ts_now(snic);
+
+		__atomic_store_n(&slot->state, SNIC_TXP_PAYLOAD,
+				 __ATOMIC_RELEASE);
+		snic_ev_signal(&txp->ev_payload);
+	}
+
+	return NULL;
+}
+
+/* backend stage: transmit packets to the tap in the ring order */
+void *snic_txp_backend_thread(void *arg)
+{
+	int ret, n;
+	uint32_t ev;
+	struct nettlp_snic *snic = arg;
+	struct snic_txp *txp = &snic->txp;
+	struct snic_txp_slot *slot;
+
+	snic_pin_cpu(txp->cpu < 0 ? -1 : txp->cpu + 1 + txp->nworkers,
+		     "tx backend");
+
+	while (!caught_signal) {
+		ev = snic_ev_read(&txp->ev_payload);
+
+		for (n = 0; txp->sent !=
+			     __atomic_load_n(&txp->fetched, __ATOMIC_ACQUIRE);
+		     n++) {
+			slot = txp_slot(txp, txp->sent);
+			if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) !=
+			    SNIC_TXP_PAYLOAD)
+				break;
+
+			/* 3.5 ok, we got the packet to be xmitted */
+			if (slot->drop)
+				SNIC_STAT_INC(snic, 0, tx_drops);
+			else {
+				ret = snic_tap_write(snic, &slot->desc,
+						     slot->pb->data);
+				if (ret < 0) {
+					perror("write");
+					SNIC_STAT_INC(snic, 0, tx_drops);
+				} else {
+					SNIC_STAT_INC(snic, 0, tx_packets);
+					SNIC_STAT_ADD(snic, 0, tx_bytes,
+						      slot->desc.length);
+				}
+			}
+			slot->ts[3] = slot->drop ? 0 : snic_ts_now(snic);
+			if (slot->pb) {
+				snic_pktbuf_free(slot->pb);
+				slot->pb = NULL;
+			}
+
+			slot->state = SNIC_TXP_SENT;
+			__atomic_store_n(&txp->sent, txp->sent + 1,
+					 __ATOMIC_RELEASE);
+		}
+
+		if (n)
+			snic_ev_signal(&txp->ev_sent);
+		else
+			snic_ev_wait(&txp->ev_payload, ev);
+	}
+
+	return NULL;
+}
+
+/* completion stage: write back sent descriptors in contiguous
+ * batches, and generate a TX interrupt for them */
+void *snic_txp_complete_thread(void *arg)
+{
+	int ret, n;
+	uint32_t ev, seq, sent, start;
+	uintptr_t addr;
+	struct nettlp_snic *snic = arg;
+	struct snic_txp *txp = &snic->txp;
+	struct snic_txp_slot *slot;
+	struct descriptor desc[SNIC_DESC_BATCH];
+
+	snic_pin_cpu(txp->cpu < 0 ? -1 : txp->cpu + 2 + txp->nworkers,
+		     "tx complete");
+
+	while (!caught_signal) {
+		ev = snic_ev_read(&txp->ev_sent);
+		sent = __atomic_load_n(&txp->sent, __ATOMIC_ACQUIRE);
+		seq = txp->completed;
+		if (seq == sent) {
+			snic_ev_wait(&txp->ev_sent, ev);
+			continue;
+		}
+
+		start = seq;
+		while (seq != sent) {
+			/* 3.9 write back the descriptors as done */
+			slot = txp_slot(txp, seq);
+			addr = desc_addr(snic->tx_desc_base, slot->idx);
+			for (n = 0; n < SNIC_DESC_BATCH && seq + n != sent;
+			     n++) {
+				slot = txp_slot(txp, seq + n);
+				if (n > 0 && slot->idx == 0)
+					break;	/* do not cross the end */
+				desc[n] = slot->desc;
+				snic_desc_done(snic, &desc[n], slot->wrap);
+			}
+
+			ret = snic_dma_write(snic, &snic->nt, addr, desc,
+					     sizeof(desc[0]) * n);
+			if (ret < 0)
+				fprintf(stderr, "failed to write back tx desc "
+					"to %#lx\n", addr);
+
+			snic->tx_head = snic_ring_next(slot->idx);
+			snic->tx_wrap = slot->wrap ^ (snic->tx_head == 0);
+			seq += n;
+		}
+
+		/* 4. Generate TX interrupt */
+		ret = snic_irq(snic, &snic->nt, SNIC_IRQ_TX);
+
+		for (; snic->timestamps && ret >= 0 && start != seq; start++) {
+			slot = txp_slot(txp, start);
+			if (!slot->ts[3])
+				continue;
+			slot->ts[4] = snic_ts_now(snic);
+			snic_ts_record(snic->ts.tx, slot->ts);
+		}
+
+		__atomic_store_n(&txp->completed, seq, __ATOMIC_RELEASE);
+		snic_ev_signal(&txp->ev_db);	/* slots are freed */
+	}
+
+	return NULL;
+}
+
+/* wait for in-flight descriptors, and reset the pipeline. Called
+ * with tx_mutex held on the ring reset */
+static void snic_txp_reset(struct nettlp_snic *snic)
+{
+	struct snic_txp *txp = &snic->txp;
+
+	while (__atomic_load_n(&txp->completed, __ATOMIC_ACQUIRE) !=
+	       txp->fetched && !caught_signal)
+		sched_yield();
+
+	txp->fetch_idx = 0;
+	txp->fetch_wrap = 1;
+}
+
+static int snic_alloc_tag(void);
+
+static int snic_txp_start(struct nettlp_snic *snic)
+{
+	int n, tag;
+	pthread_t tid;
+	struct snic_txp *txp = &snic->txp;
+	struct snic_txp_worker *w;
+
+	txp->slots = calloc(SNIC_DESC_RING_LEN, sizeof(*txp->slots));
+	if (!txp->slots) {
+		perror("calloc");
+		return -1;
+	}
+	txp->fetch_wrap = 1;
+
+	for (n = 0; n < txp->nworkers; n++) {
+		w = &txp->workers[n];
+		w->snic = snic;
+		w->id = n;
+		if (snic->shm)
+			continue;
+
+		tag = snic_alloc_tag();
+		if (tag < 0) {
+			fprintf(stderr, "no TLP tag for TX payload worker\n");
+			return -1;
+		}
+		w->nt = snic->nt;
+		w->nt.tag = tag;
+		if (nettlp_init(&w->nt) < 0) {
+			perror("nettlp_init");
+			return -1;
+		}
+	}
+
+	pthread_create(&tid, NULL, snic_txp_fetch_thread, snic);
+	pthread_detach(tid);
+	for (n = 0; n < txp->nworkers; n++) {
+		pthread_create(&tid, NULL, snic_txp_payload_thread,
+			       &txp->workers[n]);
+		pthread_detach(tid);
+	}
+	pthread_create(&tid, NULL, snic_txp_backend_thread, snic);
+	pthread_detach(tid);
+	pthread_create(&tid, NULL, snic_txp_complete_thread, snic);
+	pthread_detach(tid);
+
+	printf("TX pipeline on %s with %d payload workers\n",
+	       snic->ifname, txp->nworkers);
+
+	return 0;
+}
+
+/* Prefetch posted RX descriptors from rx_fetch into rx_cache by a
+ * single DMA read, if at least min of them are posted or the cache is
+ * empty.
+ * Called with rx_mutex held. */
+static int nettlp_snic_rx_fetch_desc(struct nettlp_snic *snic, int min)
+{
+	int ret, n, wrap;
+	uint32_t off;
+	uintptr_t addr;
+	struct descriptor *d;
+
+	if (snic->rx_desc_base == 0)
+		return -1;
+
+	/* do not cross the end of the cache, which is also the end of
+	 * the ring. in the packed ring mode, the tail is unknown until
+	 * descriptors are read */
+	off = snic->rx_fetch & (SNIC_RX_DESC_CACHE - 1);
+	n = SNIC_RX_DESC_CACHE - snic->rx_cached - snic->rx_wb_pending;
+	if (n > SNIC_RX_DESC_CACHE - off)
+		n = SNIC_RX_DESC_CACHE - off;
+	if (snic->packed) {
+		if (n > SNIC_RX_DESC_PREFETCH)
+			n = SNIC_RX_DESC_PREFETCH;
+	} else if (n > snic_ring_count(snic->rx_fetch, snic->rx_tail))
+		n = snic_ring_count(snic->rx_fetch, snic->rx_tail);
+
+	if (n == 0 || (snic->rx_cached && n < min))
+		return snic->rx_cached ? 0 : -1;
+
+	/* 2. Read descriptors from host */
+	d = &snic->rx_cache[off];
+	addr = desc_addr(snic->rx_desc_base, snic->rx_fetch);
+	ret = snic_dma_read(snic, addr, d, sizeof(*d) * n);
+	if (ret < (int)(sizeof(*d) * n)) {
+		fprintf(stderr, "failed to read rx desc from %#lx\n", addr);
+		return snic->rx_cached ? 0 : -1;
+	}
+
+	if (snic->packed) {
+		/* only leading available descriptors are posted */
+		wrap = snic->rx_fetch_wrap;
+		for (ret = 0; ret < n; ret++) {
+			if (!snic_pdesc_is_avail(d[ret].flags, wrap))
+				break;
+		}
+		n = ret;
+	}
+
+	SNIC_STAT_ADD(snic, 0, rx_desc_fetched, n);
+	pr_pkt("RX desc update: %d desc from idx=%u, %d cached\n", n,
+	       snic->rx_fetch, snic->rx_cached + n);
+
+	/* 2.1. we have new buffers */
+	snic->rx_cached += n;
+	snic->rx_fetch = snic_ring_advance(snic->rx_fetch, n,
+					   &snic->rx_fetch_wrap);
+
+	return snic->rx_cached ? 0 : -1;
+}
+
+/* fields of an exact match rule */
+static const struct snic_flow_match snic_flow_exact = {
+	.saddr = 0xffffffff,
+	.daddr = 0xffffffff,
+	.sport = 0xffff,
+	.dport = 0xffff,
+	.ethertype = 0xffff,
+	.proto = 0xff,
+};
+
+#define SNIC_FLOW_WORDS	(sizeof(struct snic_flow_match) / 8)
+
+static int snic_flow_equal(const struct snic_flow_match *a,
+			   const struct snic_flow_match *b,
+			   const struct snic_flow_match *mask)
+{
+	const uint64_t *x = (void *)a, *y = (void *)b, *m = (void *)mask;
+	uint64_t diff = 0;
+	int n;
+
+	for (n = 0; n < SNIC_FLOW_WORDS; n++)
+		diff |= (x[n] ^ y[n]) & m[n];
+
+	return diff == 0;
+}
+
+static uint32_t snic_flow_hash(const struct snic_flow_match *key)
+{
+	const uint64_t *k = (void *)key, *m = (void *)&snic_flow_exact;
+	uint64_t h = 0;
+	int n;
+
+	for (n = 0; n < SNIC_FLOW_WORDS; n++) {
+		h ^= k[n] & m[n];
+		h *= 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+	}
+
+	return h;
+}
+
+/* extract the fields of a received frame */
+static void snic_flow_key(uint8_t *pkt, int len, struct snic_flow_match *key)
+{
+	int off = sizeof(struct ether_header);
+	struct ether_header *eth = (struct ether_header *)pkt;
+	struct iphdr *ip;
+	uint16_t *ports;
+
+	memset(key, 0, sizeof(*key));
+	if (len < off)
+		return;
+
+	memcpy(key->dmac, eth->ether_dhost, ETH_ALEN);
+	key->ethertype = eth->ether_type;
+	if (key->ethertype == htons(ETHERTYPE_VLAN) && len >= off + 4) {
+		memcpy(&key->vlan, pkt + off, 2);
+		memcpy(&key->ethertype, pkt + off + 2, 2);
+		off += 4;
+	}
+
+	if (key->ethertype != htons(ETHERTYPE_IP) ||
+	    len < off + sizeof(*ip))
+		return;
+
+	ip = (struct iphdr *)(pkt + off);
+	key->saddr = ip->saddr;
+	key->daddr = ip->daddr;
+	key->proto = ip->protocol;
+	off += ip->ihl * 4;
+
+	if ((ip->protocol == IPPROTO_TCP || ip->protocol == IPPROTO_UDP) &&
+	    !(ip->frag_off & htons(IP_MF | IP_OFFMASK)) && len >= off + 4) {
+		ports = (uint16_t *)(pkt + off);
+		key->sport = ports[0];
+		key->dport = ports[1];
+	}
+}
+
+/* the RX queue for a received frame, or -1 to drop it */
+static int snic_flow_steer(struct nettlp_snic *snic, uint8_t *pkt, int len)
+{
+	struct snic_flow_table *ft = &snic->flow;
+	struct snic_flow_match key;
+	struct snic_flow_rule *r;
+	uint32_t h, i;
+	int n, loc = SNIC_FLOW_RULES, action;
+
+	if (!__atomic_load_n(&ft->nrules, __ATOMIC_RELAXED))
+		return 0;
+
+	snic_flow_key(pkt, len, &key);
+	h = snic_flow_hash(&key);
+
+	pthread_rwlock_rdlock(&ft->lock);
+
+	for (i = h; ft->ht[i & (SNIC_FLOW_HT_SIZE - 1)].loc >= 0; i++) {
+		n = ft->ht[i & (SNIC_FLOW_HT_SIZE - 1)].loc;
+		if (ft->ht[i & (SNIC_FLOW_HT_SIZE - 1)].hash == h &&
+		    snic_flow_equal(&key, &ft->rules[n].key,
+				    &snic_flow_exact)) {
+			loc = n;
+			break;
+		}
+	}
+
+	/* a wildcard rule at a lower location precedes */
+	for (n = 0; n < ft->nwild && ft->wild[n] < loc; n++) {
+		r = &ft->rules[ft->wild[n]];
+		if (snic_flow_equal(&key, &r->key, &r->mask)) {
+			loc = ft->wild[n];
+			break;
+		}
+	}
+
+	action = loc < SNIC_FLOW_RULES ? ft->rules[loc].action : 0;
+
+	pthread_rwlock_unlock(&ft->lock);
+
+	if (loc == SNIC_FLOW_RULES)
+		return 0;
+
+	SNIC_STAT_INC(snic, 0, rx_flow_hits);
+	if (action == SNIC_FLOW_DROP) {
+		SNIC_STAT_INC(snic, 0, rx_flow_drops);
+		return -1;
+	}
+
+	return action;
+}
+
+/* rebuild the lookup structures. Called with the write lock held */
+static void snic_flow_rebuild(struct snic_flow_table *ft)
+{
+	struct snic_flow_rule *r;
+	uint32_t h, i;
+	int n;
+
+	ft->nrules = ft->nwild = 0;
+	for (n = 0; n < SNIC_FLOW_HT_SIZE; n++)
+		ft->ht[n].loc = -1;
+
+	for (n = 0; n < SNIC_FLOW_RULES; n++) {
+		r = &ft->rules[n];
+		if (!r->valid)
+			continue;
+		ft->nrules++;
+
+		if (memcmp(&r->mask, &snic_flow_exact, sizeof(r->mask)) != 0) {
+			ft->wild[ft->nwild++] = n;
+			continue;
+		}
+
+		/* the first of duplicated exact rules wins on lookup */
+		h = snic_flow_hash(&r->key);
+		for (i = h; ft->ht[i & (SNIC_FLOW_HT_SIZE - 1)].loc >= 0; i++)
+			;
+		ft->ht[i & (SNIC_FLOW_HT_SIZE - 1)].hash = h;
+		ft->ht[i & (SNIC_FLOW_HT_SIZE - 1)].loc = n;
+	}
+}
+
+static int snic_flow_apply(struct nettlp_snic *snic, struct snic_flow_cmd *cmd)
+{
+	struct snic_flow_table *ft = &snic->flow;
+	struct snic_flow_rule *r;
+	int n;
+
+	if (cmd->op != SNIC_FLOW_CMD_CLEAR && cmd->loc >= SNIC_FLOW_RULES)
+		return -EINVAL;
+	if (cmd->op == SNIC_FLOW_CMD_ADD && cmd->action != SNIC_FLOW_DROP &&
+	    cmd->action >= (uint32_t)snic_nqueues(snic))
+		return -EINVAL;
+
+	pthread_rwlock_wrlock(&ft->lock);
+
+	switch (cmd->op) {
+	case SNIC_FLOW_CMD_ADD:
+		r = &ft->rules[cmd->loc];
+		r->valid = 1;
+		r->action = cmd->action;
+		r->mask = cmd->mask;
+		r->key = cmd->key;
+		for (n = 0; n < SNIC_FLOW_WORDS; n++)
+			((uint64_t *)&r->key)[n] &= ((uint64_t *)&r->mask)[n];
+		break;
+	case SNIC_FLOW_CMD_DEL:
+		ft->rules[cmd->loc].valid = 0;
+		break;
+	case SNIC_FLOW_CMD_CLEAR:
+		for (n = 0; n < SNIC_FLOW_RULES; n++)
+			ft->rules[n].valid = 0;
+		break;
+	default:
+		pthread_rwlock_unlock(&ft->lock);
+		return -EOPNOTSUPP;
+	}
+
+	snic_flow_rebuild(ft);
+	pthread_rwlock_unlock(&ft->lock);
+
+	return 0;
+}
+
+/* read a flow command from the host, run it, and write back the
+ * status */
+static void nettlp_snic_flow_cmd(struct nettlp_snic *snic)
+{
+	int ret;
+	uintptr_t addr = snic->flow_cmd_base;
+	struct snic_flow_cmd cmd;
+
+	if (!addr) {
+		fprintf(stderr, "flow command without flow_cmd_base\n");
+		return;
+	}
+
+	ret = snic_dma_read(snic, addr, &cmd, sizeof(cmd));
+	if (ret < (int)sizeof(cmd)) {
+		fprintf(stderr, "failed to read flow cmd from %#lx\n", addr);
+		return;
+	}
+
+	cmd.status = snic_flow_apply(snic, &cmd);
+	pr_pkt("flow cmd %u loc %u action %#x: %d\n", cmd.op, cmd.loc,
+	       cmd.action, cmd.status);
+
+	addr += offsetof(struct snic_flow_cmd, status);
+	ret = snic_dma_write(snic, &snic->nt, addr, &cmd.status,
+			     sizeof(cmd.status));
+	if (ret < 0)
+		fprintf(stderr, "failed to write flow cmd status to %#lx\n",
+			addr);
+}
+
+/*
+ * BAR4 registers.
+ *
+ * A write to the control registers is stored to the shadow in
+ * snic->regs, and then the handler of each register the write
+ * completes is called, looked up by the dword offset of its last
+ * dword. Writes to doorbell pages are decoded by the stride to a
+ * queue and a tail register. Handlers get nt the write arrived on,
+ * or NULL on the shm transport.
+ */
+struct snic_reg {
+	uint32_t size;
+	const char *name;
+	int (*handler)(struct nettlp_snic *snic, struct nettlp *nt,
+		       uint64_t val);
+};
+
+static int snic_reg_tx_desc_base(struct nettlp_snic *snic,
+				 struct nettlp *nt, uint64_t val)
+{
+	uint32_t seq;
+
+	/* save tx desc base, and reset the ring */
+	pthread_mutex_lock(&snic->tx_mutex);
+	if (snic->txp.nworkers)
+		snic_txp_reset(snic);
+	snic->tx_desc_base = val;
+	snic->packed = !!(snic->features & SNIC_F_PACKED_RING);
+	snic->tx_head = snic->tx_tail = 0;
+	snic->tx_wrap = 1;
+
+	/* no DMA is in flight on the old ring. tell the driver that
+	 * its buffers can be released */
+	seq = ++snic->stats.tx_reset_seq;
+	if (snic->stats_base &&
+	    snic_dma_write(snic, nt, snic->stats_base +
+			   offsetof(struct snic_stats, tx_reset_seq),
+			   &seq, sizeof(seq)) < 0)
+		fprintf(stderr, "failed to write tx reset seq\n");
+	pthread_mutex_unlock(&snic->tx_mutex);
+	printf("TX desc base is %#lx\n", snic->tx_desc_base);
+
+	return 0;
+}
+
+static int snic_reg_rx_desc_base(struct nettlp_snic *snic,
+				 struct nettlp *nt, uint64_t val)
+{
+	uint32_t seq;
+
+	/* save rx desc base, and reset the ring */
+	pthread_mutex_lock(&snic->rx_mutex);
+	snic->rx_desc_base = val;
+	snic->packed = !!(snic->features & SNIC_F_PACKED_RING);
+	snic->hdr_split = (snic->features & SNIC_F_HDR_SPLIT) &&
+		snic->rx_hdr_base;
+	snic->rx_head = snic->rx_tail = snic->rx_fetch = 0;
+	snic->rx_wrap = snic->rx_fetch_wrap = 1;
+	snic->rx_cached = snic->rx_wb_pending = 0;
+
+	/* no frame is being written to the old buffers */
+	seq = ++snic->stats.rx_reset_seq;
+	if (snic->stats_base &&
+	    snic_dma_write(snic, nt, snic->stats_base +
+			   offsetof(struct snic_stats, rx_reset_seq),
+			   &seq, sizeof(seq)) < 0)
+		fprintf(stderr, "failed to write rx reset seq\n");
+	pthread_mutex_unlock(&snic->rx_mutex);
+	printf("RX desc base is %#lx\n", snic->rx_desc_base);
+
+	return 0;
+}
+
+/* doorbells are ignored until the driver enables the device and
+ * negotiates the descriptor format */
+static int snic_db_ready(struct nettlp_snic *snic, int qn)
+{
+	if (!snic->enabled) {
+		pr_pkt("ignore doorbell while disabled\n");
+		return 0;
+	}
+	if (snic->desc_version != SNIC_DESC_VERSION) {
+		/* do not touch descriptors in unknown format */
+		pr_pkt("ignore doorbell before descriptor version "
+		       "negotiation\n");
+		return 0;
+	}
+	if (qn >= snic_nqueues(snic)) {
+		pr_pkt("ignore doorbell of queue %d\n", qn);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int snic_db_tx(struct nettlp_snic *snic, struct nettlp *nt, int qn,
+		      uint32_t idx)
+{
+	if (!snic_db_ready(snic, qn))
+		return 0;
+
+	if (snic->tx_desc_base == 0) {
+		fprintf(stderr, "tx_desc_base is 0\n");
+		return -1;
+	}
+
+	/* 1. TX tail is updated. start TX process */
+	pr_pkt("TX tail update: idx %u\n", idx);
+	if (snic->timestamps)
+		__atomic_store_n(&snic->tx_db_ts, snic_ts_now(snic),
+				 __ATOMIC_RELAXED);
+	__atomic_store_n(&snic->tx_tail, idx & (SNIC_DESC_RING_LEN - 1),
+			 __ATOMIC_RELEASE);
+
+	/* doorbell stage of the pipeline, kick the fetch stage */
+	if (snic->txp.nworkers) {
+		snic_ev_signal(&snic->txp.ev_db);
+		return 0;
+	}
+
+	/* if another thread is processing the ring, it will see the new
+	 * tail. recheck the tail after unlock not to miss an update
+	 * while holding the lock */
+	do {
+		if (pthread_mutex_trylock(&snic->tx_mutex) != 0)
+			return 0;
+		nettlp_snic_tx(snic, nt);
+		pthread_mutex_unlock(&snic->tx_mutex);
+	} while (snic->tx_head !=
+		 __atomic_load_n(&snic->tx_tail, __ATOMIC_ACQUIRE));
+
+	return 0;
+}
+
+static int snic_db_rx(struct nettlp_snic *snic, struct nettlp *nt, int qn,
+		      uint32_t idx)
+{
+	if (!snic_db_ready(snic, qn))
+		return 0;
+
+	if (snic->rx_desc_base == 0) {
+		fprintf(stderr, "rx_desc_base is 0\n");
+		return -1;
+	}
+
+	/* 1. RX tail is udpated. start RX process */
+	pr_pkt("RX tail update: idx %u\n", idx);
+
+	pthread_mutex_lock(&snic->rx_mutex);
+	snic->rx_tail = idx & (SNIC_DESC_RING_LEN - 1);
+	nettlp_snic_rx_fetch_desc(snic, SNIC_RX_DESC_PREFETCH);
+	pthread_mutex_unlock(&snic->rx_mutex);
+
+	return 0;
+}
+
+static int snic_reg_tx_desc_idx(struct nettlp_snic *snic,
+				struct nettlp *nt, uint64_t val)
+{
+	return snic_db_tx(snic, nt, 0, val);
+}
+
+static int snic_reg_rx_desc_idx(struct nettlp_snic *snic,
+				struct nettlp *nt, uint64_t val)
+{
+	return snic_db_rx(snic, nt, 0, val);
+}
+
+static int snic_reg_enabled(struct nettlp_snic *snic, struct nettlp *nt,
+			    uint64_t val)
+{
+	snic->enabled = !!val;
+	printf("device %s by driver\n", val ? "enabled" : "disabled");
+
+	return 0;
+}
+
+static int snic_reg_desc_version(struct nettlp_snic *snic,
+				 struct nettlp *nt, uint64_t val)
+{
+	snic->desc_version = val;
+	printf("descriptor version is %u\n", snic->desc_version);
+	if (snic->desc_version != SNIC_DESC_VERSION)
+		fprintf(stderr, "unsupported descriptor version %u, "
+			"device supports %u\n", snic->desc_version,
+			SNIC_DESC_VERSION);
+
+	return 0;
+}
+
+static int snic_reg_stats_base(struct nettlp_snic *snic,
+			       struct nettlp *nt, uint64_t val)
+{
+	/* save stats buffer address, 0 stops stats DMA */
+	snic->stats_base = val;
+	printf("stats base is %#lx\n", snic->stats_base);
+
+	return 0;
+}
+
+static int snic_reg_features(struct nettlp_snic *snic, struct nettlp *nt,
+			     uint64_t val)
+{
+	snic->features = val;
+	printf("features requested %#x\n", snic->features);
+	if (snic->features & ~SNIC_FEATURES) {
+		fprintf(stderr, "unsupported features %#x\n",
+			snic->features & ~SNIC_FEATURES);
+		snic->features &= SNIC_FEATURES;
+	}
+
+	return 0;
+}
+
+static int snic_reg_irq_mask(struct nettlp_snic *snic, struct nettlp *nt,
+			     uint64_t val)
+{
+	uint32_t mask = val, pending;
+
+	/* send interrupts left pending while masked */
+	__atomic_store_n(&snic->irq_mask, mask, __ATOMIC_SEQ_CST);
+	pending = __atomic_fetch_and(&snic->irq_pending, mask,
+				     __ATOMIC_SEQ_CST) & ~mask;
+	pr_pkt("irq mask %#x, pending %#x\n", mask, pending);
+	if (pending & SNIC_IRQ_TX)
+		snic_irq_send(snic, nt, SNIC_IRQ_TX);
+	if (pending & SNIC_IRQ_RX)
+		snic_irq_send(snic, nt, SNIC_IRQ_RX);
+
+	return 0;
+}
+
+static int snic_reg_rx_hdr_base(struct nettlp_snic *snic,
+				struct nettlp *nt, uint64_t val)
+{
+	snic->rx_hdr_base = val;
+	printf("RX header buffer base is %#lx\n", snic->rx_hdr_base);
+
+	return 0;
+}
+
+/* a new base comes from a driver that replays its own rules, so the
+ * rules left by the previous one are dropped */
+static int snic_reg_flow_cmd_base(struct nettlp_snic *snic,
+				  struct nettlp *nt, uint64_t val)
+{
+	struct snic_flow_cmd cmd = { .op = SNIC_FLOW_CMD_CLEAR };
+
+	snic->flow_cmd_base = val;
+	printf("flow command base is %#lx\n", snic->flow_cmd_base);
+	snic_flow_apply(snic, &cmd);
+
+	return 0;
+}
+
+static int snic_reg_flow_cmd(struct nettlp_snic *snic, struct nettlp *nt,
+			     uint64_t val)
+{
+	nettlp_snic_flow_cmd(snic);
+
+	return 0;
+}
+
+static int snic_reg_nqueues(struct nettlp_snic *snic, struct nettlp *nt,
+			    uint64_t val)
+{
+	if (val < 1 || val > snic->stats.nqueues) {
+		fprintf(stderr, "driver uses %lu queues, device serves %u\n",
+			val, snic->stats.nqueues);
+		val = val < 1 ? 1 : snic->stats.nqueues;
+	}
+	snic->nqueues = val;
+	printf("driver uses %d queues\n", snic->nqueues);
+
+	return 0;
+}
+
+/* indexed by the dword offset of the last dword of a register */
+#define SNIC_REG(field, fn)						\
+	[(offsetof(struct snic_bar4, field) +				\
+	  sizeof(((struct snic_bar4 *)0)->field)) / 4 - 1] = {		\
+		sizeof(((struct snic_bar4 *)0)->field), #field, fn	\
+	}
+
+static const struct snic_reg snic_regs[sizeof(struct snic_bar4) / 4] = {
+	SNIC_REG(tx_desc_base,	snic_reg_tx_desc_base),
+	SNIC_REG(rx_desc_base,	snic_reg_rx_desc_base),
+	SNIC_REG(tx_desc_idx,	snic_reg_tx_desc_idx),
+	SNIC_REG(rx_desc_idx,	snic_reg_rx_desc_idx),
+	SNIC_REG(enabled,	snic_reg_enabled),
+	SNIC_REG(desc_version,	snic_reg_desc_version),
+	SNIC_REG(stats_base,	snic_reg_stats_base),
+	SNIC_REG(features,	snic_reg_features),
+	SNIC_REG(irq_mask,	snic_reg_irq_mask),
+	SNIC_REG(rx_hdr_base,	snic_reg_rx_hdr_base),
+	SNIC_REG(flow_cmd_base,	snic_reg_flow_cmd_base),
+	SNIC_REG(flow_cmd,	snic_reg_flow_cmd),
+	SNIC_REG(nqueues,	snic_reg_nqueues),
+};
+
+static int snic_db_write(struct nettlp_snic *snic, struct nettlp *nt,
+			 uintptr_t off, void *m, size_t count)
+{
+	int qn, ret = 0;
+	uint32_t n, v;
+
+	off -= SNIC_BAR4_DB_OFFSET;
+	qn = off / SNIC_BAR4_DB_STRIDE;
+	off %= SNIC_BAR4_DB_STRIDE;
+
+	for (n = 0; n < count; n += 4) {
+		memcpy(&v, m + n, sizeof(v));
+		switch (off + n) {
+		case offsetof(struct snic_doorbell, tx_desc_idx):
+			ret |= snic_db_tx(snic, nt, qn, v);
+			break;
+		case offsetof(struct snic_doorbell, rx_desc_idx):
+			ret |= snic_db_rx(snic, nt, qn, v);
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/* handle a write to BAR4 from the host. nt is the context the write
+ * arrived on, or NULL on the shm transport. */
+static int nettlp_snic_bar4_write(struct nettlp_snic *snic,
+				  struct nettlp *nt, uintptr_t dma_addr,
+				  void *m, size_t count)
+{
+	int ret = 0;
+	uint32_t dw, last;
+	uint64_t val;
+	uintptr_t off = dma_addr - snic->bar4_start;
+	const struct snic_reg *r;
+
+	pr_pkt("%s: dma_addr is %#lx, %zu-byte\n", __func__, dma_addr, count);
+
+	if (off >= SNIC_BAR4_DB_OFFSET)
+		return snic_db_write(snic, nt, off, m, count);
+
+	if (off >= sizeof(snic->regs)) {
+		pr_pkt("ignore write to unknown register %#lx\n", off);
+		return 0;
+	}
+	if (off + count > sizeof(snic->regs))
+		count = sizeof(snic->regs) - off;
+
+	memcpy((char *)&snic->regs + off, m, count);
+
+	/* registers whose last dword is written */
+	last = (off + count + 3) / 4;
+	for (dw = off / 4; dw < last; dw++) {
+		r = &snic_regs[dw];
+		if (!r->handler)
+			continue;
+		val = 0;
+		memcpy(&val, (char *)&snic->regs + (dw + 1) * 4 - r->size,
+		       r->size);
+		pr_pkt("register %s is %#lx\n", r->name, val);
+		if (r->handler(snic, nt, val) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/* libtlp callback. dispatch to the instance owning the BAR4 */
+int nettlp_snic_mwr(struct nettlp *nt, struct tlp_mr_hdr *mh,
+		    void *m, size_t count, void *arg)
+{
+	int n;
+	uintptr_t addr = tlp_mr_addr(mh);
+	struct snic_daemon *d = arg;
+	struct nettlp_snic *snic;
+
+	for (n = 0; n < d->ninst; n++) {
+		snic = d->inst[n];
+		if (addr - snic->bar4_start <
+		    SNIC_BAR4_SIZE(SNIC_MAX_QUEUES)) {
+			if (snic_pcap.fp)
+				snic_pcap_tlp(snic, now_ns(),
+					      NETTLP_PCAP_INBOUND, mh,
+					      nettlp_tlp_hdr_len(mh->tlp.fmt_type),
+					      m, count);
+			return nettlp_snic_bar4_write(snic, nt, addr, m,
+						      count);
+		}
+	}
+
+	pr_pkt("%s: no instance for BAR4 address %#lx\n", __func__, addr);
+	return 0;
+}
+
+/* attach to the memfd of the host emulator listening on path */
+static int snic_shm_attach(struct nettlp_snic *snic, char *path)
+{
+	int sock, fd;
+	struct sockaddr_un sun;
+	struct nettlp_shm *shm;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	if (connect(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		perror("connect");
+		close(sock);
+		return -1;
+	}
+
+	fd = nettlp_shm_recv_fd(sock);
+	close(sock);
+	if (fd < 0) {
+		fprintf(stderr, "failed to receive shm fd from %s\n", path);
+		return -1;
+	}
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	if (shm->magic != NETTLP_SHM_MAGIC ||
+	    shm->version != NETTLP_SHM_VERSION) {
+		fprintf(stderr, "invalid shm, magic %#x version %u\n",
+			shm->magic, shm->version);
+		munmap(shm, sizeof(*shm));
+		return -1;
+	}
+
+	snic->shm = shm;
+	return 0;
+}
+
+/* the shm counterpart of nettlp_run_cb: handle BAR4 writes from the
+ * host emulator until a signal is caught */
+static void nettlp_snic_shm_run(struct nettlp_snic *snic)
+{
+	struct nettlp_shm_ent *e;
+	uint8_t hdr[NETTLP_PCAP_TLP_HDR_MAX];
+	int hlen;
+
+	while (!caught_signal) {
+		e = nettlp_shm_ring_wait(&snic->shm->mwr, SNIC_SHM_SPIN, 100);
+		if (!e)
+			continue;
+
+		if (snic_pcap.fp && e->type == NETTLP_SHM_MWR) {
+			hlen = nettlp_tlp_build_mr(hdr, 1, 0, 0, e->addr,
+						   e->len);
+			snic_pcap_tlp(snic, now_ns(), NETTLP_PCAP_INBOUND,
+				      hdr, hlen, e->data, e->len);
+		}
+
+		if (e->type == NETTLP_SHM_MWR)
+			nettlp_snic_bar4_write(snic, NULL, e->addr, e->data,
+					       e->len);
+		nettlp_shm_ring_pop(&snic->shm->mwr);
+	}
+}
+
+
+/* one's complement sum of data added to sum, not folded. With SSE2,
+ * eight 16-bit words are added at a time into 32-bit lanes, which do
+ * not overflow for far longer than a frame. */
+static uint32_t csum_partial(void *data, int len, uint32_t sum)
+{
+	uint8_t *p = data;
+	uint64_t s = sum;
+	uint16_t w;
+#ifdef __SSE2__
+	uint32_t lanes[4];
+	__m128i v, acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+
+	for (; len >= 16; len -= 16, p += 16) {
+		v = _mm_loadu_si128((__m128i *)p);
+		acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+		acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+	}
+	_mm_storeu_si128((__m128i *)lanes, acc);
+	s += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+	for (; len > 1; len -= 2, p += 2) {
+		memcpy(&w, p, sizeof(w));
+		s += w;
+	}
+	if (len)
+		s += *p;
+
+	s = (s >> 32) + (s & 0xFFFFFFFF);
+	s = (s >> 32) + (s & 0xFFFFFFFF);
+
+	return s;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	sum += (sum >> 16);
+
+	return ~sum;
+}
+
+static uint16_t ip_checksum(void *data, int len)
+{
+	return csum_fold(csum_partial(data, len, 0));
+}
+
+/* checksum of a TCP segment of len bytes with the pseudo header. 0 if
+ * the segment has a valid checksum */
+static uint16_t tcp4_checksum(struct iphdr *ip, void *th, int len)
+{
+	uint32_t sum;
+
+	sum = csum_partial(&ip->saddr, 8, 0);
+	sum += htons(IPPROTO_TCP) + htons(len);
+
+	return csum_fold(csum_partial(th, len, sum));
+}
+
+/* validate the IPv4 header and the TCP/UDP checksum of a frame.
+ * returns SNIC_DESC_F_CSUM_OK, SNIC_DESC_F_CSUM_ERR, or 0 if the
+ * frame is not validated */
+static uint16_t snic_rx_csum(uint8_t *pkt, int len)
+{
+	int off = sizeof(struct ether_header), l4len, v4 = 0;
+	uint16_t type = ((struct ether_header *)pkt)->ether_type;
+	uint8_t proto;
+	uint32_t sum;
+	struct iphdr *ip;
+	struct ip6_hdr *ip6;
+	struct udphdr *uh;
+
+	if (len < off)
+		return 0;
+
+	if (type == htons(ETHERTYPE_VLAN)) {
+		if (len < off + 4)
+			return 0;
+		memcpy(&type, pkt + off + 2, sizeof(type));
+		off += 4;
+	}
+
+	switch (ntohs(type)) {
+	case ETHERTYPE_IP:
+		ip = (struct iphdr *)(pkt + off);
+		if (len < off + sizeof(*ip) || ip->ihl < 5 ||
+		    len < off + ip->ihl * 4)
+			return 0;
+		if (ip_checksum(ip, ip->ihl * 4) != 0)
+			return SNIC_DESC_F_CSUM_ERR;
+		l4len = ntohs(ip->tot_len) - ip->ihl * 4;
+		if (l4len < 0 || off + ntohs(ip->tot_len) > len ||
+		    (ip->frag_off & htons(IP_MF | IP_OFFMASK)))
+			return 0;
+		proto = ip->protocol;
+		sum = csum_partial(&ip->saddr, 8, 0);
+		off += ip->ihl * 4;
+		v4 = 1;
+		break;
+	case ETHERTYPE_IPV6:
+		ip6 = (struct ip6_hdr *)(pkt + off);
+		if (len < off + sizeof(*ip6))
+			return 0;
+		l4len = ntohs(ip6->ip6_plen);
+		off += sizeof(*ip6);
+		if (off + l4len > len)
+			return 0;
+		proto = ip6->ip6_nxt;	/* no extension headers */
+		sum = csum_partial(&ip6->ip6_src, 32, 0);
+		break;
+	default:
+		return 0;
+	}
+
+	switch (proto) {
+	case IPPROTO_TCP:
+		if (l4len < sizeof(struct tcphdr))
+			return 0;
+		break;
+	case IPPROTO_UDP:
+		uh = (struct udphdr *)(pkt + off);
+		if (l4len < sizeof(*uh))
+			return 0;
+		if (v4 && uh->check == 0)
+			return SNIC_DESC_F_CSUM_OK;	/* no checksum */
+		break;
+	default:
+		return 0;
+	}
+
+	sum += htons(proto) + htons(l4len);
+	if (csum_fold(csum_partial(pkt + off, l4len, sum)) != 0)
+		return SNIC_DESC_F_CSUM_ERR;
+
+	return SNIC_DESC_F_CSUM_OK;
+}
+
+/* length of L2 to L4 headers to be split, or 0 if unknown */
+static int snic_hdr_len(uint8_t *pkt, int len)
+{
+	int off = sizeof(struct ether_header), proto;
+	uint16_t type = ((struct ether_header *)pkt)->ether_type;
+	struct iphdr *ip;
+
+	if (len < off)
+		return 0;
+
+	if (type == htons(ETHERTYPE_VLAN)) {
+		if (len < off + 4)
+			return 0;
+		memcpy(&type, pkt + off + 2, sizeof(type));
+		off += 4;
+	}
+
+	switch (ntohs(type)) {
+	case ETHERTYPE_IP:
+		if (len < off + sizeof(*ip))
+			return 0;
+		ip = (struct iphdr *)(pkt + off);
+		off += ip->ihl * 4;
+		/* L4 header is only in the first fragment */
+		if (ip->frag_off & htons(IP_MF | IP_OFFMASK))
+			return off <= len ? off : 0;
+		proto = ip->protocol;
+		break;
+	case ETHERTYPE_IPV6:
+		if (len < off + sizeof(struct ip6_hdr))
+			return 0;
+		proto = ((struct ip6_hdr *)(pkt + off))->ip6_nxt;
+		off += sizeof(struct ip6_hdr);
+		break;
+	default:
+		return 0;
+	}
+
+	switch (proto) {
+	case IPPROTO_TCP:
+		if (len < off + sizeof(struct tcphdr))
+			return 0;
+		off += ((struct tcphdr *)(pkt + off))->doff * 4;
+		break;
+	case IPPROTO_UDP:
+		off += sizeof(struct udphdr);
+		break;
+	default:
+		break;	/* split after L3 */
+	}
+
+	return off <= len ? off : 0;
+}
+
+/* steps 4 and 5 of RX: write back the completed RX descriptors by
+ * one DMA write, and generate one RX interrupt for them. Called with
+ * rx_mutex held. */
+static int __nettlp_snic_rx_flush(struct nettlp_snic *snic)
+{
+	int ret, n, i;
+	uint32_t start;
+	uintptr_t addr;
+	struct descriptor *d;
+	uint64_t now;
+
+	n = snic->rx_wb_pending;
+	if (!n)
+		return 0;
+
+	/* pending descriptors do not cross the end of the cache */
+	start = (snic->rx_head - n) & (SNIC_DESC_RING_LEN - 1);
+	d = &snic->rx_cache[start & (SNIC_RX_DESC_CACHE - 1)];
+
+	/* 4. Write back RX descriptors */
+	addr = desc_addr(snic->rx_desc_base, start);
+	pr_pkt("DMA Write %d updated RX desc to host: %#lx\n", n, addr);
+	ret = snic_dma_write(snic, &snic->nt, addr, d, sizeof(*d) * n);
+	if (ret < (int)(sizeof(*d) * n)) {
+		/* keep them pending, and retry on the next flush */
+		fprintf(stderr, "failed to write rx desc to %#lx\n", addr);
+		return -1;
+	}
+	snic->rx_wb_pending = 0;
+
+	now = snic_ts_now(snic);
+	for (i = 0; i < n; i++) {
+		if (d[i].flags & SNIC_DESC_F_EOP)
+			SNIC_STAT_INC(snic, 0, rx_packets);
+		SNIC_STAT_ADD(snic, 0, rx_bytes, d[i].length +
+			      (d[i].flags & SNIC_DESC_F_SPLIT ?
+			       d[i].wb.hdr_len : 0));
+		snic->rx_ts[(start + i) & (SNIC_RX_DESC_CACHE - 1)][3] = now;
+	}
+
+	/* 5. Generate RX interrupt */
+	ret = snic_irq(snic, &snic->nt, SNIC_IRQ_RX);
+	if (ret >= 0 && snic->timestamps) {
+		now = snic_ts_now(snic);
+		for (i = 0; i < n; i++) {
+			uint64_t *ts = snic->rx_ts[(start + i) &
+						   (SNIC_RX_DESC_CACHE - 1)];
+			ts[4] = now;
+			snic_ts_record(snic->ts.rx, ts);
+		}
+	}
+
+	return 0;
+}
+
+int nettlp_snic_rx_flush(struct nettlp_snic *snic)
+{
+	int ret;
+
+	if (!__atomic_load_n(&snic->rx_wb_pending, __ATOMIC_RELAXED))
+		return 0;
+
+	pthread_mutex_lock(&snic->rx_mutex);
+	ret = __nettlp_snic_rx_flush(snic);
+	pthread_mutex_unlock(&snic->rx_mutex);
+
+	return ret;
+}
+
+/* step 3 of RX: DMA a frame to the RX buffers from rx_head on the
+ * host, and complete the descriptors. A frame larger than a buffer
+ * spans multiple descriptors. segs, mss and lro_hlen of a frame
+ * coalesced by LRO are written back in its last descriptor. The descriptors are
+ * written back in a batch, and the caller calls nettlp_snic_rx_flush()
+ * when it has no more packets to deliver for now. A VLAN tag is
+ * stripped in place in buf. */
+static int nettlp_snic_rx_deliver_segs(struct nettlp_snic *snic, void *buf,
+				       int pktlen, int segs, int mss,
+				       int lro_hlen)
+{
+	int ret, hlen = 0, ndesc, n, off, len, left;
+	struct descriptor *d;
+	uintptr_t hdr;
+	uint64_t ts[SNIC_TS_STEPS];
+	uint16_t flags = 0, tci = 0;
+	uint8_t *pkt = buf;
+
+	ts[0] = snic_ts_now(snic);
+
+	/* offloads before the frame is laid out in the buffers */
+	if ((snic->features & SNIC_F_VLAN_STRIP) && pktlen >= 18 &&
+	    ((struct ether_header *)pkt)->ether_type ==
+	    htons(ETHERTYPE_VLAN)) {
+		memcpy(&tci, pkt + 14, sizeof(tci));
+		tci = ntohs(tci);
+		memmove(pkt + 4, pkt, 12);
+		buf = pkt + 4;
+		pktlen -= 4;
+		flags |= SNIC_DESC_F_VLAN;
+	}
+	if (segs > 1)
+		flags |= SNIC_DESC_F_CSUM_OK;	/* verified for each segment */
+	else if (snic->features & SNIC_F_RXCSUM)
+		flags |= snic_rx_csum(buf, pktlen);
+
+	pthread_mutex_lock(&snic->rx_mutex);
+
+	/* small packets go to the header buffer entirely. coalesced
+	 * frames are split after the TCP header */
+	if (snic->hdr_split) {
+		if (segs > 1)
+			hlen = lro_hlen;
+		else
+			hlen = pktlen <= SNIC_RX_HDR_SIZE ? pktlen :
+				snic_hdr_len(buf, pktlen);
+		if (hlen > SNIC_RX_HDR_SIZE)
+			hlen = 0;
+	}
+
+	/* descriptors for the frame, usually prefetched */
+	left = pktlen - hlen;
+	for (ndesc = 0; ndesc == 0 || left > 0; ndesc++) {
+		if (ndesc && ndesc == snic->rx_cached)
+			__nettlp_snic_rx_flush(snic);	/* room in the cache */
+		if (ndesc == snic->rx_cached &&
+		    (nettlp_snic_rx_fetch_desc(snic, ndesc ? 1 :
+					       SNIC_RX_DESC_PREFETCH) < 0 ||
+		     ndesc == snic->rx_cached)) {
+			/* let the driver see completed ones to refill */
+			__nettlp_snic_rx_flush(snic);
+			pr_pkt("RX: no RX buffer for %d-byte packet\n",
+			       pktlen);
+			SNIC_STAT_INC(snic, 0, rx_drops);
+			goto err;
+		}
+		left -= snic->rx_cache[(snic->rx_head + ndesc) &
+				       (SNIC_RX_DESC_CACHE - 1)].length;
+	}
+	ts[1] = snic_ts_now(snic);
+
+	/* 3. DMA the packet to host, the headers to the header buffer
+	 * in the header split mode */
+	if (hlen) {
+		hdr = snic->rx_hdr_base + SNIC_RX_HDR_SIZE * snic->rx_head;
+		pr_pkt("RX: DMA write %d-byte headers to %#lx\n", hlen, hdr);
+		ret = snic_dma_write(snic, &snic->nt, hdr, buf, hlen);
+		if (ret < 0) {
+			fprintf(stderr, "failed to write rx hdr to %#lx\n",
+				hdr);
+			SNIC_STAT_INC(snic, 0, rx_drops);
+			goto err;
+		}
+	}
+
+	for (n = 0, off = hlen; n < ndesc; n++) {
+		d = &snic->rx_cache[snic->rx_head & (SNIC_RX_DESC_CACHE - 1)];
+		len = pktlen - off < d->length ? pktlen - off : d->length;
+
+		if (len > 0) {
+			pr_pkt("RX: DMA write the packet to memory\n");
+			ret = snic_dma_write(snic, &snic->nt, d->addr,
+					     buf + off, len);
+			if (ret < 0) {
+				fprintf(stderr, "failed to write rx pkt to "
+					"%#lx\n", d->addr);
+				/* the rest of a long frame is still
+				 * completed, not to break the ring */
+				if (ndesc == 1) {
+					SNIC_STAT_INC(snic, 0, rx_drops);
+					goto err;
+				}
+			}
+		}
+		off += len;
+		ts[2] = snic_ts_now(snic);
+
+		/* complete the descriptor in the cache, to be written back */
+		d->wb.mss = 0;
+		d->wb.rsv = 0;
+		d->wb.hdr_len = n == 0 ? hlen : 0;
+		d->wb.seg_cnt = 0;
+		d->length = len;
+		if (n == 0 && hlen)
+			d->flags |= SNIC_DESC_F_SPLIT;
+		d->vlan = 0;
+		if (n == ndesc - 1) {
+			d->flags |= SNIC_DESC_F_EOP | flags;
+			d->vlan = tci;
+			if (segs > 1) {
+				d->wb.hdr_len = lro_hlen;
+				d->wb.seg_cnt = segs;
+				d->wb.mss = mss;
+			}
+		}
+		snic_desc_done(snic, d, snic->rx_wrap);
+		memcpy(snic->rx_ts[snic->rx_head & (SNIC_RX_DESC_CACHE - 1)],
+		       ts, sizeof(ts));
+
+		/* the buffer is consumed */
+		snic->rx_head = snic_ring_advance(snic->rx_head, 1,
+						  &snic->rx_wrap);
+		snic->rx_cached--;
+		snic->rx_wb_pending++;
+
+		/* a write back is contiguous within the cache */
+		if (snic->rx_wb_pending >= SNIC_RX_WB_BATCH ||
+		    (snic->rx_head & (SNIC_RX_DESC_CACHE - 1)) == 0)
+			__nettlp_snic_rx_flush(snic);
+	}
+
+	pr_pkt("RX done. DMA write to idx %u %d byte in %d desc\n",
+	       snic->rx_head, pktlen, ndesc);
+	if (segs > 1)
+		SNIC_STAT_ADD(snic, 0, rx_lro_segs, segs);
+
+	/* prefetch the next descriptors, if posted */
+	nettlp_snic_rx_fetch_desc(snic, SNIC_RX_DESC_PREFETCH);
+
+	pthread_mutex_unlock(&snic->rx_mutex);
+	return 0;
+
+err:
+	pthread_mutex_unlock(&snic->rx_mutex);
+	return -1;
+}
+
+int nettlp_snic_rx_deliver(struct nettlp_snic *snic, void *buf, int pktlen)
+{
+	return nettlp_snic_rx_deliver_segs(snic, buf, pktlen, 1, 0, 0);
+}
+
+
+/*
+ * Receive coalescing (SNIC_F_LRO).
+ *
+ * Segments read from the tap back to back are merged per flow before
+ * DMA, so that a burst of segments costs one set of descriptor and
+ * interrupt TLPs, and one skb on the host. A flow is delivered when a
+ * segment does not follow it in order, when a short or pushed segment
+ * ends it, when it is full or times out, or when the tap is drained.
+ *
+ * Only IPv4 TCP segments with payload and a valid checksum, without
+ * IP options or fragments, with no flags other than ACK and PSH, and
+ * with no TCP options other than timestamps are merged. Others flush
+ * their flow and are delivered as is.
+ */
+
+#define lro_ip(pkt)	((struct iphdr *)((pkt) + sizeof(struct ether_header)))
+#define lro_tcp(pkt)	((struct tcphdr *)(lro_ip(pkt) + 1))
+
+/* L2 to L4 header length of a segment that can be merged, or 0 */
+static int snic_lro_hdr_len(uint8_t *pkt, int len)
+{
+	struct ether_header *eth = (struct ether_header *)pkt;
+	struct iphdr *ip = lro_ip(pkt);
+	struct tcphdr *th = lro_tcp(pkt);
+	uint32_t ts_opt = htonl(TCPOPT_NOP << 24 | TCPOPT_NOP << 16 |
+				TCPOPT_TIMESTAMP << 8 | TCPOLEN_TIMESTAMP);
+	int hlen, tot_len;
+
+	if (len < sizeof(*eth) + sizeof(*ip) + sizeof(*th) ||
+	    eth->ether_type != htons(ETHERTYPE_IP))
+		return 0;
+
+	tot_len = ntohs(ip->tot_len);
+	if (ip->ihl != 5 || ip->protocol != IPPROTO_TCP ||
+	    (ip->frag_off & htons(IP_MF | IP_OFFMASK)) ||
+	    sizeof(*eth) + tot_len > len)
+		return 0;
+
+	if (th->syn || th->fin || th->rst || th->urg || th->res2 || !th->ack)
+		return 0;
+
+	/* no options, or NOP NOP timestamp */
+	if (th->doff == 8) {
+		if (memcmp(th + 1, &ts_opt, sizeof(ts_opt)) != 0)
+			return 0;
+	} else if (th->doff != 5)
+		return 0;
+
+	hlen = sizeof(*eth) + sizeof(*ip) + th->doff * 4;
+	if (sizeof(*eth) + tot_len <= hlen)
+		return 0;	/* no payload */
+
+	if (tcp4_checksum(ip, th, tot_len - sizeof(*ip)) != 0)
+		return 0;
+
+	return hlen;
+}
+
+/* the flow the TCP/IPv4 packet belongs to, or NULL */
+static struct snic_lro_flow *snic_lro_find(struct nettlp_snic *snic,
+					   uint8_t *pkt, int len)
+{
+	int n;
+	struct iphdr *ip = lro_ip(pkt), *fip;
+	struct tcphdr *th, *fth;
+	struct snic_lro_flow *f;
+
+	if (len < sizeof(struct ether_header) + sizeof(*ip) ||
+	    ((struct ether_header *)pkt)->ether_type != htons(ETHERTYPE_IP) ||
+	    ip->protocol != IPPROTO_TCP ||
+	    len < sizeof(struct ether_header) + ip->ihl * 4 + 4)
+		return NULL;
+
+	th = (struct tcphdr *)((uint8_t *)ip + ip->ihl * 4);
+
+	for (n = 0; n < SNIC_LRO_FLOWS; n++) {
+		f = &snic->lro[n];
+		fip = lro_ip(f->buf);
+		fth = lro_tcp(f->buf);
+		if (f->len && fip->saddr == ip->saddr &&
+		    fip->daddr == ip->daddr && fth->source == th->source &&
+		    fth->dest == th->dest)
+			return f;
+	}
+
+	return NULL;
+}
+
+/* fix up the headers of merged segments, and deliver them */
+static int snic_lro_flush_flow(struct nettlp_snic *snic,
+			       struct snic_lro_flow *f)
+{
+	int ret, tot_len = f->len - sizeof(struct ether_header);
+	struct iphdr *ip = lro_ip(f->buf);
+	struct tcphdr *th = lro_tcp(f->buf);
+
+	if (!f->len)
+		return 0;
+
+	if (f->segs > 1) {
+		ip->tot_len = htons(tot_len);
+		ip->check = 0;
+		ip->check = ip_checksum(ip, sizeof(*ip));
+		th->check = 0;
+		th->check = tcp4_checksum(ip, th, tot_len - sizeof(*ip));
+	}
+
+	ret = nettlp_snic_rx_deliver_segs(snic, f->buf, f->len, f->segs,
+					  f->mss, f->hlen);
+	f->len = 0;
+
+	return ret;
+}
+
+void nettlp_snic_lro_flush(struct nettlp_snic *snic)
+{
+	int n;
+
+	for (n = 0; n < SNIC_LRO_FLOWS; n++)
+		snic_lro_flush_flow(snic, &snic->lro[n]);
+}
+
+/* whether a segment of the flow follows the merged ones */
+static int snic_lro_follows(struct snic_lro_flow *f, uint8_t *pkt, int hlen,
+			    int plen)
+{
+	struct iphdr *ip = lro_ip(pkt), *fip = lro_ip(f->buf);
+	struct tcphdr *th = lro_tcp(pkt), *fth = lro_tcp(f->buf);
+
+	return hlen == f->hlen && ntohl(th->seq) == f->next_seq &&
+		plen <= f->mss && f->len + plen <= SNIC_LRO_MAX_BYTES &&
+		ip->tos == fip->tos && ip->ttl == fip->ttl &&
+		(int32_t)(ntohl(th->ack_seq) - ntohl(fth->ack_seq)) >= 0;
+}
+
+/* deliver a packet from the tap through the LRO stage */
+int nettlp_snic_rx_lro(struct nettlp_snic *snic, void *buf, int pktlen)
+{
+	int n, hlen, plen;
+	uint8_t *pkt = buf;
+	uint64_t now;
+	struct snic_lro_flow *f, *fl;
+	struct tcphdr *th, *fth;
+
+	if (!(snic->features & SNIC_F_LRO)) {
+		nettlp_snic_lro_flush(snic);
+		return nettlp_snic_rx_deliver(snic, buf, pktlen);
+	}
+
+	now = now_ns();
+	for (n = 0; n < SNIC_LRO_FLOWS; n++) {
+		fl = &snic->lro[n];
+		if (fl->len && now - fl->start >= SNIC_LRO_TIMEOUT)
+			snic_lro_flush_flow(snic, fl);
+	}
+
+	hlen = snic_lro_hdr_len(pkt, pktlen);
+	f = snic_lro_find(snic, pkt, pktlen);
+	if (!hlen) {
+		/* keep the order after merged segments of the flow */
+		if (f)
+			snic_lro_flush_flow(snic, f);
+		return nettlp_snic_rx_deliver(snic, buf, pktlen);
+	}
+
+	th = lro_tcp(pkt);
+	plen = sizeof(struct ether_header) + ntohs(lro_ip(pkt)->tot_len) -
+		hlen;
+
+	if (f && !snic_lro_follows(f, pkt, hlen, plen)) {
+		snic_lro_flush_flow(snic, f);
+		f = NULL;
+	}
+
+	if (f) {
+		/* append the payload, and take the latest ACK, window
+		 * and timestamps */
+		memcpy(f->buf + f->len, pkt + hlen, plen);
+		f->len += plen;
+		f->segs++;
+		f->next_seq += plen;
+
+		fth = lro_tcp(f->buf);
+		fth->ack_seq = th->ack_seq;
+		fth->window = th->window;
+		fth->psh |= th->psh;
+		memcpy(fth + 1, th + 1, th->doff * 4 - sizeof(*th));
+	} else {
+		if (th->psh)
+			return nettlp_snic_rx_deliver(snic, buf, pktlen);
+
+		/* a free flow, or the oldest one */
+		for (n = 0; n < SNIC_LRO_FLOWS; n++) {
+			fl = &snic->lro[n];
+			if (!fl->len) {
+				f = fl;
+				break;
+			}
+			if (!f || fl->start < f->start)
+				f = fl;
+		}
+		snic_lro_flush_flow(snic, f);
+
+		memcpy(f->buf, pkt, hlen + plen);
+		f->len = hlen + plen;
+		f->hlen = hlen;
+		f->segs = 1;
+		f->mss = plen;
+		f->next_seq = ntohl(th->seq) + plen;
+		f->start = now;
+	}
+
+	/* a short or pushed segment ends the burst */
+	if (th->psh || plen < f->mss || f->len + f->mss > SNIC_LRO_MAX_BYTES)
+		return snic_lro_flush_flow(snic, f);
+
+	return 0;
+}
+
+static void snic_pin_thread(struct nettlp_snic *snic, int qn)
+{
+	snic_pin_cpu(snic->rxq[qn].cpu, "RX");
+}
+
+static void snic_worker_account(struct snic_worker *w, int sleep,
+				uint64_t ns)
+{
+	int n;
+
+	/* the time is shared by all instances of the worker */
+	for (n = 0; n < w->n; n++) {
+		if (sleep)
+			SNIC_STAT_ADD(w->snics[n], 0, rx_sleep_ns, ns);
+		else
+			SNIC_STAT_ADD(w->snics[n], 0, rx_busy_poll_ns, ns);
+	}
+}
+
+void *nettlp_snic_worker_thread(void *arg)
+{
+	int n, pktlen, rcvd;
+	char *buf;
+	uint64_t now, last_rx = 0, spin_start = 0, busy_poll = 0;
+	struct snic_worker *w = arg;
+	struct nettlp_snic *snic;
+	struct snic_pktbuf *pb;
+	struct pollfd x[SNIC_MAX_INSTANCES];
+
+	/* This is the actual part of RX. This thread read tap sockets
+	 * of the instances assigned to this worker, and if rx buffer
+	 * is available, DMA Write the packet from the tap to the RX
+	 * buffer on the NetTLP adapter host.
+	 *
+	 * The taps are read in non-blocking mode. For busy_poll usec
+	 * after a packet arrives, this thread keeps spinning on the
+	 * taps, and then it falls back to block in poll(). Spinning
+	 * avoids scheduler wakeup latency under continuous traffic.
+	 */
+
+	snic_pin_thread(w->snics[0], 0);
+
+	/* a packet is DMA'd before the next read, so one buffer is
+	 * enough */
+	pb = snic_pktbuf_alloc();
+	if (!pb) {
+		fprintf(stderr, "packet pool exhausted\n");
+		return NULL;
+	}
+	buf = pb->data;
+
+	for (n = 0; n < w->n; n++) {
+		snic = w->snics[n];
+		x[n].fd = snic->fd;
+		x[n].events = POLLIN;
+		if (snic->rxq[0].busy_poll * 1000ULL > busy_poll)
+			busy_poll = snic->rxq[0].busy_poll * 1000ULL;
+
+		if (fcntl(snic->fd, F_SETFL,
+			  fcntl(snic->fd, F_GETFL) | O_NONBLOCK) < 0) {
+			perror("fcntl");
+			snic_pktbuf_free(pb);
+			return NULL;
+		}
+	}
+
+	while (!caught_signal) {
+
+		/* 2.2. read a packet from each tap interface */
+		rcvd = 0;
+		for (n = 0; n < w->n; n++) {
+			snic = w->snics[n];
+			pktlen = read(snic->fd, buf, SNIC_PKTBUF_SIZE);
+			if (pktlen < 0) {
+				if (errno != EAGAIN)
+					perror("read");
+				/* the tap is drained, complete the batch */
+				nettlp_snic_lro_flush(snic);
+				nettlp_snic_rx_flush(snic);
+				continue;
+			}
+
+			pr_pkt("RX: rcv packet from %s\n", snic->ifname);
+			rcvd++;
+
+			/* drop before spending TLPs on it */
+			if (snic_flow_steer(snic, (uint8_t *)buf, pktlen) < 0)
+				continue;
+			nettlp_snic_rx_lro(snic, buf, pktlen);
+		}
+
+		now = now_ns();
+		if (rcvd) {
+			if (spin_start) {
+				snic_worker_account(w, 0, now - spin_start);
+				spin_start = 0;
+			}
+			last_rx = now;
+			continue;
+		}
+
+		if (now - last_rx < busy_poll) {
+			/* keep spinning on the taps */
+			if (!spin_start)
+				spin_start = now;
+			cpu_relax();
+			continue;
+		}
+
+		if (spin_start) {
+			snic_worker_account(w, 0, now - spin_start);
+			spin_start = 0;
+		}
+
+		/* no traffic, block until the next packet */
+		poll(x, w->n, 500);
+		snic_worker_account(w, 1, now_ns() - now);
+	}
+
+	snic_pktbuf_free(pb);
+
+	return NULL;
+}
+
+
+/*
+ * Synthetic packet generator.
+ *
+ * Instead of reading packets from the tap, the generator thread
+ * builds UDP/IPv4 frames from a template and pushes them into the RX
+ * path. Addresses are taken from a struct snic_bar0 filled by -g
+ * suboptions, so that generated packets look like ones destined to
+ * the host netdev. Packet sizes cycle between min and max, and the
+ * UDP source port cycles over the number of flows.
+ *
+ * In the RX blast mode, the generator waits for the host to post a
+ * new RX buffer instead of dropping the packet, so that the
+ * delivered rate shows how fast the driver can receive packets.
+ */
+
+static void pktgen_build_template(struct snic_pktgen *pg, char *buf)
+{
+	struct ether_header *eth = (struct ether_header *)buf;
+	struct ip *ip = (struct ip *)(eth + 1);
+	struct udphdr *udp = (struct udphdr *)(ip + 1);
+	char *payload = (char *)(udp + 1);
+	int n;
+
+	/* BAR0 MAC addresses are stored in reverse byte order. srcmac
+	 * and srcip are the host side, and dstmac and dstip are the
+	 * device side. */
+	snic_get_mac(eth->ether_dhost, pg->cfg.srcmac);
+	snic_get_mac(eth->ether_shost, pg->cfg.dstmac);
+	eth->ether_type = htons(ETHERTYPE_IP);
+
+	memset(ip, 0, sizeof(*ip));
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_ttl = 64;
+	ip->ip_p = IPPROTO_UDP;
+	ip->ip_src.s_addr = pg->cfg.dstip;
+	ip->ip_dst.s_addr = pg->cfg.srcip;
+
+	udp->uh_sport = htons(PKTGEN_SPORT_BASE);
+	udp->uh_dport = htons(PKTGEN_DPORT);
+	udp->uh_sum = 0;
+
+	for (n = 0; n < PKTGEN_MAX_LEN - PKTGEN_HDR_LEN; n++)
+		payload[n] = n;
+}
+
+static int pktgen_next(struct snic_pktgen *pg, char *buf, uint64_t seq)
+{
+	struct ether_header *eth = (struct ether_header *)buf;
+	struct ip *ip = (struct ip *)(eth + 1);
+	struct udphdr *udp = (struct udphdr *)(ip + 1);
+	int len, range;
+
+	range = pg->max_len - pg->min_len + 1;
+	len = pg->min_len + (seq % range);
+
+	ip->ip_len = htons(len - sizeof(*eth));
+	ip->ip_id = htons(seq);
+	ip->ip_sum = 0;
+	ip->ip_sum = ip_checksum(ip, sizeof(*ip));
+
+	udp->uh_sport = htons(PKTGEN_SPORT_BASE + (seq % pg->nflows));
+	udp->uh_ulen = htons(len - sizeof(*eth) - sizeof(*ip));
+
+	return len;
+}
+
+static void pktgen_report(struct snic_pktgen *pg, uint64_t elapsed,
+			  uint64_t sent, uint64_t bytes, uint64_t dropped)
+{
+	double sec = (double)elapsed / 1000000000;
+
+	printf("pktgen: %lu pkts %lu drops in %.3f sec, "
+	       "%.0f pps %.2f Mbps\n", sent, dropped, sec,
+	       sent / sec, bytes * 8 / sec / 1000000);
+}
+
+/* whether the host has posted an RX buffer. in the packed ring mode,
+ * posted buffers are known only by reading the descriptors */
+static int pktgen_rx_avail(struct nettlp_snic *snic)
+{
+	int avail;
+
+	if (!snic->packed)
+		return snic->rx_head != snic->rx_tail;
+
+	pthread_mutex_lock(&snic->rx_mutex);
+	avail = snic->rx_cached > 0 ||
+		nettlp_snic_rx_fetch_desc(snic, 1) == 0;
+	pthread_mutex_unlock(&snic->rx_mutex);
+
+	return avail;
+}
+
+void *nettlp_snic_pktgen_thread(void *arg)
+{
+	int len;
+	char buf[PKTGEN_MAX_LEN];
+	uint64_t seq, gap, next, start, last, now;
+	uint64_t last_sent = 0, last_bytes = 0, last_dropped = 0;
+	struct nettlp_snic *snic = arg;
+	struct snic_pktgen *pg = &snic->pktgen;
+
+	snic_pin_thread(snic, 0);
+	pktgen_build_template(pg, buf);
+	gap = pg->rate ? 1000000000ULL / pg->rate : 0;
+
+	printf("pktgen: %d-%d byte, %d flows, %lu pps, %lu pkts%s\n",
+	       pg->min_len, pg->max_len, pg->nflows, pg->rate, pg->count,
+	       pg->blast ? ", rx blast" : "");
+
+	start = last = next = now_ns();
+
+	for (seq = 0; pg->count == 0 || seq < pg->count; seq++) {
+
+		if (caught_signal)
+			break;
+
+		if (gap) {
+			if (now_ns() < next)
+				nettlp_snic_rx_flush(snic);
+			while ((now = now_ns()) < next)
+				;
+			next += gap;
+		}
+
+		len = pktgen_next(pg, buf, seq);
+
+		/* in the blast mode, wait for a new rx buffer */
+		while (pg->blast && !pktgen_rx_avail(snic) && !caught_signal) {
+			nettlp_snic_rx_flush(snic);
+			sched_yield();
+		}
+
+		if (nettlp_snic_rx_deliver(snic, buf, len) < 0)
+			pg->dropped++;
+		else {
+			pg->sent++;
+			pg->bytes += len;
+		}
+
+		now = now_ns();
+		if (now - last >= 1000000000ULL) {
+			pktgen_report(pg, now - last, pg->sent - last_sent,
+				      pg->bytes - last_bytes,
+				      pg->dropped - last_dropped);
+			last = now;
+			last_sent = pg->sent;
+			last_bytes = pg->bytes;
+			last_dropped = pg->dropped;
+		}
+	}
+
+	nettlp_snic_rx_flush(snic);
+	printf("pktgen: done\n");
+	pktgen_report(pg, now_ns() - start, pg->sent, pg->bytes, pg->dropped);
+
+	return NULL;
+}
+
+static int parse_mac(char *str, uint8_t *mac)
+{
+	uint8_t m[6];
+
+	if (sscanf(str, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+		   &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6)
+		return -1;
+
+	/* stored in the BAR0 byte order */
+	snic_get_mac(mac, m);
+	return 0;
+}
+
+int pktgen_parse(struct snic_pktgen *pg, char *subopts)
+{
+	char *value;
+	enum {
+		PG_SIZE, PG_FLOWS, PG_RATE, PG_COUNT, PG_BLAST,
+		PG_HOSTMAC, PG_HOSTIP, PG_DEVMAC, PG_DEVIP,
+	};
+	char *const tokens[] = {
+		[PG_SIZE]	= "size",
+		[PG_FLOWS]	= "flows",
+		[PG_RATE]	= "rate",
+		[PG_COUNT]	= "count",
+		[PG_BLAST]	= "blast",
+		[PG_HOSTMAC]	= "hostmac",
+		[PG_HOSTIP]	= "hostip",
+		[PG_DEVMAC]	= "devmac",
+		[PG_DEVIP]	= "devip",
+		NULL,
+	};
+
+	pg->enabled = 1;
+
+	while (*subopts != '\0') {
+		int tok = getsubopt(&subopts, tokens, &value);
+
+		if (tok < 0) {
+			fprintf(stderr, "pktgen: invalid option '%s'\n", value);
+			return -1;
+		}
+		if (tok != PG_BLAST && !value) {
+			fprintf(stderr, "pktgen: '%s' requires a value\n",
+				tokens[tok]);
+			return -1;
+		}
+
+		switch (tok) {
+		case PG_SIZE:
+			if (sscanf(value, "%d-%d", &pg->min_len,
+				   &pg->max_len) == 1)
+				pg->max_len = pg->min_len;
+			break;
+		case PG_FLOWS:
+			pg->nflows = atoi(value);
+			break;
+		case PG_RATE:
+			pg->rate = strtoull(value, NULL, 10);
+			break;
+		case PG_COUNT:
+			pg->count = strtoull(value, NULL, 10);
+			break;
+		case PG_BLAST:
+			pg->blast = 1;
+			break;
+		case PG_HOSTMAC:
+			if (parse_mac(value, pg->cfg.srcmac) < 0)
+				goto invalid;
+			break;
+		case PG_HOSTIP:
+			if (inet_pton(AF_INET, value, &pg->cfg.srcip) < 1)
+				goto invalid;
+			break;
+		case PG_DEVMAC:
+			if (parse_mac(value, pg->cfg.dstmac) < 0)
+				goto invalid;
+			break;
+		case PG_DEVIP:
+			if (inet_pton(AF_INET, value, &pg->cfg.dstip) < 1)
+				goto invalid;
+			break;
+		}
+	}
+
+	if (pg->min_len < PKTGEN_MIN_LEN || pg->max_len > PKTGEN_MAX_LEN ||
+	    pg->min_len > pg->max_len) {
+		fprintf(stderr, "pktgen: size must be in %d-%d\n",
+			PKTGEN_MIN_LEN, PKTGEN_MAX_LEN);
+		return -1;
+	}
+
+	if (pg->nflows < 1) {
+		fprintf(stderr, "pktgen: flows must be larger than 0\n");
+		return -1;
+	}
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "pktgen: invalid address '%s'\n", value);
+	return -1;
+}
+
+
+/*
+ * Statistics.
+ *
+ * The stats thread DMA-writes the counters to the host buffer
+ * notified via stats_base every stats_interval, and, if the stats
+ * socket is specified, dumps them in JSON to every client that
+ * connects to the UNIX socket, e.g., by `nc -U /path/to/sock`.
+ */
+
+static void snic_stats_snapshot(struct nettlp_snic *snic,
+				struct snic_stats *st)
+{
+	int n, nq = snic->stats.nqueues;
+	uint64_t *src, *dst;
+
+	st->version = SNIC_STATS_VERSION;
+	st->nqueues = nq;
+
+	for (n = 0; n < SNIC_LAT_HIST_BUCKETS; n++)
+		st->dma_read_lat[n] = __atomic_load_n(&snic->stats.dma_read_lat[n],
+						      __ATOMIC_RELAXED);
+
+	src = (uint64_t *)snic->stats.q;
+	dst = (uint64_t *)st->q;
+	for (n = 0; n < sizeof(struct snic_queue_stats) * nq / 8; n++)
+		dst[n] = __atomic_load_n(&src[n], __ATOMIC_RELAXED);
+}
+
+static int snic_stats_dma(struct nettlp_snic *snic, struct snic_stats *st)
+{
+	size_t len;
+
+	len = offsetof(struct snic_stats, q) +
+		sizeof(struct snic_queue_stats) * st->nqueues;
+
+	return snic_dma_write(snic, &snic->nt, snic->stats_base, st, len);
+}
+
+static void snic_ts_json_hist(FILE *fp, const char *name, uint64_t *hist,
+			      int last)
+{
+	int n;
+	uint64_t h[SNIC_LAT_HIST_BUCKETS], count = 0;
+
+	for (n = 0; n < SNIC_LAT_HIST_BUCKETS; n++) {
+		h[n] = __atomic_load_n(&hist[n], __ATOMIC_RELAXED);
+		count += h[n];
+	}
+
+	fprintf(fp, "      \"%s\": {\"count\": %lu, \"p50\": %lu, "
+		"\"p90\": %lu, \"p99\": %lu, \"max\": %lu}%s\n",
+		name, count,
+		snic_lat_hist_percentile(h, 50),
+		snic_lat_hist_percentile(h, 90),
+		snic_lat_hist_percentile(h, 99),
+		snic_lat_hist_percentile(h, 100), last ? "" : ",");
+}
+
+/* stage latencies in ns, or NULL if timestamps are disabled */
+static void snic_ts_json(FILE *fp, struct snic_ts_hist *ts)
+{
+	int n;
+
+	fprintf(fp, ",\n  \"stage_latency_ns\": {\n    \"tx\": {\n");
+	for (n = 0; n < SNIC_TS_STEPS; n++)
+		snic_ts_json_hist(fp, snic_ts_tx_names[n], ts->tx[n],
+				  n == SNIC_TS_STEPS - 1);
+	fprintf(fp, "    },\n    \"rx\": {\n");
+	for (n = 0; n < SNIC_TS_STEPS; n++)
+		snic_ts_json_hist(fp, snic_ts_rx_names[n], ts->rx[n],
+				  n == SNIC_TS_STEPS - 1);
+	fprintf(fp, "    }\n  }");
+}
+
+static void snic_stats_json(FILE *fp, struct snic_stats *st,
+			    struct snic_ts_hist *ts)
+{
+	int n, first = 1;
+	struct snic_queue_stats *q;
+	uint64_t *hist = st->dma_read_lat;
+
+	fprintf(fp, "{\n  \"version\": %u,\n  \"queues\": [\n", st->version);
+
+	for (n = 0; n < st->nqueues; n++) {
+		q = &st->q[n];
+		fprintf(fp,
+			"    {\"queue\": %d, "
+			"\"rx_packets\": %lu, \"rx_bytes\": %lu, "
+			"\"rx_drops\": %lu, "
+			"\"tx_packets\": %lu, \"tx_bytes\": %lu, "
+			"\"tx_drops\": %lu, "
+			"\"rx_desc_fetched\": %lu, \"tx_desc_fetched\": %lu, "
+			"\"rx_irqs\": %lu, \"tx_irqs\": %lu, "
+			"\"dma_read_errors\": %lu, "
+			"\"dma_write_errors\": %lu, "
+			"\"rx_busy_poll_ns\": %lu, \"rx_sleep_ns\": %lu, "
+			"\"irqs_masked\": %lu, \"rx_lro_segs\": %lu, "
+			"\"rx_flow_hits\": %lu, \"rx_flow_drops\": %lu, "
+			"\"dma_read_retries\": %lu}%s\n",
+			n, q->rx_packets, q->rx_bytes, q->rx_drops,
+			q->tx_packets, q->tx_bytes, q->tx_drops,
+			q->rx_desc_fetched, q->tx_desc_fetched,
+			q->rx_irqs, q->tx_irqs,
+			q->dma_read_errors, q->dma_write_errors,
+			q->rx_busy_poll_ns, q->rx_sleep_ns, q->irqs_masked,
+			q->rx_lro_segs, q->rx_flow_hits, q->rx_flow_drops,
+			q->dma_read_retries, n + 1 < st->nqueues ? "," : "");
+	}
+
+	fprintf(fp, "  ],\n  \"dma_read_latency_ns\": {\n"
+		"    \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, "
+		"\"max\": %lu,\n    \"buckets\": [",
+		snic_lat_hist_percentile(hist, 50),
+		snic_lat_hist_percentile(hist, 90),
+		snic_lat_hist_percentile(hist, 99),
+		snic_lat_hist_percentile(hist, 100));
+
+	/* non-empty buckets only, as [lowest value, count] */
+	for (n = 0; n < SNIC_LAT_HIST_BUCKETS; n++) {
+		if (!hist[n])
+			continue;
+		fprintf(fp, "%s[%lu, %lu]", first ? "" : ", ",
+			snic_lat_hist_value(n), hist[n]);
+		first = 0;
+	}
+
+	fprintf(fp, "]\n  }");
+
+	if (ts)
+		snic_ts_json(fp, ts);
+
+	fprintf(fp, "\n}\n");
+}
+
+static int snic_stats_sock_open(char *path)
+{
+	int fd;
+	struct sockaddr_un sun;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(fd, 4) < 0) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* a stats thread serves all the instances */
+void *nettlp_snic_stats_thread(void *arg)
+{
+	int n, ret, fd, timeout = INT_MAX;
+	FILE *fp;
+	uint64_t now, next[SNIC_MAX_INSTANCES];
+	struct snic_stats st;
+	struct snic_daemon *d = arg;
+	struct nettlp_snic *snic;
+	struct pollfd x[SNIC_MAX_INSTANCES];
+
+	for (n = 0; n < d->ninst; n++) {
+		snic = d->inst[n];
+		x[n].fd = -1;	/* ignored by poll */
+		x[n].events = POLLIN;
+		if (snic->stats_sock_path) {
+			x[n].fd = snic_stats_sock_open(snic->stats_sock_path);
+			if (x[n].fd < 0)
+				fprintf(stderr, "failed to open stats socket "
+					"%s\n", snic->stats_sock_path);
+		}
+		if (snic->stats_interval < timeout)
+			timeout = snic->stats_interval;
+		next[n] = now_ns();
+	}
+
+	while (!caught_signal) {
+
+		ret = poll(x, d->ninst, timeout);
+		now = now_ns();
+
+		for (n = 0; n < d->ninst; n++) {
+			snic = d->inst[n];
+
+			if (ret > 0 && (x[n].revents & POLLIN)) {
+				fd = accept(x[n].fd, NULL, NULL);
+				if (fd >= 0 && (fp = fdopen(fd, "w"))) {
+					snic_stats_snapshot(snic, &st);
+					snic_stats_json(fp, &st, snic->timestamps ?
+							&snic->ts : NULL);
+					fclose(fp);
+				} else if (fd >= 0)
+					close(fd);
+			}
+
+			if (now < next[n])
+				continue;
+			next[n] = now + snic->stats_interval * 1000000ULL;
+
+			if (snic->stats_base) {
+				snic_stats_snapshot(snic, &st);
+				if (snic_stats_dma(snic, &st) < 0)
+					fprintf(stderr, "failed to write stats "
+						"to %#lx\n", snic->stats_base);
+			}
+		}
+	}
+
+	for (n = 0; n < d->ninst; n++) {
+		if (x[n].fd >= 0) {
+			close(x[n].fd);
+			unlink(d->inst[n]->stats_sock_path);
+		}
+	}
+
+	return NULL;
+}
+
+
+/* Bootstrap. The device information is taken from the driver by a
+ * single NETTLP_MSG_GET_ALL round trip, and stored in a cache file.
+ * A restarted device starts with the cache immediately and
+ * revalidates it against the driver in background. */
+
+#define SNIC_MSG_TIMEOUT	100	/* msec, doubled on each retry */
+#define SNIC_MSG_RETRIES	5
+
+#define SNIC_CACHE_DIR		"/var/tmp"
+#define SNIC_CACHE_MAGIC	0x534e4943	/* "SNIC" */
+
+struct snic_boot_cache {
+	uint32_t magic;
+	uint32_t host;		/* s_addr of the host */
+	struct nettlp_msg_all all;
+} __attribute__((packed));
+
+/* returns 0 on success, -1 on error, and -2 if the driver does not
+ * reply a valid NETTLP_MSG_GET_ALL */
+static int snic_msg_get_all(struct in_addr host, struct nettlp_msg_all *all)
+{
+	int sock, ret, n, timeout = SNIC_MSG_TIMEOUT;
+	int req = NETTLP_MSG_GET_ALL;
+	struct sockaddr_in sin;
+	struct pollfd x;
+	ssize_t len;
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr = host;
+	sin.sin_port = htons(NETTLP_MSG_PORT);
+	if (connect(sock, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		perror("connect");
+		goto err;
+	}
+
+	for (n = 0; n <= SNIC_MSG_RETRIES; n++, timeout *= 2) {
+		if (send(sock, &req, sizeof(req), 0) < 0) {
+			perror("send");
+			goto err;
+		}
+
+		x.fd = sock;
+		x.events = POLLIN;
+		ret = poll(&x, 1, timeout);
+		if (ret < 0 && errno != EINTR) {
+			perror("poll");
+			goto err;
+		}
+		if (ret <= 0) {
+			printf("GET_ALL to %s timed out in %d msec\n",
+			       inet_ntoa(host), timeout);
+			continue;
+		}
+
+		len = recv(sock, all, sizeof(*all), 0);
+		if (len < 0) {
+			/* ICMP unreachable while the driver is not loaded */
+			if (errno == ECONNREFUSED) {
+				usleep(timeout * 1000);
+				continue;
+			}
+			perror("recv");
+			goto err;
+		}
+
+		close(sock);
+
+		if (len != sizeof(*all) ||
+		    all->version != NETTLP_MSG_ALL_VERSION ||
+		    all->num_vec < 2) {
+			printf("invalid GET_ALL reply, %zd bytes, version %u\n",
+			       len, all->version);
+			return -2;
+		}
+		return 0;
+	}
+
+	printf("no GET_ALL reply from %s\n", inet_ntoa(host));
+err:
+	close(sock);
+	return -1;
+}
+
+/* the three round trips for drivers without NETTLP_MSG_GET_ALL */
+static int snic_msg_get_legacy(struct in_addr host,
+			       struct nettlp_msg_all *all)
+{
+	struct nettlp_msix msix[2];	/* tx and rx interrupt */
+
+	memset(all, 0, sizeof(*all));
+	all->version = NETTLP_MSG_ALL_VERSION;
+	all->dev_id = nettlp_msg_get_dev_id(host);
+
+	all->bar4_start = nettlp_msg_get_bar4_start(host);
+	if (all->bar4_start == 0) {
+		printf("failed to get BAR4 addr from %s\n", inet_ntoa(host));
+		perror("nettlp_msg_get_bar4_start");
+		return -1;
+	}
+
+	if (nettlp_msg_get_msix_table(host, msix, 2) < 0) {
+		printf("failed to get MSIX from %s\n", inet_ntoa(host));
+		perror("nettlp_msg_get_msix_table");
+		return -1;
+	}
+	memcpy(all->msix, msix, sizeof(msix));
+	all->num_vec = 2;
+
+	return 0;
+}
+
+static int snic_msg_fetch(struct in_addr host, struct nettlp_msg_all *all)
+{
+	int ret;
+
+	ret = snic_msg_get_all(host, all);
+	if (ret == -2) {
+		printf("fall back to legacy messages\n");
+		ret = snic_msg_get_legacy(host, all);
+	}
+
+	return ret;
+}
+
+static int snic_cache_load(char *path, struct in_addr host,
+			   struct nettlp_msg_all *all)
+{
+	int fd;
+	ssize_t len;
+	struct snic_boot_cache c;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	len = read(fd, &c, sizeof(c));
+	close(fd);
+
+	if (len != sizeof(c) || c.magic != SNIC_CACHE_MAGIC ||
+	    c.host != host.s_addr ||
+	    c.all.version != NETTLP_MSG_ALL_VERSION || c.all.num_vec < 2)
+		return -1;
+
+	*all = c.all;
+	return 0;
+}
+
+static int snic_cache_store(char *path, struct in_addr host,
+			    struct nettlp_msg_all *all)
+{
+	int fd;
+	ssize_t len;
+	char tmp[PATH_MAX];
+	struct snic_boot_cache c;
 
-		/* wait untile last DMA write done */
-		while (snic->rx_state != RX_STATE_DONE &&
-		       snic->rx_state != RX_STATE_INIT)
-			sched_yield();	
-
-		/* 1. RX descriptor is udpated. start RX process */
-		memcpy(&idx, m, sizeof(idx));
-		addr = snic->rx_desc_base + (sizeof(struct descriptor) * idx);
-		snic->rx_desc_addr = addr;
-		printf("RX desc update: dma to %#lx, rx desc ptr is %#lx\n",
-		       dma_addr, snic->rx_desc_addr);
-
-		/* 2. Read descriptor from host */
-		SNIC_DMA_LOCK(snic);
-		ret = dma_read(&snic->nt,
-			       snic->rx_desc_addr, &snic->rx_desc,
-			       sizeof(snic->rx_desc));
-		SNIC_DMA_UNLOCK(snic);
-		if (ret < sizeof(snic->rx_desc)) {
-			fprintf(stderr, "failed to read rx desc from %#lx\n",
-				addr);
-			return -1;
-		}
+	memset(&c, 0, sizeof(c));
+	c.magic = SNIC_CACHE_MAGIC;
+	c.host = host.s_addr;
+	c.all = *all;
+
+	/* replace the cache atomically not to read a partial one */
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
 
-		printf("RX desc update: new rx_desc addr=%#lx len=%lu\n",
-		       snic->rx_desc.addr, snic->rx_desc.length);
-		/* 2.1. Set RX State Ready because we have new buffer  */
-		snic->rx_state = RX_STATE_READY;
+	len = write(fd, &c, sizeof(c));
+	close(fd);
+	if (len != sizeof(c) || rename(tmp, path) < 0) {
+		perror("failed to store cache");
+		unlink(tmp);
+		return -1;
 	}
 
 	return 0;
 }
 
-
-void *nettlp_snic_tap_read_thread(void * arg)
+static void snic_boot_apply(struct nettlp_snic *snic,
+			    struct nettlp_msg_all *all)
 {
-	int ret, pktlen;
-	char buf[2048];
-	struct nettlp_snic *snic = arg;
-	struct pollfd x[1] = {{ .fd = snic->fd, .events = POLLIN}};
+	struct nettlp_msix tx_irq, rx_irq;
 
-	/* This is the actual part of RX. This thread read tap socket,
-	 * and if rx buffer is available, DMA Write the packet from
-	 * the tap to the RX buffer on the NetTLP adapter host.
-	 */
+	memcpy(&tx_irq, &all->msix[0], sizeof(tx_irq));
+	memcpy(&rx_irq, &all->msix[1], sizeof(rx_irq));
 
-	while (1) {
+	/* interrupts are sent under the ring locks */
+	pthread_mutex_lock(&snic->tx_mutex);
+	pthread_mutex_lock(&snic->rx_mutex);
+	snic->boot = *all;
+	__atomic_store_n(&snic->bar4_start, all->bar4_start,
+			 __ATOMIC_RELAXED);
+	snic->tx_irq = tx_irq;
+	snic->rx_irq = rx_irq;
+	pthread_mutex_unlock(&snic->rx_mutex);
+	pthread_mutex_unlock(&snic->tx_mutex);
+}
 
-		if (caught_signal)
-			break;
+/* get the device information from the cache or the driver. returns
+ * 1 if the cache is used and needs revalidation, 0 if fetched, or -1
+ * on error. */
+static int snic_bootstrap(struct nettlp_snic *snic)
+{
+	struct nettlp_msg_all all;
 
-		ret = poll(x, 1, 500);
-		if (ret < 0 || ret == 0 || !(x[0].revents & POLLIN))
-			continue;
+	if (snic->cache_path &&
+	    snic_cache_load(snic->cache_path, snic->host, &all) == 0) {
+		printf("use cached device info in %s\n", snic->cache_path);
+		snic_boot_apply(snic, &all);
+		return 1;
+	}
 
-		/* 2.2. read a packet from the tap interface */
-		pktlen = read(snic->fd, buf, sizeof(buf));
-		if (pktlen < 0) {
-			perror("read");
-			continue;
-		}
+	if (snic_msg_fetch(snic->host, &all) < 0)
+		return -1;
 
-		printf("RX: rcv packet from tap\n");
-		if (snic->rx_state != RX_STATE_READY) {
-			printf("RX: RX_STATE is not ready\n");
-			continue;
-		}
+	if (snic->cache_path)
+		snic_cache_store(snic->cache_path, snic->host, &all);
 
-		snic->rx_state = RX_STATE_BUSY;
+	snic_boot_apply(snic, &all);
+	return 0;
+}
 
-		/* 3. DMA the packet to host */
-		printf("RX: DMA write the packet to memory\n");
-		ret = dma_write(&snic->nt, snic->rx_desc.addr, buf, pktlen);
-		if (ret < 0) {
-			fprintf(stderr, "failed to write rx pkt to %#lx\n",
-				snic->rx_desc.addr);
-			continue;
-		}
+void *nettlp_snic_revalidate_thread(void *arg)
+{
+	struct nettlp_snic *snic = arg;
+	struct nettlp_msg_all all;
 
-		/* 4. Write back RX descriptor */
-		printf("DMA Write the updated RX desc to host: %#lx\n",
-		       snic->rx_desc_addr);
-		snic->rx_desc.length = pktlen;
-		ret = dma_write(&snic->nt, snic->rx_desc_addr,
-				&snic->rx_desc, sizeof(snic->rx_desc));
-		if (ret < sizeof(snic->rx_desc)) {
-			fprintf(stderr, "failed to write rx desc to %#lx\n",
-				snic->rx_desc_addr);
-			continue;
-		}
+	if (snic_msg_fetch(snic->host, &all) < 0) {
+		printf("failed to revalidate cached device info, "
+		       "keep using it\n");
+		return NULL;
+	}
 
-		/* 5. Generate RX interrupt */
-		printf("DMA Write for RX interrupt: %#lx\n",
-		       snic->rx_irq.addr);
-		ret = dma_write(&snic->nt, snic->rx_irq.addr,
-				&snic->rx_irq.data,
-				sizeof(snic->rx_irq.data));
-		if (ret < 0) {
-			fprintf(stderr, "failed to generate RX interrupt\n");
-			perror("dma_write");
-		}
+	if (memcmp(&all, &snic->boot, sizeof(all)) == 0)
+		return NULL;
 
-		printf("RX done. DMA write to %#lx %d byte\n",
-		       snic->rx_desc.addr, pktlen);
+	printf("device info on %s changed, update %s\n",
+	       inet_ntoa(snic->host), snic->cache_path);
+	snic_cache_store(snic->cache_path, snic->host, &all);
 
-		snic->rx_state = RX_STATE_DONE;
-	}
+	/* requester ID is fixed on each struct nettlp of the callback */
+	if (all.dev_id != snic->boot.dev_id)
+		printf("device ID changed from %04x to %04x, "
+		       "restart the device\n", snic->boot.dev_id, all.dev_id);
+
+	snic_boot_apply(snic, &all);
+	printf("BAR4 start address is %#lx\n", snic->bar4_start);
 
 	return NULL;
 }
 
-
-
 int tap_alloc(char *dev)
 {
 	/* create tap interface */
@@ -308,7 +3863,336 @@ int tap_up(char *dev)
 void sig_handler(int sig)
 {
 	caught_signal = 1;
-	nettlp_stop_cb();
+	nettlp_stop_cb();	/* nop on the shm transport */
+}
+
+/* parse "[queue:]value" for -y and -c. without queue, the value is
+ * applied to all queues. */
+int parse_rxq_conf(struct nettlp_snic *snic, int opt, char *arg)
+{
+	int q, qn, val;
+	char *p;
+
+	p = strchr(arg, ':');
+	if (p) {
+		qn = atoi(arg);
+		val = atoi(p + 1);
+		if (qn < 0 || qn >= SNIC_MAX_QUEUES) {
+			fprintf(stderr, "invalid queue %d\n", qn);
+			return -1;
+		}
+	} else {
+		qn = -1;
+		val = atoi(arg);
+	}
+
+	if (val < 0) {
+		fprintf(stderr, "invalid value for -%c: %s\n", opt, arg);
+		return -1;
+	}
+
+	for (q = 0; q < SNIC_MAX_QUEUES; q++) {
+		if (qn >= 0 && q != qn)
+			continue;
+		if (opt == 'y')
+			snic->rxq[q].busy_poll = val;
+		else
+			snic->rxq[q].cpu = val;
+	}
+
+	return 0;
+}
+
+/* parse an instance in the config file. an instance is a line of
+ * key=value separated by spaces, for example,
+ *
+ *   tap=tap0 host=192.168.10.1 remote=192.168.10.2 local=192.168.10.3
+ *   tap=tap1 host=192.168.20.1 stats=/tmp/snic1.sock busy_poll=50 cpu=3
+ *
+ * keys not in a line are taken from the command line options. */
+static int snic_conf_parse(struct nettlp_snic *snic, char *line)
+{
+	char *tok, *save, *val;
+	struct in_addr *addr;
+
+	for (tok = strtok_r(line, " \t\n", &save); tok;
+	     tok = strtok_r(NULL, " \t\n", &save)) {
+
+		val = strchr(tok, '=');
+		if (!val) {
+			fprintf(stderr, "invalid config \"%s\"\n", tok);
+			return -1;
+		}
+		*val++ = '\0';
+
+		addr = NULL;
+		if (strcmp(tok, "tap") == 0)
+			snic->ifname = val;
+		else if (strcmp(tok, "host") == 0)
+			addr = &snic->host;
+		else if (strcmp(tok, "remote") == 0)
+			addr = &snic->nt.remote_addr;
+		else if (strcmp(tok, "local") == 0)
+			addr = &snic->nt.local_addr;
+		else if (strcmp(tok, "cache") == 0) {
+			snic->cache_path = val;
+			snic->no_cache = (strcmp(val, "none") == 0);
+		} else if (strcmp(tok, "stats") == 0)
+			snic->stats_sock_path = val;
+		else if (strcmp(tok, "interval") == 0) {
+			snic->stats_interval = atoi(val);
+			if (snic->stats_interval < 1) {
+				fprintf(stderr, "invalid stats interval\n");
+				return -1;
+			}
+		} else if (strcmp(tok, "busy_poll") == 0) {
+			if (parse_rxq_conf(snic, 'y', val) < 0)
+				return -1;
+		} else if (strcmp(tok, "cpu") == 0) {
+			if (parse_rxq_conf(snic, 'c', val) < 0)
+				return -1;
+		} else if (strcmp(tok, "tx_pipeline") == 0) {
+			snic->txp.nworkers = atoi(val);
+			if (snic->txp.nworkers < 0 ||
+			    snic->txp.nworkers > SNIC_TXP_MAX_WORKERS) {
+				fprintf(stderr, "invalid tx_pipeline\n");
+				return -1;
+			}
+		} else if (strcmp(tok, "timestamps") == 0) {
+			snic->timestamps = atoi(val);
+		} else if (strcmp(tok, "tx_cpu") == 0) {
+			snic->txp.cpu = atoi(val);
+		} else if (strcmp(tok, "pktgen") == 0) {
+			if (pktgen_parse(&snic->pktgen, val) < 0)
+				return -1;
+		} else {
+			fprintf(stderr, "unknown config key \"%s\"\n", tok);
+			return -1;
+		}
+
+		if (addr && inet_pton(AF_INET, val, addr) < 1) {
+			fprintf(stderr, "invalid address %s=%s\n", tok, val);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int snic_conf_load(struct snic_daemon *d, struct nettlp_snic *tmpl,
+			  char *path)
+{
+	FILE *fp;
+	int lineno = 0;
+	char line[1024], *p;
+	struct nettlp_snic *snic;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		perror("fopen");
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+
+		if (d->ninst == SNIC_MAX_INSTANCES) {
+			fprintf(stderr, "%s:%d: too many instances, max %d\n",
+				path, lineno, SNIC_MAX_INSTANCES);
+			goto err;
+		}
+
+		snic = malloc(sizeof(*snic));
+		if (!snic) {
+			perror("malloc");
+			goto err;
+		}
+		*snic = *tmpl;
+		snic->id = d->ninst;
+
+		/* values point to the line, kept during the process */
+		if (snic_conf_parse(snic, strdup(p)) < 0) {
+			fprintf(stderr, "%s:%d: invalid instance\n",
+				path, lineno);
+			free(snic);
+			goto err;
+		}
+
+		d->inst[d->ninst++] = snic;
+	}
+
+	fclose(fp);
+
+	if (d->ninst == 0) {
+		fprintf(stderr, "no instance in %s\n", path);
+		return -1;
+	}
+
+	return 0;
+
+err:
+	fclose(fp);
+	return -1;
+}
+
+/* TLP tags for DMA contexts issued from this process. each context
+ * needs its own tag not to share the port */
+static int snic_tags_used = 0;
+
+static int snic_alloc_tag(void)
+{
+	if (snic_tags_used == 16)
+		return -1;
+	return snic_tags_used++;
+}
+
+/* get the device info, and open the tap and the DMA context */
+static int snic_instance_init(struct nettlp_snic *snic)
+{
+	int ret;
+	char *path;
+	pthread_t reval_tid;	/* revalidate_thread */
+
+	pthread_mutex_init(&snic->mutex, NULL);
+	pthread_mutex_init(&snic->tx_mutex, NULL);
+	pthread_mutex_init(&snic->rx_mutex, NULL);
+	pthread_mutex_init(&snic->shm_lock, NULL);
+	pthread_rwlock_init(&snic->flow.lock, NULL);
+	snic_flow_rebuild(&snic->flow);
+
+	if (snic->shm) {
+		/* the host emulator gives the device info */
+		snic_boot_apply(snic, &snic->shm->all);
+		goto tap;
+	}
+
+	if (snic->host.s_addr == 0) {
+		fprintf(stderr, "remote host addr is required for %s\n",
+			snic->ifname);
+		return -1;
+	}
+
+	/* get device info before nettlp_init that needs requester ID */
+	if (snic->no_cache)
+		snic->cache_path = NULL;
+	else if (!snic->cache_path) {
+		if (asprintf(&path, SNIC_CACHE_DIR "/nettlp_snic_%s.cache",
+			     inet_ntoa(snic->host)) < 0)
+			return -1;
+		snic->cache_path = path;
+	}
+	ret = snic_bootstrap(snic);
+	if (ret < 0) {
+		printf("failed to get device info from %s\n",
+		       inet_ntoa(snic->host));
+		return -1;
+	}
+
+	/* revalidate the cache in background, not to delay start */
+	if (ret == 1) {
+		pthread_create(&reval_tid, NULL, nettlp_snic_revalidate_thread,
+			       snic);
+		pthread_detach(reval_tid);
+	}
+
+tap:
+	/* initalize tap interface */
+	snic->fd = tap_alloc(snic->ifname);
+	if (snic->fd < 0) {
+		perror("tap_alloc");
+		return -1;
+	}
+
+	if (tap_up(snic->ifname) < 0) {
+		perror("tap_up");
+		return -1;
+	}
+
+	/* libtlp contexts are not used on the shm transport */
+	if (snic->shm)
+		goto out;
+
+	/* initialize a nettlp structure for issuing DMA from LibTLP */
+	snic->nt.requester = snic->boot.dev_id;
+	ret = snic_alloc_tag();
+	if (ret < 0) {
+		fprintf(stderr, "no TLP tag for %s\n", snic->ifname);
+		return -1;
+	}
+	snic->nt.tag = ret;
+	snic->nt.dir = DMA_ISSUED_BY_LIBTLP;
+	ret = nettlp_init(&snic->nt);
+	if (ret < 0) {
+		printf("failed to init nettlp for DMA from LibTLP\n");
+		perror("nettlp_init");
+		return ret;
+	}
+
+	/* XXX: snic->nt used for issuing DMAs from LibTLP needs to be
+	 * locked under mutex among multiple threads for each TLP tag
+	 * because multiple threads are running here, but there is a
+	 * single struct nettlp for issuing DMA read from here to the
+	 * root complex. But, on the other hand, this could be
+	 * implemented as multi-threaded fashion using TLP tags on
+	 * DMAs issued from LibTLP.
+	 */
+
+out:
+	printf("Instance %d on %s\n", snic->id, snic->ifname);
+	printf("Device is %04x\n", snic->boot.dev_id);
+	printf("BAR4 start address is %#lx\n", snic->bar4_start);
+	printf("Driver features %#x, %u queues\n", snic->boot.features,
+	       snic->boot.nqueues);
+	printf("TX IRQ address is %#lx, data is 0x%08x\n", snic->tx_irq.addr,
+	       snic->tx_irq.data);
+	printf("RX IRQ address is %#lx, data is 0x%08x\n", snic->rx_irq.addr,
+	       snic->rx_irq.data);
+
+	return 0;
+}
+
+/* initialize nettlp structures for all tags of each adapter. returns
+ * the number of the structures */
+static int snic_init_cb_contexts(struct snic_daemon *d, struct nettlp *nts,
+				 struct nettlp **nts_ptr)
+{
+	int i, j, n, ret, nnts = 0;
+	struct nettlp *nt;
+
+	for (i = 0; i < d->ninst; i++) {
+		nt = &d->inst[i]->nt;
+
+		/* instances on an adapter share its contexts */
+		for (j = 0; j < i; j++) {
+			if (d->inst[j]->nt.remote_addr.s_addr ==
+			    nt->remote_addr.s_addr &&
+			    d->inst[j]->nt.local_addr.s_addr ==
+			    nt->local_addr.s_addr)
+				break;
+		}
+		if (j < i)
+			continue;
+
+		for (n = 0; n < 16; n++) {
+			nts[nnts] = *nt;
+			nts[nnts].tag = n;
+			nts[nnts].dir = DMA_ISSUED_BY_ADAPTER;
+			nts_ptr[nnts] = &nts[nnts];
+
+			ret = nettlp_init(nts_ptr[nnts]);
+			if (ret < 0) {
+				printf("failed to init nettlp on tag %x\n", n);
+				perror("nettlp_init");
+				return ret;
+			}
+			nnts++;
+		}
+	}
+
+	return nnts;
 }
 
 void usage(void)
@@ -317,51 +4201,161 @@ void usage(void)
 	       "    -r remote addr\n"
 	       "    -l local addr\n"
 	       "    -R remote host addr (not TLP NIC)\n"
+	       "    -C device info cache file "
+	       "(default " SNIC_CACHE_DIR "/nettlp_snic_HOST.cache)\n"
+	       "    -N do not use the device info cache\n"
+	       "    -S shm transport, UNIX socket path of "
+	       "nettlp_snic_hostemu\n"
 	       "\n"
 	       "    -t tunif name (default tap0)\n"
+	       "    -q quiet, do not print per-packet messages\n"
+	       "    -s stats socket path to dump counters in JSON\n"
+	       "    -i stats DMA interval in msec (default 1000)\n"
+	       "    -T timestamp TX/RX steps, and dump stage latencies\n"
+	       "       to the stats socket\n"
+	       "    -p capture TLPs to a pcapng file, see nettlp_tlp_analyze\n"
+	       "    -y [queue:]usec to busy-poll after RX traffic (default 0)\n"
+	       "    -c [queue:]cpu to pin the RX thread\n"
+	       "    -P N pipelined TX with N payload workers (max 8)\n"
+	       "    -X first cpu to pin the TX pipeline stages\n"
+	       "\n"
+	       "    -g generate RX packets instead of reading the tap:\n"
+	       "       size=MIN[-MAX],flows=N,rate=PPS,count=N,blast,\n"
+	       "       hostmac=MAC,hostip=IP,devmac=MAC,devip=IP\n"
+	       "\n"
+	       "    -f config file of instances served by this process:\n"
+	       "       a line of tap=NAME host=ADDR remote=ADDR local=ADDR\n"
+	       "       cache=PATH|none stats=PATH interval=MSEC\n"
+	       "       busy_poll=[Q:]USEC cpu=[Q:]CPU pktgen=SUBOPTS\n"
+	       "       tx_pipeline=N tx_cpu=CPU timestamps=0|1\n"
+	       "       for each instance. options above are defaults\n"
+	       "    -w number of worker threads reading taps (default 1)\n"
 		);
 }
 
+static struct snic_daemon snicd;
+
 int main(int argc, char **argv)
 {
-	int ret, ch, n, fd;
-	struct nettlp nt, nts[16], *nts_ptr[16];
+	int ret, ch, n, nnts = 0;
+	static struct nettlp nts[16 * SNIC_MAX_INSTANCES];
+	struct nettlp *nts_ptr[16 * SNIC_MAX_INSTANCES];
 	struct nettlp_cb cb;
-	char *ifname = "tap0";
-	struct nettlp_snic snic;
-	struct in_addr host;
-	struct nettlp_msix msix[2];	/* tx and rx interrupt */
-	pthread_t rx_tid;	/* tap_read_thread */
+	struct nettlp_snic tmpl, *snic;
+	struct snic_worker *w;
+	char *shm_path = NULL, *conf_path = NULL, *pcap_path = NULL;
+	pthread_t rx_tids[SNIC_MAX_INSTANCES];	/* worker and pktgen */
+	pthread_t stats_tid;	/* stats_thread */
+	int nrx = 0;
 
-	memset(&nt, 0, sizeof(nt));
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.ifname = "tap0";
 
-	while ((ch = getopt(argc, argv, "r:l:b:R:t:")) != -1) {
+	/* default pktgen parameters */
+	tmpl.pktgen.min_len = PKTGEN_MIN_LEN;
+	tmpl.pktgen.max_len = PKTGEN_MIN_LEN;
+	tmpl.pktgen.nflows = 1;
+	memset(tmpl.pktgen.cfg.srcmac, 0xFF, 6);
+	tmpl.pktgen.cfg.dstmac[0] = 0x01;
+	tmpl.pktgen.cfg.dstmac[5] = 0x02;
+	tmpl.pktgen.cfg.srcip = htonl(0x0A000001);	/* 10.0.0.1 */
+	tmpl.pktgen.cfg.dstip = htonl(0x0A000002);	/* 10.0.0.2 */
+
+	tmpl.stats.nqueues = 1;
+	tmpl.stats_interval = SNIC_STATS_INTERVAL;
+	for (n = 0; n < SNIC_MAX_QUEUES; n++)
+		tmpl.rxq[n].cpu = -1;
+	tmpl.txp.cpu = -1;
+
+	snicd.nworkers = 1;
+
+	while ((ch = getopt(argc, argv, "r:l:b:R:t:qg:s:i:y:c:C:NS:f:w:P:X:Tp:"))
+	       != -1) {
 		switch (ch) {
                 case 'r':
-                        ret = inet_pton(AF_INET, optarg, &nt.remote_addr);
+                        ret = inet_pton(AF_INET, optarg,
+					&tmpl.nt.remote_addr);
                         if (ret < 1) {
                                 perror("inet_pton");
                                 return -1;
                         }
                         break;
                 case 'l':
-                        ret = inet_pton(AF_INET, optarg, &nt.local_addr);
+                        ret = inet_pton(AF_INET, optarg,
+					&tmpl.nt.local_addr);
                         if (ret < 1) {
                                 perror("inet_pton");
                                 return -1;
                         }
                         break;
 		case 'R':
-			ret = inet_pton(AF_INET, optarg, &host);
+			ret = inet_pton(AF_INET, optarg, &tmpl.host);
 			if (ret < 1) {
 				perror("inet_pton");
 				return -1;
 			}
-
-			nt.requester = nettlp_msg_get_dev_id(host);
+			break;
+		case 'C':
+			tmpl.cache_path = optarg;
+			break;
+		case 'N':
+			tmpl.no_cache = 1;
+			break;
+		case 'S':
+			shm_path = optarg;
 			break;
 		case 't':
-			ifname = optarg;
+			tmpl.ifname = optarg;
+			break;
+		case 'q':
+			verbose = 0;
+			break;
+		case 'g':
+			if (pktgen_parse(&tmpl.pktgen, optarg) < 0)
+				return -1;
+			break;
+		case 's':
+			tmpl.stats_sock_path = optarg;
+			break;
+		case 'y':
+		case 'c':
+			if (parse_rxq_conf(&tmpl, ch, optarg) < 0)
+				return -1;
+			break;
+		case 'i':
+			tmpl.stats_interval = atoi(optarg);
+			if (tmpl.stats_interval < 1) {
+				fprintf(stderr, "invalid stats interval\n");
+				return -1;
+			}
+			break;
+		case 'P':
+			tmpl.txp.nworkers = atoi(optarg);
+			if (tmpl.txp.nworkers < 0 ||
+			    tmpl.txp.nworkers > SNIC_TXP_MAX_WORKERS) {
+				fprintf(stderr, "invalid TX payload workers\n");
+				return -1;
+			}
+			break;
+		case 'X':
+			tmpl.txp.cpu = atoi(optarg);
+			break;
+		case 'T':
+			tmpl.timestamps = 1;
+			break;
+		case 'p':
+			pcap_path = optarg;
+			break;
+		case 'f':
+			conf_path = optarg;
+			break;
+		case 'w':
+			snicd.nworkers = atoi(optarg);
+			if (snicd.nworkers < 1 ||
+			    snicd.nworkers > SNIC_MAX_INSTANCES) {
+				fprintf(stderr, "invalid number of workers\n");
+				return -1;
+			}
 			break;
 		default:
 			usage();
@@ -369,81 +4363,49 @@ int main(int argc, char **argv)
 		}
 	}
 
-	/* initalize tap interface */
-	fd = tap_alloc(ifname);
-	if (fd < 0) {
-		perror("tap_alloc");
-		return -1;
-	}
-
-	if (tap_up(ifname) < 0) {
-		perror("tap_up");
-		return -1;
-	}
-
-	/* initialize nettlp structures for all tags */
-	for (n = 0; n < 16; n++) {
-		nts[n] = nt;
-		nts[n].tag = n;
-		nts_ptr[n] = &nts[n];
-		nts[n].dir = DMA_ISSUED_BY_ADAPTER;
-
-		ret = nettlp_init(nts_ptr[n]);
-		if (ret < 0) {
-			printf("failed to init nettlp on tag %x\n", n);
-			perror("nettlp_init");
-			return ret;
+	if (conf_path) {
+		if (shm_path) {
+			fprintf(stderr, "-S serves only a single instance\n");
+			return -1;
+		}
+		if (snic_conf_load(&snicd, &tmpl, conf_path) < 0)
+			return -1;
+	} else {
+		/* single instance from the command line */
+		snicd.inst[snicd.ninst++] = &tmpl;
+		if (shm_path) {
+			if (snic_shm_attach(&tmpl, shm_path) < 0)
+				return -1;
+			printf("attached to shm transport on %s\n", shm_path);
 		}
 	}
 
-	/* fill the snic structure */
-	memset(&snic, 0, sizeof(snic));
-	snic.fd = fd;
-	snic.bar4_start = nettlp_msg_get_bar4_start(host);
-	if (snic.bar4_start == 0) {
-		printf("failed to get BAR4 addr from %s\n", inet_ntoa(host));
-		perror("nettlp_msg_get_bar4_start");
-		return -1;
+	for (n = 0; n < snicd.ninst; n++) {
+		if (snic_instance_init(snicd.inst[n]) < 0)
+			return -1;
 	}
-	ret = nettlp_msg_get_msix_table(host, msix, 2);
-	if (ret < 0) {
-		printf("failed to get MSIX from %s\n", inet_ntoa(host));
-		perror("nettlp_msg_get_msix_table");
+
+	if (pcap_path && snic_pcap_start(&snicd, pcap_path) < 0)
 		return -1;
-	}
 
-	snic.tx_irq = msix[0];
-	snic.rx_irq = msix[1];
+	/* on the node of the first pinned thread */
+	snic = snicd.inst[0];
+	if (snic_pool_init(snicd.ninst * SNIC_POOL_BUFS_PER_INST,
+			   snic->rxq[0].cpu >= 0 ? snic->rxq[0].cpu :
+			   snic->txp.cpu) < 0)
+		return -1;
 
-	/* initialize a nettlp structure for issuing DMA from LibTLP */
-	memset(&snic.nt, 0, sizeof(snic.nt));
-	snic.nt = nt;
-	snic.nt.tag = 0;
-	snic.nt.dir = DMA_ISSUED_BY_LIBTLP;
-	ret = nettlp_init(&snic.nt);
-	if (ret < 0) {
-		printf("failed to init nettlp for DMA from LibTLP\n");
-		perror("nettlp_init");
-		return ret;
+	for (n = 0; n < snicd.ninst; n++) {
+		if (snicd.inst[n]->txp.nworkers &&
+		    snic_txp_start(snicd.inst[n]) < 0)
+			return -1;
 	}
 
-	pthread_mutex_init(&snic.mutex, NULL);
-	/* XXX: snic->nt used for issuing DMAs from LibTLP needs to be
-	 * locked under mutex among multiple threads for each TLP tag
-	 * because multiple threads are running here, but there is a
-	 * single struct nettlp for issuing DMA read from here to the
-	 * root complex. But, on the other hand, this could be
-	 * implemented as multi-threaded fashion using TLP tags on
-	 * DMAs issued from LibTLP.
-	 */
-
-
-	printf("Device is %04x\n", nt.requester);
-	printf("BAR4 start address is %#lx\n", snic.bar4_start);
-	printf("TX IRQ address is %#lx, data is 0x%08x\n", snic.tx_irq.addr,
-	       snic.tx_irq.data);
-	printf("RX IRQ address is %#lx, data is 0x%08x\n", snic.rx_irq.addr,
-	       snic.rx_irq.data);
+	if (!tmpl.shm) {
+		nnts = snic_init_cb_contexts(&snicd, nts, nts_ptr);
+		if (nnts < 0)
+			return nnts;
+	}
 
         /* set signal handler to stop callback threads */
         if (signal(SIGINT, sig_handler) == SIG_ERR) {
@@ -451,19 +4413,54 @@ int main(int argc, char **argv)
 		return -1;
         }
 
-	/* start RX thread */
-	printf("create tap read thread\n");
-	pthread_create(&rx_tid, NULL, nettlp_snic_tap_read_thread, &snic);
+	/* assign instances reading taps to the workers */
+	for (n = 0; n < snicd.ninst; n++) {
+		snic = snicd.inst[n];
+		if (snic->pktgen.enabled) {
+			printf("create pktgen thread for %s\n", snic->ifname);
+			pthread_create(&rx_tids[nrx++], NULL,
+				       nettlp_snic_pktgen_thread, snic);
+			continue;
+		}
+
+		w = &snicd.workers[n % snicd.nworkers];
+		w->snics[w->n++] = snic;
+	}
+
+	/* start RX threads */
+	for (n = 0; n < snicd.nworkers; n++) {
+		if (snicd.workers[n].n == 0)
+			continue;
+		snicd.workers[n].id = n;
+		printf("create worker thread %d for %d taps\n", n,
+		       snicd.workers[n].n);
+		pthread_create(&rx_tids[nrx++], NULL,
+			       nettlp_snic_worker_thread, &snicd.workers[n]);
+	}
+
+	/* start stats thread */
+	pthread_create(&stats_tid, NULL, nettlp_snic_stats_thread, &snicd);
+
+	if (tmpl.shm) {
+		printf("start shm transport\n");
+		nettlp_snic_shm_run(&tmpl);
+		goto out;
+	}
 
 	/* start nettlp call back */
 	printf("start nettlp callback\n");
 	memset(&cb, 0, sizeof(cb));
 	cb.mwr = nettlp_snic_mwr;
-	nettlp_run_cb(nts_ptr, 16, &cb, &snic);
+	nettlp_run_cb(nts_ptr, nnts, &cb, &snicd);
 
 	printf("nettlp callback done\n");
 
-	pthread_join(rx_tid, NULL);
+out:
+	for (n = 0; n < nrx; n++)
+		pthread_join(rx_tids[n], NULL);
+	pthread_join(stats_tid, NULL);
+	if (snic_pcap.fp)
+		pthread_join(snic_pcap.tid, NULL);
 
 	return 0;
 }
@@ -0,0 +1,446 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/types.h>
+
+#include <nettlp_snic.h>
+#include <nettlp_shm.h>
+
+/*
+ * Host emulator for the shared-memory transport.
+ *
+ * This emulates the host side of nettlp_snic_device -S: host memory
+ * serving MRd and MWr from the device, MSI-X interrupts, and a
+ * minimal driver that keeps the TX ring full of packets and the RX
+ * ring full of buffers. It reports packets per second of the device
+ * logic without libtlp and kernel UDP in the path.
+ */
+
+static int caught_signal = 0;
+
+#define HOSTEMU_SOCK_PATH	"/tmp/nettlp_snic.sock"
+
+/* fake physical addresses seen by the device */
+#define HOSTEMU_MEM_BASE	0x100000000ULL
+#define HOSTEMU_BAR4_START	0xd0000000ULL
+#define HOSTEMU_MSIX_ADDR	0xfee00000ULL
+#define HOSTEMU_TX_VEC		0
+#define HOSTEMU_RX_VEC		1
+
+/* layout of the host memory */
+#define HOSTEMU_TX_DESC		0x0000
+#define HOSTEMU_RX_DESC		0x1000
+#define HOSTEMU_STATS		0x2000
+#define HOSTEMU_TX_BUF		0x10000
+#define HOSTEMU_RX_BUF		(HOSTEMU_TX_BUF + HOSTEMU_BUF_SIZE *	\
+				 SNIC_DESC_RING_LEN)
+#define HOSTEMU_BUF_SIZE	2048
+#define HOSTEMU_MEM_SIZE	(HOSTEMU_RX_BUF + HOSTEMU_BUF_SIZE *	\
+				 SNIC_DESC_RING_LEN)
+
+struct hostemu {
+	struct nettlp_shm *shm;
+	char *mem;	/* host memory at HOSTEMU_MEM_BASE */
+
+	int pktlen;	/* TX packet length, 0 disables TX */
+
+	/* driver state */
+	uint32_t tx_idx, tx_clean;
+	uint32_t rx_idx, rx_clean;
+
+	/* counters */
+	uint64_t tx_packets, tx_bytes;
+	uint64_t rx_packets, rx_bytes;
+	uint64_t irqs[2];
+	uint64_t mrd, mwr, errors;
+};
+
+#define mem_desc(emu, off, idx)						\
+	((struct descriptor *)((emu)->mem + (off)) + (idx))
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *hostemu_mem(struct hostemu *emu, uint64_t addr, uint32_t len)
+{
+	if (addr < HOSTEMU_MEM_BASE ||
+	    addr + len > HOSTEMU_MEM_BASE + HOSTEMU_MEM_SIZE)
+		return NULL;
+
+	return emu->mem + (addr - HOSTEMU_MEM_BASE);
+}
+
+/* serve MRd and MWr issued by the device */
+void *hostemu_server_thread(void *arg)
+{
+	struct hostemu *emu = arg;
+	struct nettlp_shm_ent *e, *c;
+	void *p;
+
+	while (!caught_signal) {
+		e = nettlp_shm_ring_wait(&emu->shm->req, 4096, 100);
+		if (!e)
+			continue;
+
+		p = hostemu_mem(emu, e->addr, e->len);
+
+		switch (e->type) {
+		case NETTLP_SHM_MRD:
+			c = nettlp_shm_ring_reserve(&emu->shm->cpl);
+			c->type = NETTLP_SHM_CPL;
+			c->addr = e->addr;
+			c->len = e->len;
+			c->status = 0;
+			if (p)
+				memcpy(c->data, p, e->len);
+			else {
+				c->status = -EFAULT;
+				emu->errors++;
+			}
+			nettlp_shm_ring_push(&emu->shm->cpl);
+			emu->mrd++;
+			break;
+
+		case NETTLP_SHM_MWR:
+			if (e->addr == HOSTEMU_MSIX_ADDR) {
+				uint32_t vec;
+				memcpy(&vec, e->data, sizeof(vec));
+				if (vec < 2)
+					__atomic_fetch_add(&emu->irqs[vec], 1,
+							   __ATOMIC_RELAXED);
+			} else if (p) {
+				memcpy(p, e->data, e->len);
+				__atomic_thread_fence(__ATOMIC_RELEASE);
+			} else
+				emu->errors++;
+			emu->mwr++;
+			break;
+		}
+
+		nettlp_shm_ring_pop(&emu->shm->req);
+	}
+
+	return NULL;
+}
+
+/* MWr to BAR4 of the device */
+static void hostemu_bar4_write(struct hostemu *emu, size_t off,
+			       void *val, size_t len)
+{
+	struct nettlp_shm_ent *e;
+
+	e = nettlp_shm_ring_reserve(&emu->shm->mwr);
+	e->type = NETTLP_SHM_MWR;
+	e->addr = HOSTEMU_BAR4_START + off;
+	e->len = len;
+	memcpy(e->data, val, len);
+	nettlp_shm_ring_push(&emu->shm->mwr);
+}
+
+#define hostemu_bar4_write32(emu, field, v) do {			\
+		uint32_t __v = (v);					\
+		hostemu_bar4_write(emu, offsetof(struct snic_bar4, field), \
+				   &__v, sizeof(__v));			\
+	} while (0)
+
+#define hostemu_bar4_write64(emu, field, v) do {			\
+		uint64_t __v = (v);					\
+		hostemu_bar4_write(emu, offsetof(struct snic_bar4, field), \
+				   &__v, sizeof(__v));			\
+	} while (0)
+
+/* doorbell of queue 0 on its own page */
+#define hostemu_db_write32(emu, field, v) do {				\
+		uint32_t __v = (v);					\
+		hostemu_bar4_write(emu, SNIC_BAR4_DB_OFFSET +		\
+				   offsetof(struct snic_doorbell, field), \
+				   &__v, sizeof(__v));			\
+	} while (0)
+
+static void hostemu_post_rx(struct hostemu *emu)
+{
+	struct descriptor *d = mem_desc(emu, HOSTEMU_RX_DESC, emu->rx_idx);
+
+	memset(d, 0, sizeof(*d));
+	d->addr = HOSTEMU_MEM_BASE + HOSTEMU_RX_BUF +
+		HOSTEMU_BUF_SIZE * emu->rx_idx;
+	d->length = HOSTEMU_BUF_SIZE;
+	d->id = emu->rx_idx;
+	emu->rx_idx = snic_ring_next(emu->rx_idx);
+}
+
+static int hostemu_post_tx(struct hostemu *emu)
+{
+	int n = 0;
+	struct descriptor *d;
+
+	while (snic_ring_count(emu->tx_clean, emu->tx_idx) <
+	       SNIC_DESC_RING_LEN - 1) {
+		d = mem_desc(emu, HOSTEMU_TX_DESC, emu->tx_idx);
+		memset(d, 0, sizeof(*d));
+		d->addr = HOSTEMU_MEM_BASE + HOSTEMU_TX_BUF +
+			HOSTEMU_BUF_SIZE * emu->tx_idx;
+		d->length = emu->pktlen;
+		d->flags = SNIC_DESC_F_EOP;
+		d->id = emu->tx_idx;
+		emu->tx_idx = snic_ring_next(emu->tx_idx);
+		n++;
+	}
+
+	return n;
+}
+
+static int hostemu_desc_done(struct descriptor *d)
+{
+	return __atomic_load_n(&d->flags, __ATOMIC_ACQUIRE) &
+		SNIC_DESC_F_DD;
+}
+
+/* a minimal driver keeping both rings full */
+static void hostemu_run(struct hostemu *emu)
+{
+	int n;
+	char *pkt;
+	struct descriptor *d;
+	uint64_t start, last, now, tx_last = 0, rx_last = 0;
+
+	/* broadcast frames to be transmitted */
+	for (n = 0; n < SNIC_DESC_RING_LEN; n++) {
+		pkt = emu->mem + HOSTEMU_TX_BUF + HOSTEMU_BUF_SIZE * n;
+		memset(pkt, 0xff, 6);
+		memset(pkt + 6, 0, HOSTEMU_BUF_SIZE - 6);
+		pkt[6] = 0x02;
+		pkt[12] = 0x88;	/* local experimental ethertype */
+		pkt[13] = 0xb5;
+	}
+
+	hostemu_bar4_write32(emu, enabled, 1);
+	hostemu_bar4_write32(emu, features, 0);
+	hostemu_bar4_write32(emu, desc_version, SNIC_DESC_VERSION);
+	hostemu_bar4_write64(emu, tx_desc_base,
+			     HOSTEMU_MEM_BASE + HOSTEMU_TX_DESC);
+	hostemu_bar4_write64(emu, rx_desc_base,
+			     HOSTEMU_MEM_BASE + HOSTEMU_RX_DESC);
+	hostemu_bar4_write64(emu, stats_base, HOSTEMU_MEM_BASE + HOSTEMU_STATS);
+
+	for (n = 0; n < SNIC_DESC_RING_LEN - 1; n++)
+		hostemu_post_rx(emu);
+	hostemu_db_write32(emu, rx_desc_idx, emu->rx_idx);
+
+	start = last = now_ns();
+
+	while (!caught_signal) {
+
+		/* reclaim transmitted descriptors and post new ones */
+		if (emu->pktlen) {
+			while (emu->tx_clean != emu->tx_idx) {
+				d = mem_desc(emu, HOSTEMU_TX_DESC,
+					     emu->tx_clean);
+				if (!hostemu_desc_done(d))
+					break;
+				emu->tx_packets++;
+				emu->tx_bytes += emu->pktlen;
+				emu->tx_clean = snic_ring_next(emu->tx_clean);
+			}
+			if (hostemu_post_tx(emu))
+				hostemu_db_write32(emu, tx_desc_idx,
+						   emu->tx_idx);
+		}
+
+		/* reclaim received buffers and repost them */
+		n = 0;
+		while (1) {
+			d = mem_desc(emu, HOSTEMU_RX_DESC, emu->rx_clean);
+			if (!hostemu_desc_done(d))
+				break;
+			emu->rx_packets++;
+			emu->rx_bytes += d->length;
+			emu->rx_clean = snic_ring_next(emu->rx_clean);
+			hostemu_post_rx(emu);
+			n++;
+		}
+		if (n)
+			hostemu_db_write32(emu, rx_desc_idx, emu->rx_idx);
+
+		now = now_ns();
+		if (now - last < 1000000000ULL) {
+			sched_yield();
+			continue;
+		}
+
+		printf("%6.1fs: TX %.2f Mpps, RX %.2f Mpps, "
+		       "irq tx %lu rx %lu, MRd %lu MWr %lu, errors %lu\n",
+		       (now - start) / 1e9,
+		       (emu->tx_packets - tx_last) * 1e3 / (now - last),
+		       (emu->rx_packets - rx_last) * 1e3 / (now - last),
+		       emu->irqs[HOSTEMU_TX_VEC], emu->irqs[HOSTEMU_RX_VEC],
+		       emu->mrd, emu->mwr, emu->errors);
+		fflush(stdout);
+		tx_last = emu->tx_packets;
+		rx_last = emu->rx_packets;
+		last = now;
+	}
+
+	printf("TX %lu packets %lu bytes, RX %lu packets %lu bytes\n",
+	       emu->tx_packets, emu->tx_bytes, emu->rx_packets,
+	       emu->rx_bytes);
+}
+
+/* create the memfd for the transport, and wait for the device */
+static int hostemu_shm_listen(struct hostemu *emu, char *path)
+{
+	int fd, sock, accepted;
+	struct sockaddr_un sun;
+	struct nettlp_shm *shm;
+
+	fd = memfd_create("nettlp_shm", 0);
+	if (fd < 0) {
+		perror("memfd_create");
+		return -1;
+	}
+
+	if (ftruncate(fd, sizeof(*shm)) < 0) {
+		perror("ftruncate");
+		return -1;
+	}
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	if (shm == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	/* device info instead of NETTLP_MSG_GET_ALL */
+	shm->magic = NETTLP_SHM_MAGIC;
+	shm->version = NETTLP_SHM_VERSION;
+	shm->all.version = NETTLP_MSG_ALL_VERSION;
+	shm->all.dev_id = 0x0100;
+	shm->all.num_vec = 2;
+	shm->all.bar4_start = HOSTEMU_BAR4_START;
+	shm->all.nqueues = 1;
+	shm->all.msix[HOSTEMU_TX_VEC].addr = HOSTEMU_MSIX_ADDR;
+	shm->all.msix[HOSTEMU_TX_VEC].data = HOSTEMU_TX_VEC;
+	shm->all.msix[HOSTEMU_RX_VEC].addr = HOSTEMU_MSIX_ADDR;
+	shm->all.msix[HOSTEMU_RX_VEC].data = HOSTEMU_RX_VEC;
+	emu->shm = shm;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(sock, 1) < 0) {
+		perror("bind");
+		return -1;
+	}
+
+	printf("wait for nettlp_snic_device -S %s\n", path);
+	accepted = accept(sock, NULL, NULL);
+	if (accepted < 0) {
+		perror("accept");
+		return -1;
+	}
+
+	if (nettlp_shm_send_fd(accepted, fd) < 0) {
+		perror("sendmsg");
+		return -1;
+	}
+
+	close(accepted);
+	close(sock);
+	unlink(path);
+	close(fd);
+
+	return 0;
+}
+
+void sig_handler(int sig)
+{
+	caught_signal = 1;
+}
+
+void usage(void)
+{
+	printf("usage\n"
+	       "    -S UNIX socket path (default " HOSTEMU_SOCK_PATH ")\n"
+	       "    -l TX packet length (default 64, 0 disables TX)\n"
+		);
+}
+
+int main(int argc, char **argv)
+{
+	int ch;
+	char *path = HOSTEMU_SOCK_PATH;
+	struct hostemu emu;
+	pthread_t server_tid;
+
+	memset(&emu, 0, sizeof(emu));
+	emu.pktlen = 64;
+
+	while ((ch = getopt(argc, argv, "S:l:")) != -1) {
+		switch (ch) {
+		case 'S':
+			path = optarg;
+			break;
+		case 'l':
+			emu.pktlen = atoi(optarg);
+			if (emu.pktlen < 0 || emu.pktlen > HOSTEMU_BUF_SIZE) {
+				fprintf(stderr, "invalid packet length\n");
+				return -1;
+			}
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	emu.mem = mmap(NULL, HOSTEMU_MEM_SIZE, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (emu.mem == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	if (hostemu_shm_listen(&emu, path) < 0)
+		return -1;
+
+	if (signal(SIGINT, sig_handler) == SIG_ERR) {
+		perror("cannot set signal\n");
+		return -1;
+	}
+
+	pthread_create(&server_tid, NULL, hostemu_server_thread, &emu);
+
+	hostemu_run(&emu);
+
+	pthread_join(server_tid, NULL);
+
+	return 0;
+}
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/types.h>
+
+#include <nettlp_snic.h>
+#include <nettlp_pcap.h>
+
+/*
+ * Analyzer of TLP captures by nettlp_snic_device -p.
+ *
+ * It reports TLP counts and bytes per type and direction, MRd to CplD
+ * latencies by tag, and link utilization, to see how many TLPs a
+ * packet costs.
+ */
+
+/* per-TLP overhead on the link: STP token with sequence number (4)
+ * and LCRC (4), with 128b/130b encoding of Gen3 and later */
+#define TLP_LINK_OVERHEAD	8
+
+#define TLP_LINK_GBPS		63.0	/* Gen3 x8 after encoding */
+
+#define TLP_T_MRD	0
+#define TLP_T_MWR	1
+#define TLP_T_CPL	2
+#define TLP_T_CPLD	3
+#define TLP_T_OTHER	4
+#define TLP_T_MAX	5
+
+static const char *tlp_type_names[TLP_T_MAX] = {
+	"MRd", "MWr", "Cpl", "CplD", "other",
+};
+
+#define DIR_IN		0
+#define DIR_OUT		1
+
+struct tlp_count {
+	uint64_t tlps;
+	uint64_t bytes;		/* header and data */
+	uint64_t data;
+};
+
+struct tlp_tag {
+	uint64_t mrd_ts;	/* 0 if no MRd outstanding */
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+struct analyzer {
+	struct tlp_count count[2][TLP_T_MAX];
+	uint64_t wire[2];	/* bytes on the link */
+
+	/* MRd to CplD by tag */
+	struct tlp_tag tags[256];
+	uint64_t lat_hist[SNIC_LAT_HIST_BUCKETS];
+	uint64_t unmatched;
+
+	uint64_t first_ts, last_ts;
+	uint64_t nblocks;
+	int tsresol;		/* of the last IDB, digits of 10^-n */
+};
+
+static int tlp_type(uint8_t fmt_type)
+{
+	switch (NETTLP_TLP_TYPE(fmt_type)) {
+	case NETTLP_TLP_MRD:
+		return TLP_T_MRD;
+	case NETTLP_TLP_MWR:
+		return TLP_T_MWR;
+	case NETTLP_TLP_CPL:
+		return TLP_T_CPL;
+	case NETTLP_TLP_CPLD:
+		return TLP_T_CPLD;
+	}
+
+	return TLP_T_OTHER;
+}
+
+/* returns the value of option code in the options of a block, or
+ * NULL if not found */
+static uint8_t *pcapng_opt(uint8_t *opt, uint32_t len, uint16_t code,
+			   uint16_t *olen)
+{
+	uint16_t c, l;
+
+	while (len >= 4) {
+		memcpy(&c, opt, 2);
+		memcpy(&l, opt + 2, 2);
+		if (c == PCAPNG_OPT_END || 4U + pcapng_pad(l) > len)
+			break;
+		if (c == code) {
+			*olen = l;
+			return opt + 4;
+		}
+		opt += 4 + pcapng_pad(l);
+		len -= 4 + pcapng_pad(l);
+	}
+
+	return NULL;
+}
+
+static void analyze_tlp(struct analyzer *a, uint64_t ts, int dir,
+			uint8_t *p, uint32_t caplen, uint32_t origlen)
+{
+	int type;
+	uint8_t tag;
+	uint32_t hlen, len;
+	uint64_t lat;
+	struct tlp_count *c;
+	struct tlp_tag *t;
+
+	if (caplen < NETTLP_PCAP_NETTLP_HDR + 12)
+		return;
+
+	p += NETTLP_PCAP_NETTLP_HDR;
+	hlen = nettlp_tlp_hdr_len(p[0]);
+	len = origlen - NETTLP_PCAP_NETTLP_HDR;
+	type = tlp_type(p[0]);
+
+	c = &a->count[dir][type];
+	c->tlps++;
+	c->bytes += len;
+	c->data += len > hlen ? len - hlen : 0;
+	a->wire[dir] += len + TLP_LINK_OVERHEAD;
+
+	if (!a->first_ts || ts < a->first_ts)
+		a->first_ts = ts;
+	if (ts > a->last_ts)
+		a->last_ts = ts;
+
+	if (type == TLP_T_MRD && dir == DIR_OUT) {
+		tag = p[6];
+		a->tags[tag].mrd_ts = ts;
+	} else if ((type == TLP_T_CPLD || type == TLP_T_CPL) &&
+		   dir == DIR_IN) {
+		tag = p[10];
+		t = &a->tags[tag];
+		if (!t->mrd_ts) {
+			a->unmatched++;
+			return;
+		}
+		lat = ts > t->mrd_ts ? ts - t->mrd_ts : 0;
+		t->mrd_ts = 0;
+		t->sum += lat;
+		if (!t->count || lat < t->min)
+			t->min = lat;
+		if (lat > t->max)
+			t->max = lat;
+		t->count++;
+		a->lat_hist[snic_lat_hist_index(lat)]++;
+	}
+}
+
+static int analyze(struct analyzer *a, FILE *fp)
+{
+	struct nettlp_pcap_block b;
+	struct nettlp_pcap_epb *epb;
+	uint8_t *buf;
+	uint8_t *opt;
+	uint16_t olen;
+	uint32_t *bom, flags, off;
+	uint64_t ts, scale = 1;
+	int n, dir;
+
+	buf = malloc(1 << 16);
+	if (!buf)
+		return -1;
+
+	while (fread(&b, sizeof(b), 1, fp) == 1) {
+		if (b.len < 12 || b.len > (1 << 16) || b.len % 4) {
+			fprintf(stderr, "invalid block length %u\n", b.len);
+			goto err;
+		}
+		memcpy(buf, &b, sizeof(b));
+		if (fread(buf + sizeof(b), b.len - sizeof(b), 1, fp) != 1) {
+			fprintf(stderr, "truncated block\n");
+			goto err;
+		}
+		a->nblocks++;
+
+		switch (b.type) {
+		case PCAPNG_SHB:
+			bom = (uint32_t *)(buf + 8);
+			if (*bom != PCAPNG_BYTE_ORDER) {
+				fprintf(stderr, "byte order is not native\n");
+				goto err;
+			}
+			break;
+		case PCAPNG_IDB:
+			/* usec by default. nettlp_snic_device writes nsec */
+			a->tsresol = 6;
+			opt = pcapng_opt(buf + 16, b.len - 20,
+					 PCAPNG_OPT_IF_TSRESOL, &olen);
+			if (opt && olen == 1 && !(*opt & 0x80))
+				a->tsresol = *opt;
+			for (scale = 1, n = a->tsresol; n < 9; n++)
+				scale *= 10;
+			break;
+		case PCAPNG_EPB:
+			epb = (struct nettlp_pcap_epb *)buf;
+			if (sizeof(*epb) + pcapng_pad(epb->caplen) + 4 >
+			    b.len)
+				goto err;
+			ts = (((uint64_t)epb->ts_high << 32) | epb->ts_low) *
+				scale;
+			off = sizeof(*epb) + pcapng_pad(epb->caplen);
+			flags = 0;
+			opt = pcapng_opt(buf + off, b.len - off - 4,
+					 PCAPNG_OPT_EPB_FLAGS, &olen);
+			if (opt && olen == 4)
+				memcpy(&flags, opt, 4);
+			dir = (flags & 0x3) == NETTLP_PCAP_OUTBOUND ?
+				DIR_OUT : DIR_IN;
+			analyze_tlp(a, ts, dir, buf + sizeof(*epb),
+				    epb->caplen, epb->origlen);
+			break;
+		default:
+			break;	/* ignore other blocks */
+		}
+	}
+
+	free(buf);
+	return 0;
+
+err:
+	free(buf);
+	return -1;
+}
+
+static void report(struct analyzer *a, double gbps, uint64_t npkts)
+{
+	int d, t, n;
+	uint64_t tlps[2] = { 0, 0 }, count = 0, sum = 0;
+	double sec = (a->last_ts - a->first_ts) / 1e9;
+	static const char *dir_names[2] = { "inbound", "outbound" };
+
+	printf("%-8s %-6s %12s %14s %14s", "dir", "type", "TLPs",
+	       "bytes", "data bytes");
+	if (npkts)
+		printf(" %10s", "TLPs/pkt");
+	printf("\n");
+
+	for (d = 0; d < 2; d++) {
+		for (t = 0; t < TLP_T_MAX; t++) {
+			struct tlp_count *c = &a->count[d][t];
+
+			tlps[d] += c->tlps;
+			if (!c->tlps)
+				continue;
+			printf("%-8s %-6s %12lu %14lu %14lu", dir_names[d],
+			       tlp_type_names[t], c->tlps, c->bytes, c->data);
+			if (npkts)
+				printf(" %10.2f", (double)c->tlps / npkts);
+			printf("\n");
+		}
+	}
+	if (npkts)
+		printf("total %.2f TLPs/pkt (%lu inbound, %lu outbound)\n",
+		       (double)(tlps[0] + tlps[1]) / npkts, tlps[0], tlps[1]);
+
+	printf("\nMRd to CplD latency (ns)\n");
+	printf("%-5s %10s %10s %10s %10s\n", "tag", "count", "min", "avg",
+	       "max");
+	for (n = 0; n < 256; n++) {
+		struct tlp_tag *tg = &a->tags[n];
+
+		if (!tg->count)
+			continue;
+		count += tg->count;
+		sum += tg->sum;
+		printf("%-5d %10lu %10lu %10lu %10lu\n", n, tg->count,
+		       tg->min, tg->sum / tg->count, tg->max);
+	}
+	if (count)
+		printf("all   %10lu avg %lu p50 %lu p90 %lu p99 %lu\n", count,
+		       sum / count,
+		       snic_lat_hist_percentile(a->lat_hist, 50),
+		       snic_lat_hist_percentile(a->lat_hist, 90),
+		       snic_lat_hist_percentile(a->lat_hist, 99));
+	if (a->unmatched)
+		printf("%lu completions without MRd\n", a->unmatched);
+
+	printf("\nlink utilization over %.6f sec, %.1f Gbps per direction\n",
+	       sec, gbps);
+	for (d = 0; d < 2; d++) {
+		double g = sec > 0 ? a->wire[d] * 8 / sec / 1e9 : 0;
+
+		printf("%-8s %10.3f Gbps %6.2f %%\n", dir_names[d], g,
+		       g / gbps * 100);
+	}
+}
+
+void usage(void)
+{
+	printf("usage: nettlp_tlp_analyze [options] PCAPNG\n"
+	       "    -b link bandwidth in Gbps per direction "
+	       "(default %.1f)\n"
+	       "    -n number of packets, to report TLPs per packet\n",
+	       TLP_LINK_GBPS);
+}
+
+int main(int argc, char **argv)
+{
+	int ch;
+	FILE *fp;
+	double gbps = TLP_LINK_GBPS;
+	uint64_t npkts = 0;
+	static struct analyzer a;
+
+	while ((ch = getopt(argc, argv, "b:n:h")) != -1) {
+		switch (ch) {
+		case 'b':
+			gbps = atof(optarg);
+			if (gbps <= 0) {
+				fprintf(stderr, "invalid bandwidth\n");
+				return -1;
+			}
+			break;
+		case 'n':
+			npkts = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage();
+		return -1;
+	}
+
+	fp = fopen(argv[optind], "r");
+	if (!fp) {
+		perror("fopen");
+		return -1;
+	}
+
+	if (analyze(&a, fp) < 0) {
+		fprintf(stderr, "failed to read %s after %lu blocks\n",
+			argv[optind], a.nblocks);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	report(&a, gbps, npkts);
+
+	return 0;
+}
@@ -30,6 +30,8 @@ struct nettlp_sock {
 	uint64_t	bar4_start;	/* physical addr of BAR4 for msg 1 */
 	struct nettlp_msg_id id;	/** device id for msg 2 */
 	struct nettlp_msix msix[NETTLP_MAX_VEC]; /* MSIX table on BAR2 */
+
+	struct nettlp_msg_all all;	/* reply for NETTLP_MSG_GET_ALL */
 };
 
 struct nettlp_sock *nsock = NULL;	/* XXX: terrified */
@@ -85,13 +87,18 @@ static int nettlp_msg_rcv(struct sock *sk, struct sk_buff *skb)
 		iov[0].iov_base = &ns->msix;
 		iov[0].iov_len = sizeof(struct nettlp_msix) * NETTLP_MAX_VEC;
 		break;
+	case NETTLP_MSG_GET_ALL:
+		iov[0].iov_base = &ns->all;
+		iov[0].iov_len = sizeof(ns->all);
+		break;
+	default:
+		pr_debug("%s: unknown request %d\n", __func__, req);
+		goto drop;
 	}
 
 	ret = kernel_sendmsg(ns->sock, &msg, iov, 1, iov[0].iov_len);
-	if (ret < 0) {
+	if (ret < 0)
 		pr_err("%s: failed to send reply\n", __func__);
-		return ret;
-	}
 
 drop:
 	kfree_skb(skb);
@@ -164,13 +171,22 @@ int nettlp_msg_init(uint64_t bar4_start, uint16_t dev_id, void *bar2_virt)
 	ns->id.id = dev_id;
 	nettlp_msg_get_msix_table(bar2_virt, ns->msix);
 
+	ns->all.version = NETTLP_MSG_ALL_VERSION;
+	ns->all.dev_id = dev_id;
+	ns->all.num_vec = NETTLP_MAX_VEC;
+	ns->all.bar4_start = bar4_start;
+	BUILD_BUG_ON(sizeof(ns->all.msix) != sizeof(ns->msix));
+	memcpy(ns->all.msix, ns->msix, sizeof(ns->all.msix));
+
 	/* open UDP socket for receiving requests */
 	memset(&udp_conf, 0, sizeof(udp_conf));
 	udp_conf.family = AF_INET;
 	udp_conf.local_udp_port = htons(NETTLP_MSG_PORT);
 	err = udp_sock_create(&init_net, &udp_conf, &sock);
-	if (err < 0)
+	if (err < 0) {
+		kfree(ns);
 		return err;
+	}
 	ns->sock = sock;
 
 	/* setup callback on udp tunnel */
@@ -189,6 +205,18 @@ int nettlp_msg_init(uint64_t bar4_start, uint16_t dev_id, void *bar2_virt)
 	return 0;
 }
 
+/* fill the device information only in NETTLP_MSG_GET_ALL */
+void nettlp_msg_set_dev_info(uint64_t bar0_start, uint64_t bar2_start,
+			     uint32_t features, uint32_t nqueues)
+{
+	if (!nsock)
+		return;
+
+	nsock->all.bar0_start = bar0_start;
+	nsock->all.bar2_start = bar2_start;
+	nsock->all.features = features;
+	nsock->all.nqueues = nqueues;
+}
 
 void nettlp_msg_fini(void)
 {
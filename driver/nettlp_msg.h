@@ -2,13 +2,15 @@
 #ifndef _NETTLP_MSG_H_
 #define _NETTLP_MSG_H_
 
+#include <nettlp_msg_all.h>
 
-#define NETTLP_MSG_PORT 12287   /* NETTLP_PORT_BASE - 1 */
+/* NETTLP_MSG_PORT is defined in nettlp_msg_all.h */
 
 /* request types */
 #define NETTLP_MSG_GET_BAR4_ADDR        1
 #define NETTLP_MSG_GET_DEV_ID		2
 #define NETTLP_MSG_GET_MSIX_TABLE       3
+/* NETTLP_MSG_GET_ALL is defined in nettlp_msg_all.h */
 
 
 /* NETTLP_MSG_GET_BAR4_ADDR */
@@ -38,6 +40,8 @@ struct nettlp_msg_msix_table {
 
 
 int nettlp_msg_init(uint64_t bar4_start, uint16_t dev_id, void *bar2_virt);
+void nettlp_msg_set_dev_info(uint64_t bar0_start, uint64_t bar2_start,
+			     uint32_t features, uint32_t nqueues);
 void nettlp_msg_fini(void);
 
 #endif 
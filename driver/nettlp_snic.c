@@ -6,7 +6,13 @@
 #include <linux/pci.h>
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
-#include <net/ip_tunnels.h>
+#include <linux/ethtool.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/if_vlan.h>
+#include <linux/bpf.h>
+#include <linux/bpf_trace.h>
+#include <net/xdp.h>
+#include <net/page_pool.h>
 
 #include <nettlp_snic.h>
 #include "nettlp_msg.h"
@@ -18,7 +24,95 @@
 #define DRV_NAME		"nettlp_snic_driver"
 #define NETTLP_SNIC_VERSION	"0.0.1"
 
-#define SNIC_DESC_RING_LEN	1
+#define SNIC_NUM_QUEUES		1	/* max, set by ethtool -L */
+
+/* MSI-X vectors of a queue */
+#define SNIC_TX_VEC(q)		(2 * (q))
+#define SNIC_RX_VEC(q)		(2 * (q) + 1)
+#define SNIC_RX_BUF_SIZE	2048
+#define SNIC_RX_HEADROOM	XDP_PACKET_HEADROOM
+
+#define SNIC_FLOW_CMD_TIMEOUT	1000	/* x 100-200 usec */
+
+/* TX watchdog. NetTLP carries TLPs over UDP, and a lost interrupt or
+ * descriptor write-back leaves the queue stopped */
+#define SNIC_TX_TIMEOUT		(5 * HZ)
+#define SNIC_RESET_TIMEOUT	1000	/* x 100-200 usec */
+
+static bool packed_ring = false;
+module_param(packed_ring, bool, 0444);
+MODULE_PARM_DESC(packed_ring, "use packed descriptor rings (default false)");
+
+/* packets up to tx_copybreak are copied into pre-mapped bounce
+ * buffers instead of mapping the skb */
+#define SNIC_TX_BOUNCE_SIZE	256
+static unsigned int tx_copybreak = SNIC_TX_BOUNCE_SIZE;
+module_param(tx_copybreak, uint, 0644);
+MODULE_PARM_DESC(tx_copybreak, "max TX packet size copied into bounce "
+		 "buffers (default 256, 0 disables)");
+
+/* header split: the device DMAs headers into small coherent buffers
+ * and the payload into the page, which is passed to the stack as a
+ * frag without copy. XDP is not supported in this mode. */
+static bool hdr_split = false;
+module_param(hdr_split, bool, 0444);
+MODULE_PARM_DESC(hdr_split, "split RX headers into separate buffers "
+		 "(default false)");
+
+/* initial values of /sys/class/net/DEV/napi_defer_hard_irqs and
+ * gro_flush_timeout. Sockets busy-poll the NAPI with SO_BUSY_POLL or
+ * net.core.busy_read, and the device interrupts are masked while
+ * busy polling or hard irqs are deferred. */
+static unsigned int napi_defer_hard_irqs;
+module_param(napi_defer_hard_irqs, uint, 0444);
+MODULE_PARM_DESC(napi_defer_hard_irqs, "number of empty NAPI polls before "
+		 "unmasking interrupts (default 0)");
+
+static unsigned long gro_flush_timeout;
+module_param(gro_flush_timeout, ulong, 0444);
+MODULE_PARM_DESC(gro_flush_timeout, "nsec to defer NAPI when hard irqs "
+		 "are deferred (default 0)");
+
+
+/* per-queue counters maintained by the driver */
+struct snic_queue_counters {
+	u64	packets;
+	u64	bytes;
+	u64	drops;
+	u64	ring_full;	/* no descriptor available */
+	u64	irqs;
+	u64	polls;		/* NAPI polls */
+	u64	doorbells;	/* index updates written to BAR4 */
+	u64	xdp_drops;
+	u64	xdp_tx;
+	u64	xdp_redirects;
+	u64	copybreak;	/* packets sent via bounce buffers */
+	u64	busy_polls;	/* NAPI polls from busy polling sockets */
+	u64	lro;		/* frames coalesced by the device */
+	u64	csum_errors;	/* checksum errors found by the device */
+	u64	timeouts;	/* TX watchdog expirations */
+	u64	resets;		/* TX ring resets after a timeout */
+};
+
+/* Counters are per-CPU so that CPUs do not bounce a shared cache
+ * line. Updates disable local irqs so that hard irq handlers and
+ * NAPI can share a single syncp per CPU. */
+struct snic_pcpu_stats {
+	struct snic_queue_counters	tx[SNIC_NUM_QUEUES];
+	struct snic_queue_counters	rx[SNIC_NUM_QUEUES];
+	struct u64_stats_sync		syncp;
+};
+
+#define snic_stats_add(adapter, dir, qn, field, n) do {			\
+		unsigned long __flags;					\
+		struct snic_pcpu_stats *__s =				\
+			this_cpu_ptr((adapter)->pcpu_stats);		\
+		__flags = u64_stats_update_begin_irqsave(&__s->syncp);	\
+		__s->dir[qn].field += (n);				\
+		u64_stats_update_end_irqrestore(&__s->syncp, __flags);	\
+	} while (0)
+#define snic_stats_inc(adapter, dir, qn, field)			\
+	snic_stats_add(adapter, dir, qn, field, 1)
 
 
 /* netdev private date structure (netdev_priv). pci_drvdata is netdev */
@@ -28,6 +122,7 @@ struct nettlp_snic_adapter {
 	struct net_device *dev;
 
 	struct snic_bar4 *bar4;	/* ioremaped virt addr of BAR4 */
+	struct snic_doorbell *db;	/* doorbells of queue 0 in BAR4 */
 	struct snic_bar0 *bar0;	/* ioremaped virt addr of BAR0 */
 	void *bar2;	/* ioremapped BAR2 for MSIX */
 
@@ -36,143 +131,650 @@ struct nettlp_snic_adapter {
 	dma_addr_t tx_desc_paddr;	/* phy addr of tx_desc */
 	dma_addr_t rx_desc_paddr;	/* phy addr of rx_desc */
 
-	struct rx_buf *rx_bufs;		/* rx packet buffers */
+	uint32_t	tx_desc_idx;	/* TX tail, next desc to be used */
+	uint32_t	tx_clean_idx;	/* next TX desc to be completed */
+	uint32_t	rx_desc_idx;	/* RX tail, next desc to be posted */
+	uint32_t	rx_clean_idx;	/* next RX desc to be received */
+
+	/* packed ring mode and its wrap counters for the indexes */
+	bool		packed;
+	int		tx_avail_wrap, tx_used_wrap;
+	int		rx_avail_wrap, rx_used_wrap;
+
+	/* buffers on the TX ring to be freed on completion */
+	struct snic_tx_buf {
+		int		type;
+#define SNIC_TX_BUF_SKB		0	/* mapped skb */
+#define SNIC_TX_BUF_XDP_TX	1	/* page pool page from XDP_TX */
+#define SNIC_TX_BUF_XDP_NDO	2	/* mapped frame from ndo_xdp_xmit */
+#define SNIC_TX_BUF_BOUNCE	3	/* copied into the bounce buffer */
+		union {
+			struct sk_buff		*skb;
+			struct xdp_frame	*xdpf;
+		};
+		dma_addr_t	dma;
+		unsigned int	len;
+	} tx_bufs[SNIC_DESC_RING_LEN];
+
+	/* TX ring is shared by xmit, XDP_TX, and ndo_xdp_xmit */
+	spinlock_t	tx_lock;
+	struct work_struct tx_reset_work;	/* after TX timeout */
 
-	uint32_t	tx_desc_idx;	/* index of TX desc to be sent */
-	uint32_t	rx_desc_idx;	/* index of RX desc for next buf 
-					 * XXX: in simple NIC, always 0.
-					 */
+	/* SNIC_TX_BOUNCE_SIZE bounce buffer for each TX desc */
+	void		*tx_bounce;
+	dma_addr_t	tx_bounce_paddr;
 
-	spinlock_t	tx_lock;
-	int		tx_state;
-#define TX_STATE_READY	1
-#define TX_STATE_BUSY	2
-	/* when tx_state is ready, start xmit and set tx_tate busy.
-	 * tx_irq_handler set tx_state ready.
-	 */
-
-	spinlock_t	rx_lock;
-	struct tasklet_struct	*rx_tasklet;
-
-	/* one rx packet buffer */
-	void		*rx_buf;
-	dma_addr_t	rx_buf_paddr;
+	/* SNIC_RX_HDR_SIZE header buffer for each RX desc, if hdr_split */
+	void		*rx_hdr;
+	dma_addr_t	rx_hdr_paddr;
+
+	/* queues in use, and the cpu serving the vectors of each */
+	unsigned int		num_queues;
+	int			queue_cpu[SNIC_NUM_QUEUES];
+
+	/* TX completion and RX are done in NAPI */
+	struct napi_struct	napi;
+	bool			irq_masked;	/* last written irq_mask */
+
+	/* rx packet buffers. a page from page_pool for each RX desc.
+	 * NULL if the page is passed to XDP_TX or XDP_REDIRECT */
+	struct page_pool	*page_pool;
+	struct page		*rx_pages[SNIC_DESC_RING_LEN];
+
+	/* a frame spanning descriptors being received, or dropping the
+	 * rest of one */
+	struct sk_buff		*rx_skb;
+	bool			rx_discard;
+
+	struct bpf_prog		*xdp_prog;
+	struct xdp_rxq_info	xdp_rxq;
+
+	/* counters DMA-written by the device */
+	struct snic_stats	*dev_stats;
+	dma_addr_t		dev_stats_paddr;
+
+	/* flow rules programmed by ethtool -N, and the command buffer
+	 * read by the device. Serialized by rtnl */
+	struct snic_flow_cmd	*flow_cmd;
+	dma_addr_t		flow_cmd_paddr;
+	struct ethtool_rx_flow_spec *flow_specs;
+	DECLARE_BITMAP(flow_locs, SNIC_FLOW_RULES);
+
+	struct snic_pcpu_stats __percpu *pcpu_stats;
 };
 
-#define next_index(idx) (((idx + 1) % SNIC_DESC_RING_LEN) - 1)
+#define snic_tx_bounce(adapter, idx)					\
+	((adapter)->tx_bounce + SNIC_TX_BOUNCE_SIZE * (idx))
+#define snic_tx_bounce_paddr(adapter, idx)				\
+	((adapter)->tx_bounce_paddr + SNIC_TX_BOUNCE_SIZE * (idx))
+
+#define snic_rx_hdr(adapter, idx)					\
+	((adapter)->rx_hdr + SNIC_RX_HDR_SIZE * (idx))
+
+#define snic_tx_avail(adapter)						\
+	(SNIC_DESC_RING_LEN - 1 -					\
+	 snic_ring_count((adapter)->tx_clean_idx, (adapter)->tx_desc_idx))
 
 
-#if 0
-static int nettlp_setup_rx_buf(struct net_device *dev)
+/* advance a ring index by one, flipping the wrap counter on wrap */
+static inline uint32_t snic_ring_inc(uint32_t idx, int *wrap)
 {
-	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+	idx = snic_ring_next(idx);
+	if (idx == 0)
+		*wrap = !*wrap;
+	return idx;
+}
 
-	/* allocate first rx packet buffer */
-	adapter->rx_skb = netdev_alloc_skb(dev, 2048);
-	if (!adapter->rx_skb) {
-		pr_err("%s: failed to alloc skb\n", __func__);
-		return -ENOMEM;
+/* whether the device has completed the descriptor */
+static inline bool snic_desc_is_done(struct nettlp_snic_adapter *adapter,
+				     struct descriptor *d, int used_wrap)
+{
+	uint16_t flags = READ_ONCE(d->flags);
+
+	if (adapter->packed)
+		return snic_pdesc_is_used(flags, used_wrap);
+	return flags & SNIC_DESC_F_DD;
+}
+
+/* hand a descriptor filled except flags to the device */
+static inline void snic_desc_post(struct nettlp_snic_adapter *adapter,
+				  struct descriptor *d, uint16_t flags,
+				  int avail_wrap)
+{
+	if (adapter->packed) {
+		/* the device must see the other fields before AVAIL */
+		dma_wmb();
+		flags |= snic_pdesc_avail_flags(avail_wrap);
+	}
+	WRITE_ONCE(d->flags, flags);
+}
+
+/* post the rx buffer for the desc at the RX tail, and advance it */
+static int nettlp_snic_post_rx_desc(struct nettlp_snic_adapter *adapter)
+{
+	dma_addr_t dma;
+	struct page *page;
+	uint32_t idx = adapter->rx_desc_idx;
+	struct descriptor *d = &adapter->rx_desc[idx];
+
+	page = adapter->rx_pages[idx];
+	if (!page) {
+		page = page_pool_dev_alloc_pages(adapter->page_pool);
+		if (!page)
+			return -ENOMEM;
+		adapter->rx_pages[idx] = page;
 	}
-	adapter->rx_desc->addr = dma_map_single(&adapter->pdev->dev,
-						skb_mac_header(adapter->rx_skb),
-						2048, DMA_FROM_DEVICE);
-	adapter->rx_desc->length = 2048;
+
+	dma = page_pool_get_dma_addr(page) + SNIC_RX_HEADROOM;
+	dma_sync_single_for_device(&adapter->pdev->dev, dma,
+				   SNIC_RX_BUF_SIZE, DMA_BIDIRECTIONAL);
+
+	d->addr = dma;
+	d->length = SNIC_RX_BUF_SIZE;
+	d->vlan = 0;
+	d->id = idx;
+	snic_desc_post(adapter, d, 0, adapter->rx_avail_wrap);
+
+	adapter->rx_desc_idx = snic_ring_inc(idx, &adapter->rx_avail_wrap);
 
 	return 0;
 }
-#endif
 
+/* post rx buffers up to the ring size except one to distinguish
+ * full from empty. returns the number of posted buffers */
+static int nettlp_snic_refill_rx_ring(struct nettlp_snic_adapter *adapter)
+{
+	int n = 0;
+
+	while (snic_ring_count(adapter->rx_clean_idx, adapter->rx_desc_idx) <
+	       SNIC_DESC_RING_LEN - 1) {
+		if (nettlp_snic_post_rx_desc(adapter) < 0) {
+			snic_stats_inc(adapter, rx, 0, ring_full);
+			break;
+		}
+		n++;
+	}
+
+	return n;
+}
 
-void rx_tasklet(unsigned long data)
+static void nettlp_snic_init_rx_ring(struct nettlp_snic_adapter *adapter)
 {
-	unsigned long flags;
-	struct nettlp_snic_adapter *adapter =
-		(struct nettlp_snic_adapter *)data;
-	struct sk_buff *skb;
+	memset(adapter->rx_desc, 0,
+	       sizeof(struct descriptor) * SNIC_DESC_RING_LEN);
+
+	adapter->rx_clean_idx = 0;
+	adapter->rx_desc_idx = 0;
+	adapter->rx_avail_wrap = 1;
+	adapter->rx_used_wrap = 1;
+
+	nettlp_snic_refill_rx_ring(adapter);
+}
+
+static void nettlp_snic_free_rx_ring(struct nettlp_snic_adapter *adapter)
+{
+	int n;
+
+	for (n = 0; n < SNIC_DESC_RING_LEN; n++) {
+		if (!adapter->rx_pages[n])
+			continue;
+		page_pool_put_full_page(adapter->page_pool,
+					adapter->rx_pages[n], false);
+		adapter->rx_pages[n] = NULL;
+	}
+}
+
+/* put a buffer on the TX ring. Called with tx_lock held, and the
+ * caller rings the doorbell. */
+static void nettlp_snic_tx_post(struct nettlp_snic_adapter *adapter,
+				int type, void *ptr, dma_addr_t dma,
+				unsigned int len, uint16_t flags, uint16_t vlan)
+{
+	uint32_t idx = adapter->tx_desc_idx;
+	struct snic_tx_buf *buf = &adapter->tx_bufs[idx];
+	struct descriptor *tx_desc = &adapter->tx_desc[idx];
+
+	buf->type = type;
+	if (type == SNIC_TX_BUF_SKB)
+		buf->skb = ptr;
+	else
+		buf->xdpf = ptr;
+	buf->dma = dma;
+	buf->len = len;
+
+	tx_desc->addr = dma;
+	tx_desc->length = len;
+	tx_desc->vlan = vlan;
+	tx_desc->id = idx;
+	snic_desc_post(adapter, tx_desc, SNIC_DESC_F_EOP | flags,
+		       adapter->tx_avail_wrap);
 
-	pr_err("rx_tasklet!\n");
+	adapter->tx_desc_idx = snic_ring_inc(idx, &adapter->tx_avail_wrap);
 
-	spin_lock_irqsave(&adapter->rx_lock, flags);
+	snic_stats_inc(adapter, tx, 0, packets);
+	snic_stats_add(adapter, tx, 0, bytes, len);
+}
 
+/* notify the device to start DMA. Called with tx_lock held */
+static void nettlp_snic_tx_doorbell(struct nettlp_snic_adapter *adapter)
+{
+	writel(adapter->tx_desc_idx, &adapter->db->tx_desc_idx);
+	snic_stats_inc(adapter, tx, 0, doorbells);
+}
 
+/* transmit a frame converted from XDP_TX on the rx page */
+static int nettlp_snic_xdp_tx(struct nettlp_snic_adapter *adapter,
+			      struct xdp_buff *xdp, struct page *page)
+{
+	dma_addr_t dma;
+	unsigned long flags;
+	struct xdp_frame *xdpf;
 
-	/*
-	 * RX interrupt means DMA to the rx buffer is done.
-	 * finish building rx skb and receive it to upper protocols.
-	 */
-	pr_info("%s: start\n", __func__);
+	xdpf = xdp_convert_buff_to_frame(xdp);
+	if (unlikely(!xdpf))
+		return -EOVERFLOW;
 
-	/* prepare rx desc for read */
-	dma_unmap_single(&adapter->pdev->dev, adapter->rx_desc_paddr,
-			 sizeof(struct descriptor), DMA_BIDIRECTIONAL);
+	dma = page_pool_get_dma_addr(page) +
+		(xdpf->data - page_address(page));
+	dma_sync_single_for_device(&adapter->pdev->dev, dma, xdpf->len,
+				   DMA_BIDIRECTIONAL);
 
-	dma_unmap_single(&adapter->pdev->dev, adapter->rx_desc->addr, 2048,
-			 DMA_FROM_DEVICE);
+	spin_lock_irqsave(&adapter->tx_lock, flags);
+	if (snic_tx_avail(adapter) == 0) {
+		snic_stats_inc(adapter, tx, 0, ring_full);
+		spin_unlock_irqrestore(&adapter->tx_lock, flags);
+		xdp_return_frame_rx_napi(xdpf);
+		return -ENOSPC;
+	}
+	nettlp_snic_tx_post(adapter, SNIC_TX_BUF_XDP_TX, xdpf, dma,
+			    xdpf->len, 0, 0);
+	spin_unlock_irqrestore(&adapter->tx_lock, flags);
 
-	pr_info("%s: packet length is %llu\n", __func__,
-		adapter->rx_desc->length);
+	return 0;
+}
 
-	pr_info("%s: build rx skb like sume\n", __func__);
+/* run XDP program on the received buffer. returns XDP_PASS if the
+ * packet goes to the stack, XDP_DROP if the page is to be recycled,
+ * or XDP_TX/XDP_REDIRECT if the page is consumed. */
+static u32 nettlp_snic_run_xdp(struct nettlp_snic_adapter *adapter,
+			       struct bpf_prog *prog, struct xdp_buff *xdp,
+			       struct page *page)
+{
+	int rc;
+	u32 act;
+
+	act = bpf_prog_run_xdp(prog, xdp);
+	switch (act) {
+	case XDP_PASS:
+		return XDP_PASS;
+	case XDP_TX:
+		rc = nettlp_snic_xdp_tx(adapter, xdp, page);
+		if (rc == -EOVERFLOW)
+			goto drop;	/* not converted, page is still ours */
+		if (rc < 0) {
+			/* the frame is returned to the pool on failure */
+			snic_stats_inc(adapter, rx, 0, xdp_drops);
+			return XDP_TX;
+		}
+		snic_stats_inc(adapter, rx, 0, xdp_tx);
+		return XDP_TX;
+	case XDP_REDIRECT:
+		if (xdp_do_redirect(adapter->dev, xdp, prog) < 0)
+			goto drop;
+		snic_stats_inc(adapter, rx, 0, xdp_redirects);
+		return XDP_REDIRECT;
+	default:
+		bpf_warn_invalid_xdp_action(act);
+		fallthrough;
+	case XDP_ABORTED:
+		trace_xdp_exception(adapter->dev, prog, act);
+		fallthrough;
+	case XDP_DROP:
+	drop:
+		snic_stats_inc(adapter, rx, 0, xdp_drops);
+		return XDP_DROP;
+	}
+}
+
+/* SNIC_F_* requested to the device */
+static u32 nettlp_snic_features(netdev_features_t features)
+{
+	return (packed_ring ? SNIC_F_PACKED_RING : 0) |
+		(hdr_split ? SNIC_F_HDR_SPLIT : 0) |
+		(features & NETIF_F_LRO ? SNIC_F_LRO : 0) |
+		(features & NETIF_F_RXCSUM ? SNIC_F_RXCSUM : 0) |
+		(features & NETIF_F_HW_VLAN_CTAG_RX ? SNIC_F_VLAN_STRIP : 0);
+}
+
+/* build an skb of a frame from frags: a header-split packet, or a
+ * frame spanning descriptors coalesced by the device. The headers are
+ * copied to the linear area from the header buffer or the head of the
+ * first buffer, and the rest stays in the pages as frags. A page in
+ * the skb leaves the pool, and a new one is posted. Returns the skb
+ * on the last descriptor of the frame, or NULL. */
+static struct sk_buff *nettlp_snic_rx_chain(struct nettlp_snic_adapter *adapter,
+					    uint32_t idx, struct descriptor *d,
+					    uint32_t len, bool xdp)
+{
+	struct sk_buff *skb = adapter->rx_skb;
+	struct page *page = adapter->rx_pages[idx];
+	uint32_t off = 0;
+
+	if (adapter->rx_discard)
+		goto discard;
 
-	skb = netdev_alloc_skb_ip_align(adapter->dev,
-					adapter->rx_desc->length +
-					NET_IP_ALIGN);
 	if (!skb) {
-		adapter->dev->stats.rx_dropped++;
-		pr_err("%s: failed to allocate rx skb\n", __func__);
-		goto out;
+		/* XDP needs the whole frame in a buffer */
+		if (xdp) {
+			snic_stats_inc(adapter, rx, 0, xdp_drops);
+			goto discard;
+		}
+
+		if (d->flags & SNIC_DESC_F_SPLIT) {
+			skb = napi_alloc_skb(&adapter->napi, d->wb.hdr_len);
+			if (skb)
+				skb_put_data(skb, snic_rx_hdr(adapter, idx),
+					     d->wb.hdr_len);
+		} else {
+			off = min_t(uint32_t, len, SNIC_RX_HDR_SIZE);
+			skb = napi_alloc_skb(&adapter->napi, off);
+			if (skb)
+				skb_put_data(skb, page_address(page) +
+					     SNIC_RX_HEADROOM, off);
+		}
+		if (!skb) {
+			snic_stats_inc(adapter, rx, 0, drops);
+			goto discard;
+		}
+	}
+
+	if (len > off) {
+		if (skb_shinfo(skb)->nr_frags == MAX_SKB_FRAGS) {
+			snic_stats_inc(adapter, rx, 0, drops);
+			dev_kfree_skb(skb);
+			goto discard;
+		}
+		page_pool_release_page(adapter->page_pool, page);
+		skb_add_rx_frag(skb, skb_shinfo(skb)->nr_frags, page,
+				SNIC_RX_HEADROOM + off, len - off, PAGE_SIZE);
+		adapter->rx_pages[idx] = NULL;
 	}
 
-	skb_copy_to_linear_data_offset(skb, NET_IP_ALIGN,
-				       adapter->rx_buf,
-				       adapter->rx_desc->length);
-	skb_put(skb, adapter->rx_desc->length);
-	skb->protocol = eth_type_trans(skb, adapter->dev);
-	skb->ip_summed = CHECKSUM_NONE;
+	if (!(d->flags & SNIC_DESC_F_EOP)) {
+		adapter->rx_skb = skb;
+		return NULL;
+	}
 
-	pr_info("%s: go netif_rx\n", __func__);
-	netif_rx(skb);
-	adapter->dev->stats.rx_packets++;
-	adapter->dev->stats.rx_bytes += adapter->rx_desc->length;
+	adapter->rx_skb = NULL;
+	return skb;
 
+discard:
+	/* the page is reused, and the rest of the frame is dropped */
+	adapter->rx_skb = NULL;
+	adapter->rx_discard = !(d->flags & SNIC_DESC_F_EOP);
+	return NULL;
+}
 
-	/* prepare rx buf for DMA */
-	adapter->rx_desc->addr = dma_map_single(&adapter->pdev->dev,
-						adapter->rx_buf, 2048,
-						DMA_FROM_DEVICE);
-	adapter->rx_desc->length = 2048;
+/* a frame of segs TCP segments of mss bytes, but the last, coalesced
+ * by the device. The device verified the checksums of the segments,
+ * and GSO info lets the stack account and resegment it when
+ * forwarded. */
+static void nettlp_snic_rx_lro(struct sk_buff *skb, u16 segs, u16 mss)
+{
+	skb_shinfo(skb)->gso_size = mss;
+	skb_shinfo(skb)->gso_type = SKB_GSO_TCPV4;
+	skb_shinfo(skb)->gso_segs = segs;
+	skb->ip_summed = CHECKSUM_UNNECESSARY;
+}
 
-	/* prepare rx desc for DMA */
-	dma_map_single(&adapter->pdev->dev, adapter->rx_desc,
-		       sizeof(struct descriptor), DMA_BIDIRECTIONAL);
+/* receive packets on the descriptors completed by the device */
+static int nettlp_snic_rx(struct nettlp_snic_adapter *adapter, int budget)
+{
+	int n = 0, posted;
+	u32 act;
+	bool xdp_tx = false, xdp_redirect = false;
+	struct sk_buff *skb;
+	struct descriptor *d;
+	struct page *page;
+	struct bpf_prog *prog;
+	struct xdp_buff xdp;
+	uint32_t idx, len;
+	dma_addr_t dma;
+	void *data;
+
+	rcu_read_lock();
+	prog = READ_ONCE(adapter->xdp_prog);
+
+	idx = adapter->rx_clean_idx;
+	while (n < budget) {
+
+		d = &adapter->rx_desc[idx];
+		if (!snic_desc_is_done(adapter, d, adapter->rx_used_wrap))
+			break;
+
+		/* read the rest of the desc after DD */
+		dma_rmb();
+		len = d->length;
+		page = adapter->rx_pages[idx];
+		pr_debug("%s: packet length is %u on desc %u\n",
+			 __func__, len, idx);
+
+		dma = page_pool_get_dma_addr(page) + SNIC_RX_HEADROOM;
+		dma_sync_single_for_cpu(&adapter->pdev->dev, dma, len,
+					DMA_BIDIRECTIONAL);
+		data = page_address(page) + SNIC_RX_HEADROOM;
+
+		if (!(d->flags & SNIC_DESC_F_EOP) ||
+		    (d->flags & SNIC_DESC_F_SPLIT) || adapter->rx_skb ||
+		    adapter->rx_discard) {
+			skb = nettlp_snic_rx_chain(adapter, idx, d, len, prog);
+			if (!skb)
+				goto next;
+			goto deliver;
+		}
+
+		if (prog) {
+			/* run XDP on the DMA'd buffer before skb */
+			xdp.data_hard_start = page_address(page);
+			xdp.data = data;
+			xdp.data_end = data + len;
+			xdp_set_data_meta_invalid(&xdp);
+			xdp.rxq = &adapter->xdp_rxq;
+			xdp.frame_sz = PAGE_SIZE;
+
+			act = nettlp_snic_run_xdp(adapter, prog, &xdp, page);
+			switch (act) {
+			case XDP_PASS:
+				data = xdp.data;
+				len = xdp.data_end - xdp.data;
+				break;
+			case XDP_TX:
+				xdp_tx = true;
+				adapter->rx_pages[idx] = NULL;
+				goto next;
+			case XDP_REDIRECT:
+				xdp_redirect = true;
+				adapter->rx_pages[idx] = NULL;
+				goto next;
+			default:
+				/* the page is reused for the next buffer */
+				goto next;
+			}
+		}
+
+		skb = napi_alloc_skb(&adapter->napi, len);
+		if (!skb) {
+			snic_stats_inc(adapter, rx, 0, drops);
+			goto next;
+		}
+		skb_put_data(skb, data, len);
+
+	deliver:
+		len = skb->len;
+		skb->ip_summed = CHECKSUM_NONE;
+		if (d->flags & SNIC_DESC_F_CSUM_OK &&
+		    adapter->dev->features & NETIF_F_RXCSUM)
+			skb->ip_summed = CHECKSUM_UNNECESSARY;
+		else if (d->flags & SNIC_DESC_F_CSUM_ERR)
+			snic_stats_inc(adapter, rx, 0, csum_errors);
+		if (d->flags & SNIC_DESC_F_VLAN)
+			__vlan_hwaccel_put_tag(skb, htons(ETH_P_8021Q), d->vlan);
+		if (d->wb.seg_cnt > 1) {
+			nettlp_snic_rx_lro(skb, d->wb.seg_cnt, d->wb.mss);
+			snic_stats_inc(adapter, rx, 0, lro);
+		}
+		skb->protocol = eth_type_trans(skb, adapter->dev);
+
+		napi_gro_receive(&adapter->napi, skb);
+		snic_stats_inc(adapter, rx, 0, packets);
+		snic_stats_add(adapter, rx, 0, bytes, len);
+
+	next:
+		idx = snic_ring_inc(idx, &adapter->rx_used_wrap);
+		n++;
+	}
 
+	adapter->rx_clean_idx = idx;
 
-	/* notify new rx skb by DMA write rx_desc address  */
-	pr_info("%s: notify the new desc to libtlp: buf paddr %llu\n",
-		__func__,  adapter->rx_desc->addr);
-	/* notify new rx desc index */
-	writel(adapter->rx_desc_idx, &adapter->bar4->rx_desc_idx);
+	if (xdp_redirect)
+		xdp_do_flush();
 
-	pr_info("%s: done\n", __func__);
+	if (xdp_tx) {
+		spin_lock(&adapter->tx_lock);
+		nettlp_snic_tx_doorbell(adapter);
+		spin_unlock(&adapter->tx_lock);
+	}
 
+	rcu_read_unlock();
 
-out:
-	spin_unlock_irqrestore(&adapter->rx_lock, flags);
+	/* refill the received buffers, and notify them by moving the
+	 * tail */
+	posted = nettlp_snic_refill_rx_ring(adapter);
+	if (posted) {
+		writel(adapter->rx_desc_idx, &adapter->db->rx_desc_idx);
+		snic_stats_inc(adapter, rx, 0, doorbells);
+	}
 
-	return;
+	return n;
 }
 
-static irqreturn_t rx_handler(int irq, void *nic_irq)
+/* free buffers on completed TX descriptors, or all the buffers if
+ * force. Called with tx_lock held. */
+static int nettlp_snic_tx_clean(struct nettlp_snic_adapter *adapter,
+				bool force)
+{
+	int n = 0;
+	uint32_t idx;
+	struct snic_tx_buf *buf;
+
+	idx = adapter->tx_clean_idx;
+	while (idx != adapter->tx_desc_idx) {
+
+		if (!force && !snic_desc_is_done(adapter, &adapter->tx_desc[idx],
+						 adapter->tx_used_wrap))
+			break;
+
+		buf = &adapter->tx_bufs[idx];
+		switch (buf->type) {
+		case SNIC_TX_BUF_SKB:
+			dma_unmap_single(&adapter->pdev->dev, buf->dma,
+					 buf->len, DMA_TO_DEVICE);
+			dev_consume_skb_any(buf->skb);
+			break;
+		case SNIC_TX_BUF_XDP_NDO:
+			dma_unmap_single(&adapter->pdev->dev, buf->dma,
+					 buf->len, DMA_TO_DEVICE);
+			xdp_return_frame(buf->xdpf);
+			break;
+		case SNIC_TX_BUF_XDP_TX:
+			/* page pool page, mapped by the pool */
+			xdp_return_frame(buf->xdpf);
+			break;
+		case SNIC_TX_BUF_BOUNCE:
+			/* skb is already freed */
+			break;
+		}
+		buf->skb = NULL;
+
+		idx = snic_ring_inc(idx, &adapter->tx_used_wrap);
+		n++;
+	}
+
+	adapter->tx_clean_idx = idx;
+
+	if (n && netif_queue_stopped(adapter->dev) &&
+	    snic_tx_avail(adapter) > 0)
+		netif_wake_queue(adapter->dev);
+
+	return n;
+}
+
+/* mask or unmask the device interrupts. writes BAR4 only on changes
+ * not to spend a TLP on every poll */
+static void nettlp_snic_irq_mask(struct nettlp_snic_adapter *adapter,
+				 bool mask)
+{
+	if (adapter->irq_masked == mask)
+		return;
+
+	adapter->irq_masked = mask;
+	writel(mask ? SNIC_IRQ_ALL : 0, &adapter->bar4->irq_mask);
+}
+
+static bool nettlp_snic_work_pending(struct nettlp_snic_adapter *adapter)
 {
+	uint32_t tx = adapter->tx_clean_idx, rx = adapter->rx_clean_idx;
+
+	return (tx != adapter->tx_desc_idx &&
+		snic_desc_is_done(adapter, &adapter->tx_desc[tx],
+				  adapter->tx_used_wrap)) ||
+		snic_desc_is_done(adapter, &adapter->rx_desc[rx],
+				  adapter->rx_used_wrap);
+}
+
+static int nettlp_snic_poll(struct napi_struct *napi, int budget)
+{
+	int done;
 	unsigned long flags;
-	struct nettlp_snic_adapter *adapter = nic_irq;
+	struct nettlp_snic_adapter *adapter =
+		container_of(napi, struct nettlp_snic_adapter, napi);
 
-	spin_lock_irqsave(&adapter->rx_lock, flags);
+	snic_stats_inc(adapter, rx, 0, polls);
+	if (test_bit(NAPI_STATE_IN_BUSY_POLL, &napi->state))
+		snic_stats_inc(adapter, rx, 0, busy_polls);
 
-	pr_err("rx interrupt! irq=%d\n", irq);
-	tasklet_schedule(adapter->rx_tasklet);
+	/* TX interrupt means descriptors are written back with DD */
+	spin_lock_irqsave(&adapter->tx_lock, flags);
+	nettlp_snic_tx_clean(adapter, false);
+	spin_unlock_irqrestore(&adapter->tx_lock, flags);
+
+	/* RX interrupt means DMA to the rx buffers is done */
+	done = nettlp_snic_rx(adapter, budget);
+
+	/* napi_complete_done() fails while a socket is busy polling
+	 * or hard irqs are deferred. NAPI keeps polling then, so mask
+	 * the interrupts until NAPI completes. skbs are marked with the
+	 * napi_id for busy polling by napi_gro_receive(). */
+	if (done < budget && napi_complete_done(napi, done)) {
+		/* the device sends interrupts left pending on unmask,
+		 * but it may be completing descriptors before the unmask
+		 * arrives. recheck the rings not to miss them */
+		nettlp_snic_irq_mask(adapter, false);
+		if (nettlp_snic_work_pending(adapter))
+			napi_schedule(napi);
+	} else
+		nettlp_snic_irq_mask(adapter, true);
+
+	return done;
+}
 
-	spin_unlock_irqrestore(&adapter->rx_lock, flags);
+static irqreturn_t rx_handler(int irq, void *nic_irq)
+{
+	struct nettlp_snic_adapter *adapter = nic_irq;
+
+	pr_debug("rx interrupt! irq=%d\n", irq);
+	snic_stats_inc(adapter, rx, 0, irqs);
+	napi_schedule(&adapter->napi);
 
 	return IRQ_HANDLED;
 }
@@ -181,75 +783,407 @@ static irqreturn_t rx_handler(int irq, void *nic_irq)
 
 static int nettlp_snic_init(struct net_device *dev)
 {
+	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+
 	pr_info("%s\n", __func__);
 
 	/* setup counters */
-	dev->tstats = netdev_alloc_pcpu_stats(struct pcpu_sw_netstats);
-	if (!dev->tstats)
+	adapter->pcpu_stats = netdev_alloc_pcpu_stats(struct snic_pcpu_stats);
+	if (!adapter->pcpu_stats)
 		return -ENOMEM;
 	return 0;
 }
 
 static void nettlp_snic_uninit(struct net_device *dev)
 {
+	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+
 	pr_info("%s\n", __func__);
 
 	/* free counters */
-	free_percpu(dev->tstats);
+	free_percpu(adapter->pcpu_stats);
+}
+
+/* sum up the per-CPU counters of all queues into tx and rx */
+static void nettlp_snic_sum_stats(struct nettlp_snic_adapter *adapter,
+				  struct snic_queue_counters *tx,
+				  struct snic_queue_counters *rx)
+{
+	int cpu, q;
+	unsigned int start;
+	struct snic_pcpu_stats *s;
+	struct snic_queue_counters t[SNIC_NUM_QUEUES], r[SNIC_NUM_QUEUES];
+
+	memset(tx, 0, sizeof(*tx) * SNIC_NUM_QUEUES);
+	memset(rx, 0, sizeof(*rx) * SNIC_NUM_QUEUES);
+
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(adapter->pcpu_stats, cpu);
+		do {
+			start = u64_stats_fetch_begin_irq(&s->syncp);
+			memcpy(t, s->tx, sizeof(t));
+			memcpy(r, s->rx, sizeof(r));
+		} while (u64_stats_fetch_retry_irq(&s->syncp, start));
+
+		for (q = 0; q < SNIC_NUM_QUEUES; q++) {
+			tx[q].packets	+= t[q].packets;
+			tx[q].bytes	+= t[q].bytes;
+			tx[q].drops	+= t[q].drops;
+			tx[q].ring_full	+= t[q].ring_full;
+			tx[q].irqs	+= t[q].irqs;
+			tx[q].polls	+= t[q].polls;
+			tx[q].doorbells	+= t[q].doorbells;
+			tx[q].copybreak	+= t[q].copybreak;
+			tx[q].timeouts	+= t[q].timeouts;
+			tx[q].resets	+= t[q].resets;
+			rx[q].packets	+= r[q].packets;
+			rx[q].bytes	+= r[q].bytes;
+			rx[q].drops	+= r[q].drops;
+			rx[q].ring_full	+= r[q].ring_full;
+			rx[q].irqs	+= r[q].irqs;
+			rx[q].polls	+= r[q].polls;
+			rx[q].doorbells	+= r[q].doorbells;
+			rx[q].xdp_drops	+= r[q].xdp_drops;
+			rx[q].xdp_tx	+= r[q].xdp_tx;
+			rx[q].xdp_redirects += r[q].xdp_redirects;
+			rx[q].busy_polls += r[q].busy_polls;
+			rx[q].lro	+= r[q].lro;
+			rx[q].csum_errors += r[q].csum_errors;
+		}
+	}
+}
+
+static void nettlp_snic_get_stats64(struct net_device *dev,
+				    struct rtnl_link_stats64 *stats)
+{
+	int q;
+	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+	struct snic_queue_counters tx[SNIC_NUM_QUEUES], rx[SNIC_NUM_QUEUES];
+
+	nettlp_snic_sum_stats(adapter, tx, rx);
+
+	for (q = 0; q < SNIC_NUM_QUEUES; q++) {
+		stats->tx_packets	+= tx[q].packets;
+		stats->tx_bytes		+= tx[q].bytes;
+		stats->tx_dropped	+= tx[q].drops;
+		stats->rx_packets	+= rx[q].packets;
+		stats->rx_bytes		+= rx[q].bytes;
+		stats->rx_dropped	+= rx[q].drops;
+	}
+}
+
+/* run a flow command on the device, and wait for the status. while
+ * the interface is down, rules are only kept by the driver, and put
+ * on the device by nettlp_snic_flow_replay() on open */
+static int nettlp_snic_flow_cmd(struct nettlp_snic_adapter *adapter, u32 op,
+				u32 loc, u32 action,
+				struct snic_flow_match *key,
+				struct snic_flow_match *mask)
+{
+	int n, status;
+	struct snic_flow_cmd *cmd = adapter->flow_cmd;
+
+	if (!netif_running(adapter->dev))
+		return 0;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->op = op;
+	cmd->loc = loc;
+	cmd->action = action;
+	if (key) {
+		cmd->key = *key;
+		cmd->mask = *mask;
+	}
+	cmd->status = SNIC_FLOW_PENDING;
+
+	/* the device reads the command after the doorbell */
+	wmb();
+	writel(1, &adapter->bar4->flow_cmd);
+
+	for (n = 0; n < SNIC_FLOW_CMD_TIMEOUT; n++) {
+		status = READ_ONCE(cmd->status);
+		if (status != SNIC_FLOW_PENDING)
+			return status;
+		usleep_range(100, 200);
+	}
+
+	return -ETIMEDOUT;
+}
+
+static int nettlp_snic_flow_clear(struct nettlp_snic_adapter *adapter)
+{
+	int rc;
+
+	rc = nettlp_snic_flow_cmd(adapter, SNIC_FLOW_CMD_CLEAR, 0, 0,
+				  NULL, NULL);
+	if (rc)
+		return rc;
+
+	bitmap_zero(adapter->flow_locs, SNIC_FLOW_RULES);
+
+	return 0;
+}
+
+/* convert an ethtool flow spec to the device rule */
+static int nettlp_snic_flow_parse(struct nettlp_snic_adapter *adapter,
+				  struct ethtool_rx_flow_spec *fs,
+				  struct snic_flow_match *key,
+				  struct snic_flow_match *mask, u32 *action)
+{
+	struct ethtool_tcpip4_spec *h4, *m4;
+	struct ethtool_usrip4_spec *hu, *mu;
+	struct ethhdr *he, *me;
+
+	memset(key, 0, sizeof(*key));
+	memset(mask, 0, sizeof(*mask));
+
+	switch (fs->flow_type & ~(FLOW_EXT | FLOW_MAC_EXT)) {
+	case TCP_V4_FLOW:
+	case UDP_V4_FLOW:
+		h4 = &fs->h_u.tcp_ip4_spec;
+		m4 = &fs->m_u.tcp_ip4_spec;
+		if (m4->tos)
+			return -EINVAL;
+		key->proto = (fs->flow_type & ~(FLOW_EXT | FLOW_MAC_EXT)) ==
+			TCP_V4_FLOW ? IPPROTO_TCP : IPPROTO_UDP;
+		mask->proto = 0xff;
+		key->ethertype = htons(ETH_P_IP);
+		mask->ethertype = 0xffff;
+		key->saddr = h4->ip4src;
+		mask->saddr = m4->ip4src;
+		key->daddr = h4->ip4dst;
+		mask->daddr = m4->ip4dst;
+		key->sport = h4->psrc;
+		mask->sport = m4->psrc;
+		key->dport = h4->pdst;
+		mask->dport = m4->pdst;
+		break;
+	case IPV4_USER_FLOW:
+		hu = &fs->h_u.usr_ip4_spec;
+		mu = &fs->m_u.usr_ip4_spec;
+		if (mu->tos || mu->l4_4_bytes || mu->ip_ver ||
+		    hu->ip_ver != ETH_RX_NFC_IP4)
+			return -EINVAL;
+		key->proto = hu->proto;
+		mask->proto = mu->proto;
+		key->ethertype = htons(ETH_P_IP);
+		mask->ethertype = 0xffff;
+		key->saddr = hu->ip4src;
+		mask->saddr = mu->ip4src;
+		key->daddr = hu->ip4dst;
+		mask->daddr = mu->ip4dst;
+		break;
+	case ETHER_FLOW:
+		he = &fs->h_u.ether_spec;
+		me = &fs->m_u.ether_spec;
+		if (!is_zero_ether_addr(me->h_source))
+			return -EINVAL;
+		ether_addr_copy(key->dmac, he->h_dest);
+		ether_addr_copy(mask->dmac, me->h_dest);
+		key->ethertype = he->h_proto;
+		mask->ethertype = me->h_proto;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (fs->flow_type & FLOW_EXT) {
+		if (fs->m_ext.vlan_etype || fs->m_ext.data[0] ||
+		    fs->m_ext.data[1])
+			return -EINVAL;
+		key->vlan = fs->h_ext.vlan_tci;
+		mask->vlan = fs->m_ext.vlan_tci;
+	}
+
+	if (fs->flow_type & FLOW_MAC_EXT) {
+		ether_addr_copy(key->dmac, fs->h_ext.h_dest);
+		ether_addr_copy(mask->dmac, fs->m_ext.h_dest);
+	}
+
+	if (fs->ring_cookie == RX_CLS_FLOW_DISC)
+		*action = SNIC_FLOW_DROP;
+	else if (ethtool_get_flow_spec_ring_vf(fs->ring_cookie) ||
+		 ethtool_get_flow_spec_ring(fs->ring_cookie) >=
+		 adapter->num_queues)
+		return -EINVAL;
+	else
+		*action = ethtool_get_flow_spec_ring(fs->ring_cookie);
+
+	return 0;
+}
+
+/* the device drops its rules when flow_cmd_base is written. put the
+ * rules kept by the driver back on the device */
+static void nettlp_snic_flow_replay(struct nettlp_snic_adapter *adapter)
+{
+	int rc;
+	u32 loc, action;
+	struct snic_flow_match key, mask;
+
+	for_each_set_bit(loc, adapter->flow_locs, SNIC_FLOW_RULES) {
+		rc = nettlp_snic_flow_parse(adapter, &adapter->flow_specs[loc],
+					    &key, &mask, &action);
+		if (!rc)
+			rc = nettlp_snic_flow_cmd(adapter, SNIC_FLOW_CMD_ADD,
+						  loc, action, &key, &mask);
+		if (rc == -ETIMEDOUT) {
+			pr_warn("%s: device does not respond, drop flow "
+				"rules\n", __func__);
+			bitmap_zero(adapter->flow_locs, SNIC_FLOW_RULES);
+			return;
+		}
+		if (rc) {
+			pr_warn("%s: failed to restore flow rule %u\n",
+				__func__, loc);
+			clear_bit(loc, adapter->flow_locs);
+		}
+	}
 }
 
 static int nettlp_snic_open(struct net_device *dev)
 {
+	int rc;
 	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+	struct page_pool_params pp = {
+		.flags		= PP_FLAG_DMA_MAP,
+		.order		= 0,
+		.pool_size	= SNIC_DESC_RING_LEN,
+		.nid		= dev_to_node(&adapter->pdev->dev),
+		.dev		= &adapter->pdev->dev,
+		.dma_dir	= DMA_BIDIRECTIONAL,	/* for XDP_TX */
+	};
 
 	pr_info("%s\n", __func__);
-	adapter->bar4->enabled = 1;
-	adapter->tx_state = TX_STATE_READY;
 
-	/* notify descriptor base addresses */
-	pr_info("notify descriptor base addresses, TX %#llx, RX %#llx\n",
-		adapter->tx_desc_paddr, adapter->rx_desc_paddr);
+	/* setup rx buffer pool for XDP */
+	adapter->page_pool = page_pool_create(&pp);
+	if (IS_ERR(adapter->page_pool)) {
+		rc = PTR_ERR(adapter->page_pool);
+		adapter->page_pool = NULL;
+		return rc;
+	}
+
+	rc = xdp_rxq_info_reg(&adapter->xdp_rxq, dev, 0);
+	if (rc)
+		goto err1;
+
+	rc = xdp_rxq_info_reg_mem_model(&adapter->xdp_rxq, MEM_TYPE_PAGE_POOL,
+					adapter->page_pool);
+	if (rc)
+		goto err2;
+
+	writel(1, &adapter->bar4->enabled);
+
+	/* initialize rings */
+	adapter->packed = packed_ring;
+	memset(adapter->tx_desc, 0,
+	       sizeof(struct descriptor) * SNIC_DESC_RING_LEN);
+	adapter->tx_desc_idx = 0;
+	adapter->tx_clean_idx = 0;
+	adapter->tx_avail_wrap = 1;
+	adapter->tx_used_wrap = 1;
+	nettlp_snic_init_rx_ring(adapter);
+
+	/* notify features, descriptor format and base addresses.
+	 * writing the base addresses resets the rings on the device */
+	pr_info("notify descriptor base addresses, TX %#llx, RX %#llx%s\n",
+		adapter->tx_desc_paddr, adapter->rx_desc_paddr,
+		adapter->packed ? ", packed ring" : "");
+	writel(nettlp_snic_features(dev->features), &adapter->bar4->features);
+	if (adapter->rx_hdr)
+		writeq(adapter->rx_hdr_paddr, &adapter->bar4->rx_hdr_base);
+	writel(SNIC_DESC_VERSION, &adapter->bar4->desc_version);
+	writel(adapter->num_queues, &adapter->bar4->nqueues);
 	writeq(adapter->tx_desc_paddr, &adapter->bar4->tx_desc_base);
 	writeq(adapter->rx_desc_paddr, &adapter->bar4->rx_desc_base);
+	writeq(adapter->dev_stats_paddr, &adapter->bar4->stats_base);
+	writeq(adapter->flow_cmd_paddr, &adapter->bar4->flow_cmd_base);
+	nettlp_snic_flow_replay(adapter);
+	adapter->irq_masked = false;
+	writel(0, &adapter->bar4->irq_mask);
+
+	napi_enable(&adapter->napi);
 
-	/* prepare desc and notify rx descriptor to device */
-	adapter->rx_desc->addr = adapter->rx_buf_paddr;
-	dma_map_single(&adapter->pdev->dev, adapter->rx_buf, 2048,
-		       DMA_FROM_DEVICE);
-	dma_map_single(&adapter->pdev->dev, adapter->rx_desc,
-		       sizeof(adapter->rx_desc), DMA_BIDIRECTIONAL);
-	writel(adapter->rx_desc_idx, &adapter->bar4->rx_desc_idx);
+	/* notify posted rx descriptors to device */
+	writel(adapter->rx_desc_idx, &adapter->db->rx_desc_idx);
+
+	netif_start_queue(dev);
 
 	return 0;
+
+err2:
+	xdp_rxq_info_unreg(&adapter->xdp_rxq);
+err1:
+	page_pool_destroy(adapter->page_pool);
+	adapter->page_pool = NULL;
+	return rc;
+}
+
+/* wait until the device acks a ring reset by changing *seq from old,
+ * after its DMAs on the previous ring are over */
+static int nettlp_snic_wait_reset(u32 *seq, u32 old)
+{
+	int n;
+
+	for (n = 0; n < SNIC_RESET_TIMEOUT; n++) {
+		if (READ_ONCE(*seq) != old)
+			return 0;
+		usleep_range(100, 200);
+	}
+
+	return -ETIMEDOUT;
 }
 
 static int nettlp_snic_stop(struct net_device *dev)
 {
+	u32 tx_seq, rx_seq;
+	unsigned long flags;
 	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
 
 	pr_info("%s\n", __func__);
-	adapter->bar4->enabled = 0;
+	writel(0, &adapter->bar4->enabled);
+
+	/* zero base addresses stop the device touching the rings. the
+	 * acks come through the stats buffer, so keep it until then */
+	tx_seq = READ_ONCE(adapter->dev_stats->tx_reset_seq);
+	rx_seq = READ_ONCE(adapter->dev_stats->rx_reset_seq);
+	writeq(0, &adapter->bar4->tx_desc_base);
+	writeq(0, &adapter->bar4->rx_desc_base);
+	writeq(0, &adapter->bar4->flow_cmd_base);
+	if (nettlp_snic_wait_reset(&adapter->dev_stats->tx_reset_seq, tx_seq))
+		netdev_warn(dev, "device does not ack TX ring reset\n");
+	if (nettlp_snic_wait_reset(&adapter->dev_stats->rx_reset_seq, rx_seq))
+		netdev_warn(dev, "device does not ack RX ring reset\n");
+	writeq(0, &adapter->bar4->stats_base);
+
+	netif_stop_queue(dev);
+	napi_disable(&adapter->napi);
+
+	/* release buffers the device did not complete */
+	spin_lock_irqsave(&adapter->tx_lock, flags);
+	nettlp_snic_tx_clean(adapter, true);
+	spin_unlock_irqrestore(&adapter->tx_lock, flags);
+
+	/* a frame the device did not complete */
+	dev_kfree_skb(adapter->rx_skb);
+	adapter->rx_skb = NULL;
+	adapter->rx_discard = false;
 
-	tasklet_kill(adapter->rx_tasklet);
+	nettlp_snic_free_rx_ring(adapter);
+	xdp_rxq_info_unreg(&adapter->xdp_rxq);
+	page_pool_destroy(adapter->page_pool);
+	adapter->page_pool = NULL;
 
 	return 0;
 }
 
 static irqreturn_t tx_handler(int irq, void *nic_irq)
 {
-	unsigned long flags;
 	struct nettlp_snic_adapter *adapter = nic_irq;
 
-	pr_info("tx interrupt! irq=%d\n", irq);
-
-	spin_lock_irqsave(&adapter->tx_lock, flags);
-
-	if (adapter->tx_state != TX_STATE_BUSY)
-		goto out;
-
-	adapter->tx_state = TX_STATE_READY;
-out:
-	spin_unlock_irqrestore(&adapter->tx_lock, flags);
+	pr_debug("tx interrupt! irq=%d\n", irq);
+	snic_stats_inc(adapter, tx, 0, irqs);
+	napi_schedule(&adapter->napi);
 
 	return IRQ_HANDLED;
 }
@@ -260,50 +1194,133 @@ static netdev_tx_t nettlp_snic_xmit(struct sk_buff *skb,
 				    struct net_device *dev)
 {
 	dma_addr_t dma;
-	uint32_t pktlen;
+	uint32_t pktlen, idx;
 	unsigned long flags;
+	uint16_t dflags = 0, vlan = 0;
 	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
-	struct descriptor *tx_desc;
 
+	/* the device inserts the tag */
+	if (skb_vlan_tag_present(skb)) {
+		dflags = SNIC_DESC_F_VLAN;
+		vlan = skb_vlan_tag_get(skb);
+	}
 
-	/* the current implementation allows only a single CPU can
-	 * start TX */
 	spin_lock_irqsave(&adapter->tx_lock, flags);
 
-	tx_desc = adapter->tx_desc;
+	if (snic_tx_avail(adapter) == 0) {
+		/* should not happen because the queue is stopped */
+		snic_stats_inc(adapter, tx, 0, ring_full);
+		netif_stop_queue(dev);
+		spin_unlock_irqrestore(&adapter->tx_lock, flags);
+		return NETDEV_TX_BUSY;
+	}
+
+	/* prepare the tx descriptor */
+	pktlen = skb->len;
+
+	if (pktlen <= READ_ONCE(tx_copybreak) &&
+	    pktlen <= SNIC_TX_BOUNCE_SIZE) {
+		/* copy small packets to avoid mapping and unmapping */
+		idx = adapter->tx_desc_idx;
+		skb_copy_bits(skb, 0, snic_tx_bounce(adapter, idx), pktlen);
+		nettlp_snic_tx_post(adapter, SNIC_TX_BUF_BOUNCE, NULL,
+				    snic_tx_bounce_paddr(adapter, idx), pktlen,
+				    dflags, vlan);
+		snic_stats_inc(adapter, tx, 0, copybreak);
+		dev_consume_skb_any(skb);
+		goto doorbell;
+	}
 
-	if (adapter->tx_state != TX_STATE_READY) {
-		adapter->dev->stats.tx_dropped++;
+	dma = dma_map_single(&adapter->pdev->dev, skb->data, pktlen,
+			     DMA_TO_DEVICE);
+	if (dma_mapping_error(&adapter->pdev->dev, dma)) {
+		snic_stats_inc(adapter, tx, 0, drops);
 		spin_unlock_irqrestore(&adapter->tx_lock, flags);
-		kfree_skb(skb);
+		dev_kfree_skb_any(skb);
 		return NETDEV_TX_OK;
 	}
+	pr_debug("%s: skb dma addr is %#llx\n", __func__, dma);
 
-	adapter->tx_state = TX_STATE_BUSY;
+	nettlp_snic_tx_post(adapter, SNIC_TX_BUF_SKB, skb, dma, pktlen,
+			    dflags, vlan);
 
-	/* prepare the tx descriptor */
-	pktlen = skb->len;
-	dma = dma_map_single(&adapter->pdev->dev, skb_mac_header(skb),
-			     pktlen, DMA_TO_DEVICE);
-	pr_info("%s: skb dma addr is %#llx\n", __func__, dma);
-	tx_desc->addr = dma;
-	tx_desc->length = pktlen;
+doorbell:
+	nettlp_snic_tx_doorbell(adapter);
 
-	/* notify the device to start DMA */
-	writel(adapter->tx_desc_idx, &adapter->bar4->tx_desc_idx);
+	if (snic_tx_avail(adapter) == 0) {
+		snic_stats_inc(adapter, tx, 0, ring_full);
+		netif_stop_queue(dev);
+	}
 
-	adapter->dev->stats.tx_packets++;
-	adapter->dev->stats.tx_bytes += pktlen;
+	spin_unlock_irqrestore(&adapter->tx_lock, flags);
 
-	dev_kfree_skb_any(skb);
+	return NETDEV_TX_OK;
+}
+
+/* Reset the TX ring when the device lost descriptors or their
+ * write-back. Buffers not completed by then are dropped */
+static void nettlp_snic_tx_reset(struct work_struct *work)
+{
+	int n;
+	u32 seq;
+	unsigned long flags;
+	struct nettlp_snic_adapter *adapter =
+		container_of(work, struct nettlp_snic_adapter, tx_reset_work);
+	struct net_device *dev = adapter->dev;
+
+	rtnl_lock();
+	if (!netif_running(dev))
+		goto out;
+
+	netif_tx_disable(dev);
+	napi_disable(&adapter->napi);
 
-	adapter->tx_desc_idx = 0;	/* always 0 in snic */
+	/* stop the device fetching from the ring, and wait until its
+	 * DMAs on the buffers and descriptors are over */
+	seq = READ_ONCE(adapter->dev_stats->tx_reset_seq);
+	writeq(0, &adapter->bar4->tx_desc_base);
+	if (nettlp_snic_wait_reset(&adapter->dev_stats->tx_reset_seq, seq))
+		netdev_warn(dev, "device does not ack TX ring reset\n");
 
+	spin_lock_irqsave(&adapter->tx_lock, flags);
+	nettlp_snic_tx_clean(adapter, false);
+	n = nettlp_snic_tx_clean(adapter, true);
+	memset(adapter->tx_desc, 0,
+	       sizeof(struct descriptor) * SNIC_DESC_RING_LEN);
+	adapter->tx_desc_idx = 0;
+	adapter->tx_clean_idx = 0;
+	adapter->tx_avail_wrap = 1;
+	adapter->tx_used_wrap = 1;
+	/* resets the ring on the device before xmit posts again */
+	writeq(adapter->tx_desc_paddr, &adapter->bar4->tx_desc_base);
 	spin_unlock_irqrestore(&adapter->tx_lock, flags);
 
-	pr_info("%s done\n", __func__);
+	snic_stats_add(adapter, tx, 0, drops, n);
+	snic_stats_inc(adapter, tx, 0, resets);
+	netdev_warn(dev, "TX ring reset, %d packets dropped\n", n);
 
-	return NETDEV_TX_OK;
+	napi_enable(&adapter->napi);
+	netif_wake_queue(dev);
+out:
+	rtnl_unlock();
+}
+
+static void nettlp_snic_tx_timeout(struct net_device *dev,
+				   unsigned int txqueue)
+{
+	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+
+	snic_stats_inc(adapter, tx, 0, timeouts);
+
+	/* the interrupt was lost. NAPI reaps the completions */
+	if (nettlp_snic_work_pending(adapter)) {
+		netdev_warn(dev, "TX timeout, interrupt lost\n");
+		napi_schedule(&adapter->napi);
+		return;
+	}
+
+	netdev_warn(dev, "TX timeout, resetting the ring\n");
+	schedule_work(&adapter->tx_reset_work);
 }
 
 static int nettlp_snic_set_mac(struct net_device *dev, void *p)
@@ -320,6 +1337,122 @@ static int nettlp_snic_set_mac(struct net_device *dev, void *p)
 	return 0;
 }
 
+static int nettlp_snic_xdp_xmit(struct net_device *dev, int n,
+				struct xdp_frame **frames, u32 flags)
+{
+	int i, drops = 0;
+	dma_addr_t dma;
+	unsigned long lflags;
+	struct xdp_frame *xdpf;
+	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+
+	if (unlikely(flags & ~XDP_XMIT_FLAGS_MASK))
+		return -EINVAL;
+
+	if (unlikely(!netif_running(dev)))
+		return -ENETDOWN;
+
+	spin_lock_irqsave(&adapter->tx_lock, lflags);
+
+	for (i = 0; i < n; i++) {
+		xdpf = frames[i];
+
+		if (snic_tx_avail(adapter) == 0) {
+			snic_stats_inc(adapter, tx, 0, ring_full);
+			goto drop;
+		}
+
+		dma = dma_map_single(&adapter->pdev->dev, xdpf->data,
+				     xdpf->len, DMA_TO_DEVICE);
+		if (dma_mapping_error(&adapter->pdev->dev, dma))
+			goto drop;
+
+		nettlp_snic_tx_post(adapter, SNIC_TX_BUF_XDP_NDO, xdpf, dma,
+				    xdpf->len, 0, 0);
+		continue;
+	drop:
+		snic_stats_inc(adapter, tx, 0, drops);
+		xdp_return_frame_rx_napi(xdpf);
+		drops++;
+	}
+
+	if (flags & XDP_XMIT_FLUSH)
+		nettlp_snic_tx_doorbell(adapter);
+
+	spin_unlock_irqrestore(&adapter->tx_lock, lflags);
+
+	return n - drops;
+}
+
+static int nettlp_snic_xdp_setup(struct net_device *dev,
+				 struct bpf_prog *prog)
+{
+	struct bpf_prog *old;
+	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+
+	/* XDP needs the whole packet in a buffer */
+	if (prog && hdr_split) {
+		netdev_warn(dev, "XDP is not supported with hdr_split\n");
+		return -EOPNOTSUPP;
+	}
+	if (prog && (dev->features & NETIF_F_LRO)) {
+		netdev_warn(dev, "XDP is not supported with LRO\n");
+		return -EOPNOTSUPP;
+	}
+
+	/* every rx buffer is in a page with XDP_PACKET_HEADROOM, and
+	 * max_mtu is limited to SNIC_RX_BUF_SIZE. so that no need to
+	 * reconfigure rx buffers. */
+	old = xchg(&adapter->xdp_prog, prog);
+	if (old)
+		bpf_prog_put(old);
+
+	return 0;
+}
+
+static netdev_features_t nettlp_snic_fix_features(struct net_device *dev,
+						  netdev_features_t features)
+{
+	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+
+	/* coalesced frames span buffers, which XDP does not handle */
+	if (adapter->xdp_prog)
+		features &= ~NETIF_F_LRO;
+
+	return features;
+}
+
+static int nettlp_snic_set_features(struct net_device *dev,
+				    netdev_features_t features)
+{
+	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+	netdev_features_t changed = dev->features ^ features;
+
+	/* the device applies LRO and RX offloads immediately, and
+	 * others on open */
+	if ((changed & (NETIF_F_LRO | NETIF_F_RXCSUM |
+			NETIF_F_HW_VLAN_CTAG_RX)) && netif_running(dev))
+		writel(nettlp_snic_features(features),
+		       &adapter->bar4->features);
+
+	/* flow rules are kept only while ntuple is on */
+	if ((changed & NETIF_F_NTUPLE) && !(features & NETIF_F_NTUPLE) &&
+	    nettlp_snic_flow_clear(adapter))
+		return -EIO;
+
+	return 0;
+}
+
+static int nettlp_snic_bpf(struct net_device *dev, struct netdev_bpf *bpf)
+{
+	switch (bpf->command) {
+	case XDP_SETUP_PROG:
+		return nettlp_snic_xdp_setup(dev, bpf->prog);
+	default:
+		return -EINVAL;
+	}
+}
+
 /* netdevice ops */
 static const struct net_device_ops nettlp_snic_ops = {
 	.ndo_init		= nettlp_snic_init,
@@ -327,49 +1460,385 @@ static const struct net_device_ops nettlp_snic_ops = {
 	.ndo_open		= nettlp_snic_open,
 	.ndo_stop		= nettlp_snic_stop,
 	.ndo_start_xmit		= nettlp_snic_xmit,
-	.ndo_get_stats64	= ip_tunnel_get_stats64, /* ??? */
+	.ndo_tx_timeout		= nettlp_snic_tx_timeout,
+	.ndo_get_stats64	= nettlp_snic_get_stats64,
 	.ndo_change_mtu		= eth_change_mtu,
 	.ndo_validate_addr	= eth_validate_addr,
 	.ndo_set_mac_address	= nettlp_snic_set_mac,
+	.ndo_fix_features	= nettlp_snic_fix_features,
+	.ndo_set_features	= nettlp_snic_set_features,
+	.ndo_bpf		= nettlp_snic_bpf,
+	.ndo_xdp_xmit		= nettlp_snic_xdp_xmit,
 };
 
 
+/* ethtool ops */
+static const char nettlp_snic_drv_stats_str[][ETH_GSTRING_LEN] = {
+	"packets",
+	"bytes",
+	"drops",
+	"ring_full",
+	"irqs",
+	"polls",
+	"doorbells",
+	"xdp_drops",
+	"xdp_tx",
+	"xdp_redirects",
+	"copybreak",
+	"busy_polls",
+	"lro",
+	"csum_errors",
+	"timeouts",
+	"resets",
+};
+#define SNIC_DRV_STATS_LEN	ARRAY_SIZE(nettlp_snic_drv_stats_str)
+
+static const char nettlp_snic_dev_stats_str[][ETH_GSTRING_LEN] = {
+	"rx_packets",
+	"rx_bytes",
+	"rx_drops",
+	"tx_packets",
+	"tx_bytes",
+	"tx_drops",
+	"rx_desc_fetched",
+	"tx_desc_fetched",
+	"rx_irqs",
+	"tx_irqs",
+	"dma_read_errors",
+	"dma_write_errors",
+	"rx_busy_poll_ns",
+	"rx_sleep_ns",
+	"irqs_masked",
+	"rx_lro_segs",
+	"rx_flow_hits",
+	"rx_flow_drops",
+	"dma_read_retries",
+};
+#define SNIC_DEV_STATS_LEN	ARRAY_SIZE(nettlp_snic_dev_stats_str)
+
+static const int nettlp_snic_dev_lat_pct[] = { 50, 90, 99, 100 };
+static const char nettlp_snic_dev_lat_str[][ETH_GSTRING_LEN] = {
+	"dev_dma_read_lat_p50_ns",
+	"dev_dma_read_lat_p90_ns",
+	"dev_dma_read_lat_p99_ns",
+	"dev_dma_read_lat_max_ns",
+};
+#define SNIC_DEV_LAT_LEN	ARRAY_SIZE(nettlp_snic_dev_lat_str)
+
+static void nettlp_snic_get_drvinfo(struct net_device *dev,
+				    struct ethtool_drvinfo *info)
+{
+	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+
+	strlcpy(info->driver, DRV_NAME, sizeof(info->driver));
+	strlcpy(info->version, NETTLP_SNIC_VERSION, sizeof(info->version));
+	strlcpy(info->bus_info, pci_name(adapter->pdev),
+		sizeof(info->bus_info));
+}
+
+static int nettlp_snic_get_sset_count(struct net_device *dev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return (SNIC_DRV_STATS_LEN * 2 + SNIC_DEV_STATS_LEN) *
+			SNIC_NUM_QUEUES + SNIC_DEV_LAT_LEN;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void nettlp_snic_get_strings(struct net_device *dev, u32 sset,
+				    u8 *data)
+{
+	int q, n;
+
+	if (sset != ETH_SS_STATS)
+		return;
+
+	for (q = 0; q < SNIC_NUM_QUEUES; q++) {
+		for (n = 0; n < SNIC_DRV_STATS_LEN; n++) {
+			snprintf(data, ETH_GSTRING_LEN, "tx_queue_%d_%s", q,
+				 nettlp_snic_drv_stats_str[n]);
+			data += ETH_GSTRING_LEN;
+		}
+		for (n = 0; n < SNIC_DRV_STATS_LEN; n++) {
+			snprintf(data, ETH_GSTRING_LEN, "rx_queue_%d_%s", q,
+				 nettlp_snic_drv_stats_str[n]);
+			data += ETH_GSTRING_LEN;
+		}
+	}
+
+	for (q = 0; q < SNIC_NUM_QUEUES; q++) {
+		for (n = 0; n < SNIC_DEV_STATS_LEN; n++) {
+			snprintf(data, ETH_GSTRING_LEN, "dev_q%d_%s", q,
+				 nettlp_snic_dev_stats_str[n]);
+			data += ETH_GSTRING_LEN;
+		}
+	}
+
+	memcpy(data, nettlp_snic_dev_lat_str, sizeof(nettlp_snic_dev_lat_str));
+}
+
+static void nettlp_snic_get_ethtool_stats(struct net_device *dev,
+					  struct ethtool_stats *stats,
+					  u64 *data)
+{
+	int q, n;
+	u64 *qstats;
+	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+	struct snic_stats *ds = adapter->dev_stats;
+	struct snic_queue_counters tx[SNIC_NUM_QUEUES], rx[SNIC_NUM_QUEUES];
+
+	/* driver counters. the order must match struct
+	 * snic_queue_counters and nettlp_snic_drv_stats_str */
+	nettlp_snic_sum_stats(adapter, tx, rx);
+	for (q = 0; q < SNIC_NUM_QUEUES; q++) {
+		memcpy(data, &tx[q], sizeof(u64) * SNIC_DRV_STATS_LEN);
+		data += SNIC_DRV_STATS_LEN;
+		memcpy(data, &rx[q], sizeof(u64) * SNIC_DRV_STATS_LEN);
+		data += SNIC_DRV_STATS_LEN;
+	}
+
+	/* counters of the last DMA from the device */
+	for (q = 0; q < SNIC_NUM_QUEUES; q++) {
+		qstats = (u64 *)&ds->q[q];
+		for (n = 0; n < SNIC_DEV_STATS_LEN; n++)
+			*data++ = READ_ONCE(qstats[n]);
+	}
+
+	for (n = 0; n < SNIC_DEV_LAT_LEN; n++)
+		*data++ = snic_lat_hist_percentile(ds->dma_read_lat,
+						   nettlp_snic_dev_lat_pct[n]);
+}
+
+static int nettlp_snic_flow_add(struct nettlp_snic_adapter *adapter,
+				struct ethtool_rx_flow_spec *fs)
+{
+	int rc;
+	u32 action, loc = fs->location;
+	struct snic_flow_match key, mask;
+
+	if (!(adapter->dev->features & NETIF_F_NTUPLE))
+		return -EOPNOTSUPP;
+
+	rc = nettlp_snic_flow_parse(adapter, fs, &key, &mask, &action);
+	if (rc)
+		return rc;
+
+	/* RX_CLS_LOC_ANY and others take a free location */
+	if (loc & RX_CLS_LOC_SPECIAL) {
+		loc = find_first_zero_bit(adapter->flow_locs,
+					  SNIC_FLOW_RULES);
+		if (loc == SNIC_FLOW_RULES)
+			return -ENOSPC;
+	} else if (loc >= SNIC_FLOW_RULES)
+		return -EINVAL;
+
+	rc = nettlp_snic_flow_cmd(adapter, SNIC_FLOW_CMD_ADD, loc, action,
+				  &key, &mask);
+	if (rc)
+		return rc;
+
+	fs->location = loc;
+	adapter->flow_specs[loc] = *fs;
+	set_bit(loc, adapter->flow_locs);
+
+	return 0;
+}
+
+static int nettlp_snic_flow_del(struct nettlp_snic_adapter *adapter,
+				u32 loc)
+{
+	int rc;
+
+	if (loc >= SNIC_FLOW_RULES || !test_bit(loc, adapter->flow_locs))
+		return -ENOENT;
+
+	rc = nettlp_snic_flow_cmd(adapter, SNIC_FLOW_CMD_DEL, loc, 0,
+				  NULL, NULL);
+	if (rc)
+		return rc;
+
+	clear_bit(loc, adapter->flow_locs);
+
+	return 0;
+}
+
+static int nettlp_snic_get_rxnfc(struct net_device *dev,
+				 struct ethtool_rxnfc *cmd, u32 *rule_locs)
+{
+	u32 loc, n = 0;
+	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+
+	switch (cmd->cmd) {
+	case ETHTOOL_GRXRINGS:
+		cmd->data = adapter->num_queues;
+		return 0;
+	case ETHTOOL_GRXCLSRLCNT:
+		cmd->rule_cnt = bitmap_weight(adapter->flow_locs,
+					      SNIC_FLOW_RULES);
+		cmd->data = SNIC_FLOW_RULES | RX_CLS_LOC_SPECIAL;
+		return 0;
+	case ETHTOOL_GRXCLSRULE:
+		loc = cmd->fs.location;
+		if (loc >= SNIC_FLOW_RULES || !test_bit(loc, adapter->flow_locs))
+			return -ENOENT;
+		cmd->fs = adapter->flow_specs[loc];
+		return 0;
+	case ETHTOOL_GRXCLSRLALL:
+		for_each_set_bit(loc, adapter->flow_locs, SNIC_FLOW_RULES) {
+			if (n == cmd->rule_cnt)
+				return -EMSGSIZE;
+			rule_locs[n++] = loc;
+		}
+		cmd->rule_cnt = n;
+		cmd->data = SNIC_FLOW_RULES;
+		return 0;
+	}
+
+	return -EOPNOTSUPP;
+}
+
+static int nettlp_snic_set_rxnfc(struct net_device *dev,
+				 struct ethtool_rxnfc *cmd)
+{
+	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+
+	switch (cmd->cmd) {
+	case ETHTOOL_SRXCLSRLINS:
+		return nettlp_snic_flow_add(adapter, &cmd->fs);
+	case ETHTOOL_SRXCLSRLDEL:
+		return nettlp_snic_flow_del(adapter, cmd->fs.location);
+	}
+
+	return -EOPNOTSUPP;
+}
+
+/* Spread queues over online cpus close to the device, and point the
+ * TX and RX vectors and the XPS map of each queue to the same cpu,
+ * so that completions and transmits of a queue stay on one core */
+static void nettlp_snic_set_affinity(struct nettlp_snic_adapter *adapter)
+{
+	int q, node = dev_to_node(&adapter->pdev->dev);
+	const struct cpumask *mask;
+
+	for (q = 0; q < SNIC_NUM_QUEUES; q++) {
+		if (q < adapter->num_queues) {
+			adapter->queue_cpu[q] = cpumask_local_spread(q, node);
+			mask = cpumask_of(adapter->queue_cpu[q]);
+			netif_set_xps_queue(adapter->dev, mask, q);
+		} else
+			mask = NULL;
+
+		irq_set_affinity_hint(pci_irq_vector(adapter->pdev,
+						     SNIC_TX_VEC(q)), mask);
+		irq_set_affinity_hint(pci_irq_vector(adapter->pdev,
+						     SNIC_RX_VEC(q)), mask);
+	}
+}
+
+static void nettlp_snic_get_channels(struct net_device *dev,
+				     struct ethtool_channels *ch)
+{
+	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+
+	ch->max_combined = SNIC_NUM_QUEUES;
+	ch->combined_count = adapter->num_queues;
+}
+
+static int nettlp_snic_set_channels(struct net_device *dev,
+				    struct ethtool_channels *ch)
+{
+	int rc;
+	struct nettlp_snic_adapter *adapter = netdev_priv(dev);
+
+	if (ch->rx_count || ch->tx_count || ch->other_count ||
+	    !ch->combined_count || ch->combined_count > SNIC_NUM_QUEUES)
+		return -EINVAL;
+
+	/* flow rules may steer to the queues removed */
+	if (ch->combined_count < adapter->num_queues &&
+	    !bitmap_empty(adapter->flow_locs, SNIC_FLOW_RULES))
+		return -EBUSY;
+
+	rc = netif_set_real_num_tx_queues(dev, ch->combined_count);
+	if (rc)
+		return rc;
+	rc = netif_set_real_num_rx_queues(dev, ch->combined_count);
+	if (rc)
+		return rc;
+
+	adapter->num_queues = ch->combined_count;
+	nettlp_snic_set_affinity(adapter);
+	if (netif_running(dev))
+		writel(adapter->num_queues, &adapter->bar4->nqueues);
+
+	return 0;
+}
+
+static const struct ethtool_ops nettlp_snic_ethtool_ops = {
+	.get_drvinfo		= nettlp_snic_get_drvinfo,
+	.get_link		= ethtool_op_get_link,
+	.get_sset_count		= nettlp_snic_get_sset_count,
+	.get_strings		= nettlp_snic_get_strings,
+	.get_ethtool_stats	= nettlp_snic_get_ethtool_stats,
+	.get_rxnfc		= nettlp_snic_get_rxnfc,
+	.set_rxnfc		= nettlp_snic_set_rxnfc,
+	.get_channels		= nettlp_snic_get_channels,
+	.set_channels		= nettlp_snic_set_channels,
+};
+
 
 
 static int nettlp_register_interrupts(struct nettlp_snic_adapter *adapter)
 {
-	int ret;
+	int ret, q;
 
 	// Enable MSI-X
-	ret = pci_alloc_irq_vectors(adapter->pdev, 2, 2, PCI_IRQ_MSIX);
+	ret = pci_alloc_irq_vectors(adapter->pdev, 2 * SNIC_NUM_QUEUES,
+				    2 * SNIC_NUM_QUEUES, PCI_IRQ_MSIX);
 	if (ret < 0) {
 		pr_info("Request for #%d msix vectors failed, returned %d\n",
-			NETTLP_NUM_VEC, ret);
+			2 * SNIC_NUM_QUEUES, ret);
 		return 1;
 	}
 
 	// register interrupt handler 
-	ret = request_irq(pci_irq_vector(adapter->pdev, 0),
-			  tx_handler, 0, DRV_NAME, adapter);
-	if (ret) {
-		pr_err("%s: failed to register TX IRQ\n", __func__);
-		return 1;
+	for (q = 0; q < SNIC_NUM_QUEUES; q++) {
+		ret = request_irq(pci_irq_vector(adapter->pdev, SNIC_TX_VEC(q)),
+				  tx_handler, 0, DRV_NAME, adapter);
+		if (ret) {
+			pr_err("%s: failed to register TX IRQ\n", __func__);
+			return 1;
+		}
+
+		ret = request_irq(pci_irq_vector(adapter->pdev, SNIC_RX_VEC(q)),
+				  rx_handler, 0, DRV_NAME, adapter);
+		if (ret) {
+			pr_err("%s: failed to register RX IRQ\n", __func__);
+			return 1;
+		}
 	}
 
-	ret = request_irq(pci_irq_vector(adapter->pdev, 1),
-			  rx_handler, 0, DRV_NAME, adapter);
-	if (ret) {
-		pr_err("%s: failed to register RX IRQ\n", __func__);
-		return 1;
-	}
+	nettlp_snic_set_affinity(adapter);
 
 	return 0;
 }
 
 static void nettlp_unregister_interrupts(struct nettlp_snic_adapter *adapter)
 {
-	free_irq(pci_irq_vector(adapter->pdev, 0), adapter);
-	free_irq(pci_irq_vector(adapter->pdev, 1), adapter);
+	int q;
+
+	for (q = 0; q < SNIC_NUM_QUEUES; q++) {
+		irq_set_affinity_hint(pci_irq_vector(adapter->pdev,
+						     SNIC_TX_VEC(q)), NULL);
+		irq_set_affinity_hint(pci_irq_vector(adapter->pdev,
+						     SNIC_RX_VEC(q)), NULL);
+		free_irq(pci_irq_vector(adapter->pdev, SNIC_TX_VEC(q)),
+			 adapter);
+		free_irq(pci_irq_vector(adapter->pdev, SNIC_RX_VEC(q)),
+			 adapter);
+	}
 }
 
 /* this it the identical device id with the original NetTLP driver */
@@ -438,7 +1907,8 @@ static int nettlp_snic_pci_init(struct pci_dev *pdev,
 
 	/* setup struct netdevice */
 	rc = -ENOMEM;
-	dev = alloc_etherdev(sizeof(*adapter));
+	dev = alloc_etherdev_mqs(sizeof(*adapter), SNIC_NUM_QUEUES,
+				 SNIC_NUM_QUEUES);
 	if (!dev)
 		goto err6;
 
@@ -448,8 +1918,19 @@ static int nettlp_snic_pci_init(struct pci_dev *pdev,
 	adapter->dev = dev;
 	adapter->pdev = pdev;
 	adapter->bar4 = bar4;
+	/* the registers in the first page have the same layout as a
+	 * doorbell page */
+	if (bar4_len >= SNIC_BAR4_SIZE(SNIC_NUM_QUEUES))
+		adapter->db = snic_doorbell(bar4, 0);
+	else
+		adapter->db = (struct snic_doorbell *)
+			&adapter->bar4->tx_desc_idx;
 	adapter->bar0 = bar0;
 	adapter->bar2 = bar2;
+	adapter->num_queues = min_t(int, netif_get_num_default_rss_queues(),
+				    SNIC_NUM_QUEUES);
+	netif_set_real_num_tx_queues(dev, adapter->num_queues);
+	netif_set_real_num_rx_queues(dev, adapter->num_queues);
 	
 	/* allocate DMA region for descriptors and pseudo interrupts */
 	adapter->tx_desc = dma_alloc_coherent(&pdev->dev,
@@ -459,7 +1940,7 @@ static int nettlp_snic_pci_init(struct pci_dev *pdev,
 					      GFP_KERNEL);
 	if (!adapter->tx_desc) {
 		pr_err("%s: failed to alloc tx descriptor\n", __func__);
-		goto err6;
+		goto err7;
 	}
 
 	adapter->rx_desc = dma_alloc_coherent(&pdev->dev,
@@ -469,50 +1950,93 @@ static int nettlp_snic_pci_init(struct pci_dev *pdev,
 					      GFP_KERNEL);
 	if (!adapter->rx_desc) {
 		pr_err("%s: failed to alloc rx descriptor\n", __func__);
-		goto err6;
+		goto err8;
 	}
 
-	adapter->rx_buf = dma_alloc_coherent(&pdev->dev, 2048,
-					     &adapter->rx_buf_paddr,
-					     GFP_KERNEL);
-	if (!adapter->rx_buf) {
-		pr_err("%s: failed to alloc rx buffer\n", __func__);
-		goto err6;
+	adapter->dev_stats = dma_alloc_coherent(&pdev->dev,
+						sizeof(struct snic_stats),
+						&adapter->dev_stats_paddr,
+						GFP_KERNEL);
+	if (!adapter->dev_stats) {
+		pr_err("%s: failed to alloc device stats buffer\n", __func__);
+		goto err9;
+	}
+
+	adapter->tx_bounce = dma_alloc_coherent(&pdev->dev,
+						SNIC_TX_BOUNCE_SIZE *
+						SNIC_DESC_RING_LEN,
+						&adapter->tx_bounce_paddr,
+						GFP_KERNEL);
+	if (!adapter->tx_bounce) {
+		pr_err("%s: failed to alloc tx bounce buffer\n", __func__);
+		goto err10;
+	}
+
+	if (hdr_split) {
+		adapter->rx_hdr = dma_alloc_coherent(&pdev->dev,
+						     SNIC_RX_HDR_SIZE *
+						     SNIC_DESC_RING_LEN,
+						     &adapter->rx_hdr_paddr,
+						     GFP_KERNEL);
+		if (!adapter->rx_hdr) {
+			pr_err("%s: failed to alloc rx header buffer\n",
+			       __func__);
+			goto err11;
+		}
+	}
+
+	adapter->flow_cmd = dma_alloc_coherent(&pdev->dev,
+					       sizeof(struct snic_flow_cmd),
+					       &adapter->flow_cmd_paddr,
+					       GFP_KERNEL);
+	if (!adapter->flow_cmd) {
+		pr_err("%s: failed to alloc flow command buffer\n", __func__);
+		goto err12;
+	}
+
+	adapter->flow_specs = kvcalloc(SNIC_FLOW_RULES,
+				       sizeof(struct ethtool_rx_flow_spec),
+				       GFP_KERNEL);
+	if (!adapter->flow_specs) {
+		pr_err("%s: failed to alloc flow rules\n", __func__);
+		goto err13;
 	}
-	pr_info("%s: rx_buf is %#llx\n", __func__, adapter->rx_buf_paddr);
 
 	spin_lock_init(&adapter->tx_lock);
-	spin_lock_init(&adapter->rx_lock);
+	INIT_WORK(&adapter->tx_reset_work, nettlp_snic_tx_reset);
+	netif_napi_add(dev, &adapter->napi, nettlp_snic_poll, NAPI_POLL_WEIGHT);
 
 	snic_get_mac(dev->dev_addr, adapter->bar0->srcmac);
-	dev->needs_free_netdev = true;
 	dev->netdev_ops = &nettlp_snic_ops;
+	dev->ethtool_ops = &nettlp_snic_ethtool_ops;
+	dev->watchdog_timeo = SNIC_TX_TIMEOUT;
 	dev->min_mtu = ETH_MIN_MTU;
-	dev->max_mtu = ETH_MAX_MTU;
-	/* XXX: should handle feature */
+	dev->max_mtu = SNIC_RX_BUF_SIZE - VLAN_ETH_HLEN;
+	dev->napi_defer_hard_irqs = napi_defer_hard_irqs;
+	dev->gro_flush_timeout = gro_flush_timeout;
+	/* offloads by the device. LRO is off by default */
+	dev->hw_features |= NETIF_F_LRO | NETIF_F_RXCSUM |
+		NETIF_F_HW_VLAN_CTAG_RX | NETIF_F_HW_VLAN_CTAG_TX |
+		NETIF_F_NTUPLE;
+	dev->features |= NETIF_F_RXCSUM | NETIF_F_HW_VLAN_CTAG_RX |
+		NETIF_F_HW_VLAN_CTAG_TX | NETIF_F_NTUPLE;
 
 	rc = register_netdev(dev);
 	if (rc)
-		goto err7;
-
-	/* initialize tasklet for RX interrupt */
-	adapter->rx_tasklet = kmalloc(sizeof(struct tasklet_struct),
-				      GFP_KERNEL);
-	if (!adapter->rx_tasklet) {
-		rc = -ENOMEM;
-		goto err8;
-	}
-	tasklet_init(adapter->rx_tasklet, rx_tasklet, (unsigned long)adapter);
+		goto err14;
 
 	/* register irq */
 	rc = nettlp_register_interrupts(adapter);
 	if (rc)
-		goto err9;
+		goto err15;
 
 	/* initialize nettlp_msg module */
 	nettlp_msg_init(bar4_start,
 			PCI_DEVID(pdev->bus->number, pdev->devfn),
 			bar2);
+	nettlp_msg_set_dev_info(bar0_start, bar2_start,
+				nettlp_snic_features(dev->features),
+				adapter->num_queues);
 
 	/* initialize base addresses for descriptor and indexes */
 	adapter->tx_desc_idx = 0;
@@ -526,17 +2050,35 @@ static int nettlp_snic_pci_init(struct pci_dev *pdev,
 
 
 
-err9:
-	kfree(adapter->rx_tasklet);
-err8:
+err15:
 	unregister_netdev(dev);
-err7:
+err14:
+	netif_napi_del(&adapter->napi);
+	kvfree(adapter->flow_specs);
+err13:
+	dma_free_coherent(&pdev->dev, sizeof(struct snic_flow_cmd),
+			  adapter->flow_cmd, adapter->flow_cmd_paddr);
+err12:
+	if (adapter->rx_hdr)
+		dma_free_coherent(&pdev->dev,
+				  SNIC_RX_HDR_SIZE * SNIC_DESC_RING_LEN,
+				  adapter->rx_hdr, adapter->rx_hdr_paddr);
+err11:
+	dma_free_coherent(&pdev->dev, SNIC_TX_BOUNCE_SIZE * SNIC_DESC_RING_LEN,
+			  adapter->tx_bounce, adapter->tx_bounce_paddr);
+err10:
+	dma_free_coherent(&pdev->dev, sizeof(struct snic_stats),
+			  (void *)adapter->dev_stats, adapter->dev_stats_paddr);
+err9:
 	dma_free_coherent(&pdev->dev,
 			  sizeof(struct descriptor) * SNIC_DESC_RING_LEN,
-			  (void *)adapter->tx_desc, adapter->tx_desc_paddr);
+			  (void *)adapter->rx_desc, adapter->rx_desc_paddr);
+err8:
 	dma_free_coherent(&pdev->dev,
 			  sizeof(struct descriptor) * SNIC_DESC_RING_LEN,
-			  (void *)adapter->rx_desc, adapter->rx_desc_paddr);
+			  (void *)adapter->tx_desc, adapter->tx_desc_paddr);
+err7:
+	free_netdev(dev);
 err6:
 	iounmap(bar2);
 err5:
@@ -559,13 +2101,13 @@ static void nettlp_snic_pci_remove(struct pci_dev *pdev)
 
 	pr_info("%s\n", __func__);
 
-	kfree(adapter->rx_tasklet);
-
 	nettlp_msg_fini();
 	nettlp_unregister_interrupts(adapter);
 	pci_free_irq_vectors(pdev);
 
+	cancel_work_sync(&adapter->tx_reset_work);
 	unregister_netdev(dev);
+	netif_napi_del(&adapter->napi);
 
 	dma_free_coherent(&pdev->dev,
 			  sizeof(struct descriptor) * SNIC_DESC_RING_LEN,
@@ -573,12 +2115,22 @@ static void nettlp_snic_pci_remove(struct pci_dev *pdev)
 	dma_free_coherent(&pdev->dev,
 			  sizeof(struct descriptor) * SNIC_DESC_RING_LEN,
 			  (void *)adapter->rx_desc, adapter->rx_desc_paddr);
-	dma_free_coherent(&pdev->dev, 2048, (void *)adapter->rx_buf,
-			  adapter->rx_buf_paddr);
+	dma_free_coherent(&pdev->dev, sizeof(struct snic_stats),
+			  (void *)adapter->dev_stats, adapter->dev_stats_paddr);
+	dma_free_coherent(&pdev->dev, SNIC_TX_BOUNCE_SIZE * SNIC_DESC_RING_LEN,
+			  adapter->tx_bounce, adapter->tx_bounce_paddr);
+	if (adapter->rx_hdr)
+		dma_free_coherent(&pdev->dev,
+				  SNIC_RX_HDR_SIZE * SNIC_DESC_RING_LEN,
+				  adapter->rx_hdr, adapter->rx_hdr_paddr);
+	dma_free_coherent(&pdev->dev, sizeof(struct snic_flow_cmd),
+			  adapter->flow_cmd, adapter->flow_cmd_paddr);
+	kvfree(adapter->flow_specs);
 
 	iounmap(adapter->bar4);
 	iounmap(adapter->bar2);
 	iounmap(adapter->bar0);
+	free_netdev(dev);
 	
 	pci_release_regions(pdev);
 	pci_disable_device(pdev);
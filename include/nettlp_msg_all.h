@@ -0,0 +1,42 @@
+/* nettlp_msg_all.h */
+
+#ifndef _NETTLP_MSG_ALL_H_
+#define _NETTLP_MSG_ALL_H_
+
+/* NETTLP_MSG_GET_ALL returns everything a device needs to bootstrap
+ * in a single reply, instead of a round trip for each of
+ * NETTLP_MSG_GET_BAR4_ADDR, GET_DEV_ID, and GET_MSIX_TABLE. This is
+ * shared by the driver (nettlp_msg.c) and the device, which cannot
+ * include driver/nettlp_msg.h because libtlp has its own definitions.
+ */
+
+#ifndef NETTLP_MSG_PORT
+#define NETTLP_MSG_PORT		12287	/* NETTLP_PORT_BASE - 1 */
+#endif
+
+#define NETTLP_MSG_GET_ALL	4
+
+#define NETTLP_MSG_ALL_VERSION	1
+#define NETTLP_MSG_ALL_MAX_VEC	16
+
+struct nettlp_msg_all_vec {
+	uint64_t	addr;
+	uint32_t	data;
+} __attribute__((packed));	/* same layout as struct nettlp_msix */
+
+struct nettlp_msg_all {
+	uint32_t	version;	/* NETTLP_MSG_ALL_VERSION */
+	uint16_t	dev_id;		/* PCI device ID */
+	uint16_t	num_vec;	/* valid entries in msix */
+
+	uint64_t	bar0_start;
+	uint64_t	bar2_start;
+	uint64_t	bar4_start;
+
+	uint32_t	features;	/* features the driver supports */
+	uint32_t	nqueues;	/* number of queues on the driver */
+
+	struct nettlp_msg_all_vec msix[NETTLP_MSG_ALL_MAX_VEC];
+} __attribute__((packed));
+
+#endif /* _NETTLP_MSG_ALL_H_ */
@@ -0,0 +1,229 @@
+/* nettlp_pcap.h */
+
+#ifndef _NETTLP_PCAP_H_
+#define _NETTLP_PCAP_H_
+
+/* TLP capture in pcapng, written by nettlp_snic_device -p and read by
+ * nettlp_tlp_analyze.
+ *
+ * Each interface (IDB) is a snic instance. Each packet (EPB) is a TLP
+ * encapsulated as NetTLP does on the wire: a 6-byte NetTLP header
+ * (seq, tstamp in network byte order), followed by the 3DW or 4DW TLP
+ * header and the data, truncated to the snaplen. Timestamps are in
+ * nanoseconds, and the direction is in the epb_flags option:
+ *
+ *   inbound:  MWr from the host to BAR4, CplD for device MRd
+ *   outbound: MRd and MWr issued by the device
+ *
+ * A DMA of the device is captured as a single TLP (and a single CplD
+ * for a MRd) as issued to libtlp, regardless of how libtlp splits it
+ * on the wire. The CplD timestamp is when the DMA read returned.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define NETTLP_PCAP_LINKTYPE	147	/* LINKTYPE_USER0 */
+
+#define PCAPNG_SHB		0x0a0d0d0a
+#define PCAPNG_IDB		0x00000001
+#define PCAPNG_EPB		0x00000006
+#define PCAPNG_BYTE_ORDER	0x1a2b3c4d
+
+#define PCAPNG_OPT_END		0
+#define PCAPNG_OPT_IF_NAME	2
+#define PCAPNG_OPT_IF_TSRESOL	9
+#define PCAPNG_OPT_EPB_FLAGS	2
+
+#define NETTLP_PCAP_INBOUND	1	/* epb_flags direction */
+#define NETTLP_PCAP_OUTBOUND	2
+
+/* TLP fmt/type in the first byte of the header */
+#define NETTLP_TLP_4DW		0x20
+#define NETTLP_TLP_DATA		0x40
+#define NETTLP_TLP_MRD		0x00
+#define NETTLP_TLP_MWR		0x40
+#define NETTLP_TLP_CPL		0x0a
+#define NETTLP_TLP_CPLD		0x4a
+#define NETTLP_TLP_TYPE(b)	((b) & 0x5f)	/* without 4DW */
+
+#define NETTLP_PCAP_NETTLP_HDR	6
+#define NETTLP_PCAP_TLP_HDR_MAX	16
+
+struct nettlp_pcap_block {
+	uint32_t	type;
+	uint32_t	len;
+} __attribute__((packed));
+
+struct nettlp_pcap_epb {
+	uint32_t	type;
+	uint32_t	len;
+	uint32_t	ifid;
+	uint32_t	ts_high;
+	uint32_t	ts_low;
+	uint32_t	caplen;
+	uint32_t	origlen;
+} __attribute__((packed));
+
+#define pcapng_pad(len)		(((len) + 3) & ~3)
+
+static inline uint32_t nettlp_tlp_hdr_len(uint8_t fmt_type)
+{
+	if (NETTLP_TLP_TYPE(fmt_type) == NETTLP_TLP_CPL ||
+	    NETTLP_TLP_TYPE(fmt_type) == NETTLP_TLP_CPLD)
+		return 12;
+	return (fmt_type & NETTLP_TLP_4DW) ? 16 : 12;
+}
+
+/* length field in DW: 0 means 1024 DW */
+static inline uint32_t nettlp_tlp_dw(uint32_t len)
+{
+	return ((len + 3) / 4) & 0x3ff;
+}
+
+/* build a MRd or MWr header at p, returns the header length */
+static inline int nettlp_tlp_build_mr(uint8_t *p, int write,
+				      uint16_t requester, uint8_t tag,
+				      uint64_t addr, uint32_t len)
+{
+	uint32_t dw = nettlp_tlp_dw(len);
+	int hlen = (addr >> 32) ? 16 : 12;
+
+	p[0] = (write ? NETTLP_TLP_MWR : NETTLP_TLP_MRD) |
+		(hlen == 16 ? NETTLP_TLP_4DW : 0);
+	p[1] = 0;
+	p[2] = (dw >> 8) & 0x3;
+	p[3] = dw & 0xff;
+	p[4] = requester >> 8;
+	p[5] = requester & 0xff;
+	p[6] = tag;
+	p[7] = len > 4 ? 0xff : 0x0f;	/* last BE, first BE */
+
+	if (hlen == 16) {
+		*(uint32_t *)(p + 8) = htonl(addr >> 32);
+		*(uint32_t *)(p + 12) = htonl(addr & 0xfffffffc);
+	} else
+		*(uint32_t *)(p + 8) = htonl(addr & 0xfffffffc);
+
+	return hlen;
+}
+
+/* build a CplD header at p, returns the header length */
+static inline int nettlp_tlp_build_cpld(uint8_t *p, uint16_t requester,
+					uint8_t tag, uint64_t addr,
+					uint32_t len)
+{
+	uint32_t dw = nettlp_tlp_dw(len);
+
+	memset(p, 0, 12);
+	p[0] = NETTLP_TLP_CPLD;
+	p[2] = (dw >> 8) & 0x3;
+	p[3] = dw & 0xff;
+	p[6] = (len >> 8) & 0x0f;	/* byte count */
+	p[7] = len & 0xff;
+	p[8] = requester >> 8;
+	p[9] = requester & 0xff;
+	p[10] = tag;
+	p[11] = addr & 0x7f;
+
+	return 12;
+}
+
+static inline uint32_t nettlp_tlp_len(uint8_t *p)
+{
+	uint32_t dw = ((p[2] & 0x3) << 8) | p[3];
+
+	if (!(p[0] & NETTLP_TLP_DATA))
+		return 0;
+	return (dw ? dw : 1024) * 4;
+}
+
+static inline int pcapng_write_shb(FILE *fp)
+{
+	uint32_t b[7] = {
+		PCAPNG_SHB, 28, PCAPNG_BYTE_ORDER,
+		1,		/* major 1, minor 0 */
+		0xffffffff, 0xffffffff,	/* section length unknown */
+		28,
+	};
+
+	return fwrite(b, sizeof(b), 1, fp) == 1 ? 0 : -1;
+}
+
+static inline int pcapng_write_idb(FILE *fp, const char *name,
+				   uint32_t snaplen)
+{
+	uint8_t buf[128];
+	uint16_t *opt;
+	uint32_t len, off, nlen = strlen(name);
+
+	if (nlen > 64)
+		nlen = 64;
+
+	memset(buf, 0, sizeof(buf));
+	off = 8;
+	*(uint16_t *)(buf + off) = NETTLP_PCAP_LINKTYPE;
+	*(uint32_t *)(buf + off + 4) = snaplen;
+	off += 8;
+
+	opt = (uint16_t *)(buf + off);
+	opt[0] = PCAPNG_OPT_IF_NAME;
+	opt[1] = nlen;
+	memcpy(buf + off + 4, name, nlen);
+	off += 4 + pcapng_pad(nlen);
+
+	opt = (uint16_t *)(buf + off);
+	opt[0] = PCAPNG_OPT_IF_TSRESOL;
+	opt[1] = 1;
+	buf[off + 4] = 9;	/* nsec */
+	off += 8;
+
+	off += 4;		/* opt_endofopt */
+	len = off + 4;
+
+	*(uint32_t *)buf = PCAPNG_IDB;
+	*(uint32_t *)(buf + 4) = len;
+	*(uint32_t *)(buf + off) = len;
+
+	return fwrite(buf, len, 1, fp) == 1 ? 0 : -1;
+}
+
+static inline int pcapng_write_epb(FILE *fp, uint32_t ifid, uint64_t ts_ns,
+				   uint32_t flags, void *data,
+				   uint32_t caplen, uint32_t origlen)
+{
+	struct nettlp_pcap_epb epb;
+	struct {
+		uint16_t code, len;
+		uint32_t flags;
+		uint32_t end;
+		uint32_t blen;	/* trailing block length */
+	} __attribute__((packed)) opt;
+	uint32_t pad = 0;
+
+	epb.type = PCAPNG_EPB;
+	epb.len = sizeof(epb) + pcapng_pad(caplen) + sizeof(opt);
+	epb.ifid = ifid;
+	epb.ts_high = ts_ns >> 32;
+	epb.ts_low = ts_ns & 0xffffffff;
+	epb.caplen = caplen;
+	epb.origlen = origlen;
+
+	opt.code = PCAPNG_OPT_EPB_FLAGS;
+	opt.len = 4;
+	opt.flags = flags;
+	opt.end = PCAPNG_OPT_END;
+	opt.blen = epb.len;
+
+	if (fwrite(&epb, sizeof(epb), 1, fp) != 1 ||
+	    fwrite(data, caplen, 1, fp) != 1 ||
+	    fwrite(&pad, pcapng_pad(caplen) - caplen, 1, fp) > 1 ||
+	    fwrite(&opt, sizeof(opt), 1, fp) != 1)
+		return -1;
+
+	return 0;
+}
+
+#endif /* _NETTLP_PCAP_H_ */
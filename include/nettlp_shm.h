@@ -0,0 +1,229 @@
+/* nettlp_shm.h */
+
+#ifndef _NETTLP_SHM_H_
+#define _NETTLP_SHM_H_
+
+/* Shared-memory TLP transport between a device and a host emulator
+ * running on the same machine (nettlp_snic_hostemu). It replaces
+ * dma_read/dma_write and the mwr callback of libtlp, which go through
+ * UDP sockets, so that the device logic can be benchmarked without
+ * kernel UDP overhead.
+ *
+ * The host emulator creates a memfd holding struct nettlp_shm, and
+ * passes it to the device over a UNIX socket. Each ring has a single
+ * producer and a single consumer, and is lock-free. A consumer that
+ * runs out of entries sleeps on the futex of the producer index, and
+ * the producer wakes it up only when it is sleeping.
+ *
+ *   req: device -> host, MRd and MWr issued by the device
+ *   cpl: host -> device, completions with data for MRd
+ *   mwr: host -> device, MWr to BAR4 of the device
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <nettlp_msg_all.h>
+
+#define NETTLP_SHM_MAGIC	0x4e544c50	/* "NTLP" */
+#define NETTLP_SHM_VERSION	1
+
+#define NETTLP_SHM_RING_LEN	256	/* must be power of 2 */
+#define NETTLP_SHM_MAX_PAYLOAD	4096
+
+#define NETTLP_SHM_MRD		1
+#define NETTLP_SHM_MWR		2
+#define NETTLP_SHM_CPL		3
+
+struct nettlp_shm_ent {
+	uint32_t	type;	/* NETTLP_SHM_* */
+	uint32_t	len;	/* length of data */
+	uint64_t	addr;
+	int32_t		status;	/* 0 or -errno for CPL */
+	uint32_t	rsv;
+	uint8_t		data[NETTLP_SHM_MAX_PAYLOAD];
+} __attribute__((aligned(64)));
+
+struct nettlp_shm_ring {
+	/* producer side. prod is also the futex word */
+	uint32_t	prod __attribute__((aligned(64)));
+
+	/* consumer side */
+	uint32_t	cons __attribute__((aligned(64)));
+	uint32_t	waiting;	/* consumer sleeps on prod */
+
+	struct nettlp_shm_ent ent[NETTLP_SHM_RING_LEN];
+} __attribute__((aligned(64)));
+
+struct nettlp_shm {
+	uint32_t	magic;		/* NETTLP_SHM_MAGIC */
+	uint32_t	version;	/* NETTLP_SHM_VERSION */
+
+	/* filled by the host emulator instead of NETTLP_MSG_GET_ALL */
+	struct nettlp_msg_all all;
+
+	struct nettlp_shm_ring req;
+	struct nettlp_shm_ring cpl;
+	struct nettlp_shm_ring mwr;
+};
+
+
+static inline int nettlp_shm_futex(uint32_t *uaddr, int op, uint32_t val,
+				   const struct timespec *ts)
+{
+	/* not FUTEX_PRIVATE_FLAG, the word is shared among processes */
+	return syscall(SYS_futex, uaddr, op, val, ts, NULL, 0);
+}
+
+/* producer: returns the entry to be filled, or NULL if full */
+static inline struct nettlp_shm_ent *
+nettlp_shm_ring_next(struct nettlp_shm_ring *r)
+{
+	uint32_t prod = r->prod;
+
+	if (prod - __atomic_load_n(&r->cons, __ATOMIC_ACQUIRE) ==
+	    NETTLP_SHM_RING_LEN)
+		return NULL;
+
+	return &r->ent[prod & (NETTLP_SHM_RING_LEN - 1)];
+}
+
+/* producer: publish the entry filled after nettlp_shm_ring_next */
+static inline void nettlp_shm_ring_push(struct nettlp_shm_ring *r)
+{
+	__atomic_store_n(&r->prod, r->prod + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+		nettlp_shm_futex(&r->prod, FUTEX_WAKE, 1, NULL);
+	}
+}
+
+/* producer: wait for a free entry */
+static inline struct nettlp_shm_ent *
+nettlp_shm_ring_reserve(struct nettlp_shm_ring *r)
+{
+	struct nettlp_shm_ent *e;
+
+	while (!(e = nettlp_shm_ring_next(r)))
+		sched_yield();
+
+	return e;
+}
+
+/* consumer: returns the head entry, or NULL if empty */
+static inline struct nettlp_shm_ent *
+nettlp_shm_ring_peek(struct nettlp_shm_ring *r)
+{
+	uint32_t cons = r->cons;
+
+	if (cons == __atomic_load_n(&r->prod, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &r->ent[cons & (NETTLP_SHM_RING_LEN - 1)];
+}
+
+/* consumer: release the head entry */
+static inline void nettlp_shm_ring_pop(struct nettlp_shm_ring *r)
+{
+	__atomic_store_n(&r->cons, r->cons + 1, __ATOMIC_RELEASE);
+}
+
+/* consumer: spin, and then sleep until an entry is pushed or
+ * timeout_ms passes. returns the head entry or NULL. */
+static inline struct nettlp_shm_ent *
+nettlp_shm_ring_wait(struct nettlp_shm_ring *r, int spin, int timeout_ms)
+{
+	int n;
+	uint32_t prod;
+	struct nettlp_shm_ent *e;
+	struct timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (timeout_ms % 1000) * 1000000,
+	};
+
+	for (n = 0; n < spin; n++) {
+		e = nettlp_shm_ring_peek(r);
+		if (e)
+			return e;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	}
+
+	/* tell the producer, and recheck not to miss a push */
+	prod = r->cons;
+	__atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->prod, __ATOMIC_SEQ_CST) == prod)
+		nettlp_shm_futex(&r->prod, FUTEX_WAIT, prod, &ts);
+	__atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+
+	return nettlp_shm_ring_peek(r);
+}
+
+
+/* pass the memfd over a UNIX socket */
+static inline int nettlp_shm_send_fd(int sock, int fd)
+{
+	char dummy = 0;
+	struct iovec iov = { .iov_base = &dummy, .iov_len = 1 };
+	union {
+		struct cmsghdr cm;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} u;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&u, 0, sizeof(u));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+
+	return sendmsg(sock, &msg, 0) < 0 ? -1 : 0;
+}
+
+static inline int nettlp_shm_recv_fd(int sock)
+{
+	int fd;
+	char dummy;
+	struct iovec iov = { .iov_base = &dummy, .iov_len = 1 };
+	union {
+		struct cmsghdr cm;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} u;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+
+	if (recvmsg(sock, &msg, 0) < 0)
+		return -1;
+
+	cm = CMSG_FIRSTHDR(&msg);
+	if (!cm || cm->cmsg_level != SOL_SOCKET ||
+	    cm->cmsg_type != SCM_RIGHTS)
+		return -1;
+
+	memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+	return fd;
+}
+
+#endif /* _NETTLP_SHM_H_ */
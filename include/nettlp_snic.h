@@ -45,19 +45,241 @@ struct snic_bar4 {
 	uint64_t tx_desc_base;	/* base address of TX descriptors */
 	uint64_t rx_desc_base;	/* base address of RX descriptors */
 
-	uint32_t tx_desc_idx;	/* index of TX desc to be sent */
-	uint32_t rx_desc_idx;	/* index of RX desc for next free buf */
+	uint32_t tx_desc_idx;	/* TX tail: index of next desc to be filled */
+	uint32_t rx_desc_idx;	/* RX tail: index of next desc to be filled */
 
 	uint32_t enabled;	/* if 1, device enabled by driver */
+	uint32_t desc_version;	/* SNIC_DESC_VERSION used by driver */
+
+	uint64_t stats_base;	/* host address of struct snic_stats */
+
+	uint32_t features;	/* SNIC_F_* requested by driver */
+
+	uint32_t irq_mask;	/* SNIC_IRQ_* not to be sent */
+
+	uint64_t rx_hdr_base;	/* header buffers for SNIC_F_HDR_SPLIT */
+
+	uint64_t flow_cmd_base;	/* host address of struct snic_flow_cmd */
+	uint32_t flow_cmd;	/* doorbell to run the flow command */
+
+	uint32_t nqueues;	/* queues in use by the driver */
 } __attribute__((packed));
 
+/* A 64-bit register takes effect on the write of its high dword, so
+ * that it may be written by a single MWr or by two 32-bit ones, low
+ * dword first.
+ *
+ * Doorbells of queue q are on their own 4KB page at
+ * SNIC_BAR4_DB_OFFSET + q * SNIC_BAR4_DB_STRIDE, so that each queue's
+ * doorbell can be mapped independently. tx_desc_idx and rx_desc_idx
+ * above are also the doorbells of queue 0, for a BAR4 mapped smaller
+ * than SNIC_BAR4_SIZE. */
+#define SNIC_BAR4_DB_OFFSET	4096
+#define SNIC_BAR4_DB_STRIDE	4096
+#define SNIC_BAR4_SIZE(nq)	(SNIC_BAR4_DB_OFFSET + (nq) * SNIC_BAR4_DB_STRIDE)
 
-/* packet descriptor */
-struct descriptor {
-	uint64_t addr;
-	uint64_t length; 
+struct snic_doorbell {
+	uint32_t tx_desc_idx;	/* TX tail of the queue */
+	uint32_t rx_desc_idx;	/* RX tail of the queue */
 } __attribute__((packed));
 
+#define snic_doorbell(bar4, q)						\
+	((struct snic_doorbell *)((char *)(bar4) + SNIC_BAR4_DB_OFFSET +	\
+				  (q) * SNIC_BAR4_DB_STRIDE))
+
+/* Optional features. The driver writes requested features before
+ * the descriptor base addresses, and the device applies them when
+ * the rings are reset. */
+#define SNIC_F_PACKED_RING	(1 << 0)
+#define SNIC_F_HDR_SPLIT	(1 << 1)
+#define SNIC_F_LRO		(1 << 2)	/* applied immediately */
+#define SNIC_F_RXCSUM		(1 << 3)	/* applied immediately */
+#define SNIC_F_VLAN_STRIP	(1 << 4)	/* applied immediately */
+
+/* RX checksum and VLAN offloads. With SNIC_F_RXCSUM, the device
+ * validates the IPv4 header and the TCP/UDP checksum over IPv4 and
+ * IPv6, and sets SNIC_DESC_F_CSUM_OK or SNIC_DESC_F_CSUM_ERR in the
+ * last descriptor of the frame. Other packets have neither. With
+ * SNIC_F_VLAN_STRIP, the device removes the 802.1Q tag of a received
+ * frame and writes back the TCI in vlan with SNIC_DESC_F_VLAN. On
+ * TX, the device inserts an 802.1Q tag with the TCI in vlan of a
+ * descriptor with SNIC_DESC_F_VLAN. */
+
+/* Header split (SNIC_F_HDR_SPLIT). The driver provides a header
+ * buffer of SNIC_RX_HDR_SIZE bytes for each RX descriptor at
+ * rx_hdr_base + SNIC_RX_HDR_SIZE * index, written before the RX
+ * descriptor base. The device DMAs the L2 to L4 headers of a packet
+ * to the header buffer and the payload to the descriptor's buffer,
+ * and writes back SNIC_DESC_F_SPLIT with wb.hdr_len and the payload
+ * length. A packet that fits the header buffer is written there
+ * entirely with length 0. Unknown protocols are not split. */
+#define SNIC_RX_HDR_SIZE	256
+
+/* Receive coalescing (SNIC_F_LRO). The device merges in-order TCP
+ * segments of a flow into a frame of up to SNIC_LRO_MAX_BYTES with
+ * rewritten IP and TCP headers and checksums. A frame larger than an
+ * RX buffer spans multiple descriptors, and only the last one has
+ * SNIC_DESC_F_EOP. The last descriptor of a coalesced frame has the
+ * number of segments in wb.seg_cnt, the payload length of the
+ * segments but the last in wb.mss, and the L2 to L4 header length in
+ * wb.hdr_len, so that the driver can set gso_size. */
+#define SNIC_LRO_MAX_BYTES	16384
+
+/* Interrupt mask. While the driver keeps polling, it masks the
+ * interrupts so that the device does not spend MWr TLPs on them.
+ * The device leaves a masked interrupt pending, and sends it when
+ * the driver unmasks the interrupt. */
+#define SNIC_IRQ_TX		(1 << 0)
+#define SNIC_IRQ_RX		(1 << 1)
+#define SNIC_IRQ_ALL		(SNIC_IRQ_TX | SNIC_IRQ_RX)
+
+
+/*
+ * Flow rules.
+ *
+ * The device matches received frames against rules at locations
+ * 0 to SNIC_FLOW_RULES - 1, and the matching rule at the lowest
+ * location decides the action: drop the frame before DMA, or steer
+ * it to an RX queue. A frame matches a rule if every bit set in
+ * the mask is equal in the frame and the key. Fields are in network
+ * byte order, and vlan is the TCI, 0 for untagged frames. Ports are
+ * 0 for protocols other than TCP and UDP and for IP fragments.
+ *
+ * The driver fills struct snic_flow_cmd in the buffer at
+ * flow_cmd_base with status SNIC_FLOW_PENDING, and writes any value
+ * to flow_cmd. The device reads the command, applies it, and
+ * DMA-writes the result to status: 0 or -errno. Writing
+ * flow_cmd_base deletes all rules, and the driver writes it on open
+ * and adds its rules again.
+ */
+#define SNIC_FLOW_RULES		1024
+
+#define SNIC_FLOW_CMD_ADD	1	/* add or replace the rule at loc */
+#define SNIC_FLOW_CMD_DEL	2	/* delete the rule at loc */
+#define SNIC_FLOW_CMD_CLEAR	3	/* delete all rules */
+
+#define SNIC_FLOW_DROP		0xffffffff	/* action to drop */
+#define SNIC_FLOW_PENDING	1		/* status until done */
+
+struct snic_flow_match {
+	uint32_t saddr;		/* IPv4 */
+	uint32_t daddr;
+	uint16_t sport;
+	uint16_t dport;
+	uint16_t vlan;
+	uint16_t ethertype;	/* after the VLAN tag */
+	uint8_t	 dmac[6];
+	uint8_t	 proto;
+	uint8_t	 rsv;
+} __attribute__((packed, aligned(8)));
+
+struct snic_flow_cmd {
+	uint32_t op;		/* SNIC_FLOW_CMD_* */
+	uint32_t loc;
+	uint32_t action;	/* RX queue or SNIC_FLOW_DROP */
+	int32_t	 status;	/* written by the device */
+	struct snic_flow_match key;
+	struct snic_flow_match mask;
+} __attribute__((packed, aligned(8)));
+
+
+/*
+ * Descriptor rings.
+ *
+ * TX and RX descriptors are arrays of SNIC_DESC_RING_LEN descriptors
+ * on the host. Descriptors from the device's head to the tail index
+ * written to BAR4 by the driver are owned by the device. When the
+ * device finishes a descriptor, it writes the descriptor back with
+ * SNIC_DESC_F_DD set, so that the driver finds completed descriptors
+ * by polling DD bits instead of reading a head pointer. A ring is
+ * reset to head = tail = 0 when its base address is written.
+ */
+#define SNIC_DESC_RING_LEN	256	/* must be power of 2 */
+#define snic_ring_next(idx)	(((idx) + 1) & (SNIC_DESC_RING_LEN - 1))
+#define snic_ring_count(head, tail)				\
+	(((tail) - (head)) & (SNIC_DESC_RING_LEN - 1))
+
+
+/*
+ * Packet descriptor.
+ *
+ * Descriptors are 16 bytes and 16-byte aligned, so that four
+ * descriptors are fetched by one 64-byte DMA read. flags is at the
+ * same offset in the read and the writeback formats.
+ *
+ * RX writeback overwrites addr with wb, so that the driver needs to
+ * remember buffer addresses.
+ */
+#define SNIC_DESC_VERSION	1
+
+struct descriptor {
+	union {
+		uint64_t addr;		/* read: buffer address */
+		struct {
+			uint16_t mss;
+			uint16_t rsv;
+			uint16_t hdr_len;
+			uint16_t seg_cnt;
+		} __attribute__((packed)) wb;	/* RX writeback */
+	};
+	uint16_t length;	/* buffer length, or packet length on wb */
+	uint16_t flags;		/* SNIC_DESC_F_* */
+	uint16_t vlan;		/* 802.1Q TCI when SNIC_DESC_F_VLAN */
+	uint16_t id;		/* buffer id in the packed ring */
+} __attribute__((packed, aligned(16)));
+
+#define SNIC_DESC_F_EOP		0x0001	/* end of packet */
+#define SNIC_DESC_F_DD		0x0002	/* descriptor done, set by device */
+#define SNIC_DESC_F_VLAN	0x0004	/* vlan is valid (RX strip/TX insert) */
+#define SNIC_DESC_F_CSUM_OK	0x0008	/* RX: L3/L4 checksums verified */
+#define SNIC_DESC_F_CSUM_ERR	0x0010	/* RX: L3/L4 checksum error */
+#define SNIC_DESC_F_TX_CSUM	0x0020	/* TX: hint to fill L4 checksum */
+#define SNIC_DESC_F_SPLIT	0x0040	/* RX: wb.hdr_len in header buffer */
+#define SNIC_DESC_F_AVAIL	0x4000	/* packed ring: available */
+#define SNIC_DESC_F_USED	0x8000	/* packed ring: used */
+
+
+/*
+ * Packed ring mode (SNIC_F_PACKED_RING).
+ *
+ * Like the packed virtqueue of virtio 1.1, availability and usage
+ * of descriptors are indicated by AVAIL and USED flags in the ring
+ * itself with wrap counters, instead of the tail index and DD.
+ * Both sides start with wrap counter 1, and flip it every time
+ * their index wraps around the ring.
+ *
+ * - The driver makes a descriptor available by writing flags with
+ *   AVAIL = wrap and USED = !wrap of its avail wrap counter.
+ * - The device processes descriptors in order while they are
+ *   available, and writes them back with AVAIL = USED = wrap of its
+ *   wrap counter. DD is also set.
+ *
+ * The TX and RX index registers are just notifications that new
+ * descriptors may be available, so that the device can read and
+ * complete a batch of descriptors without knowing the tail.
+ */
+static inline int snic_pdesc_is_avail(uint16_t flags, int wrap)
+{
+	return !!(flags & SNIC_DESC_F_AVAIL) == wrap &&
+		!!(flags & SNIC_DESC_F_USED) != wrap;
+}
+
+static inline int snic_pdesc_is_used(uint16_t flags, int wrap)
+{
+	return !!(flags & SNIC_DESC_F_AVAIL) == wrap &&
+		!!(flags & SNIC_DESC_F_USED) == wrap;
+}
+
+static inline uint16_t snic_pdesc_avail_flags(int wrap)
+{
+	return wrap ? SNIC_DESC_F_AVAIL : SNIC_DESC_F_USED;
+}
+
+static inline uint16_t snic_pdesc_used_flags(int wrap)
+{
+	return wrap ? (SNIC_DESC_F_AVAIL | SNIC_DESC_F_USED) : 0;
+}
+
 
 /*
  * BAR0 layout for configuration
@@ -75,6 +297,114 @@ struct snic_bar0 {
 	__be32 dstip;
 };
 
+/*
+ * Device statistics.
+ *
+ * BAR4 is not backed by memory on the device side, so that the
+ * driver cannot read counters from BAR4 directly. Instead, the
+ * driver notifies a host buffer via stats_base, and the device
+ * periodically DMA-writes struct snic_stats to the buffer. Only the
+ * header, the histogram, and nqueues entries of q[] are written.
+ *
+ * tx_reset_seq and rx_reset_seq are not in the periodic write. The
+ * device increments one and DMA-writes it alone when a write to
+ * tx_desc_base or rx_desc_base has taken effect, after the DMAs on
+ * the previous ring are over.
+ */
+#define SNIC_MAX_QUEUES		16
+
+struct snic_queue_stats {
+	uint64_t rx_packets;
+	uint64_t rx_bytes;
+	uint64_t rx_drops;
+	uint64_t tx_packets;
+	uint64_t tx_bytes;
+	uint64_t tx_drops;
+	uint64_t rx_desc_fetched;
+	uint64_t tx_desc_fetched;
+	uint64_t rx_irqs;
+	uint64_t tx_irqs;
+	uint64_t dma_read_errors;
+	uint64_t dma_write_errors;
+	uint64_t rx_busy_poll_ns;	/* time spinning on the backend */
+	uint64_t rx_sleep_ns;		/* time blocking on the backend */
+	uint64_t irqs_masked;		/* interrupts left pending */
+	uint64_t rx_lro_segs;		/* segments merged by LRO */
+	uint64_t rx_flow_hits;		/* frames matching a flow rule */
+	uint64_t rx_flow_drops;		/* frames dropped by a flow rule */
+	uint64_t dma_read_retries;	/* DMA reads retried after a loss */
+};
+
+/* DMA read latency histogram in nanoseconds. Buckets are log-linear
+ * like HDR histogram: values below SNIC_LAT_HIST_SUB have their own
+ * bucket, and each power of 2 above is split into SNIC_LAT_HIST_SUB
+ * linear buckets. The last bucket also counts larger values. */
+#define SNIC_LAT_HIST_SUB_BITS	3
+#define SNIC_LAT_HIST_SUB	(1 << SNIC_LAT_HIST_SUB_BITS)
+#define SNIC_LAT_HIST_BUCKETS	(SNIC_LAT_HIST_SUB * 30)
+
+struct snic_stats {
+	uint32_t version;
+#define SNIC_STATS_VERSION	1
+	uint32_t nqueues;	/* number of valid entries in q[] */
+
+	uint64_t dma_read_lat[SNIC_LAT_HIST_BUCKETS];
+
+	struct snic_queue_stats q[SNIC_MAX_QUEUES];
+
+	uint32_t tx_reset_seq;
+	uint32_t rx_reset_seq;
+};
+
+static inline int snic_lat_hist_index(uint64_t v)
+{
+	int msb, shift, idx;
+
+	if (v < SNIC_LAT_HIST_SUB)
+		return v;
+
+	msb = 63 - __builtin_clzll(v);
+	shift = msb - SNIC_LAT_HIST_SUB_BITS;
+	idx = SNIC_LAT_HIST_SUB * (shift + 1) +
+		((v >> shift) & (SNIC_LAT_HIST_SUB - 1));
+
+	return idx < SNIC_LAT_HIST_BUCKETS ? idx : SNIC_LAT_HIST_BUCKETS - 1;
+}
+
+/* the lowest value counted in the bucket idx */
+static inline uint64_t snic_lat_hist_value(int idx)
+{
+	int shift;
+
+	if (idx < SNIC_LAT_HIST_SUB)
+		return idx;
+
+	shift = idx / SNIC_LAT_HIST_SUB - 1;
+	return (uint64_t)(SNIC_LAT_HIST_SUB + idx % SNIC_LAT_HIST_SUB) << shift;
+}
+
+/* the value at percentile pct (0-100) of the histogram */
+static inline uint64_t snic_lat_hist_percentile(uint64_t *hist, int pct)
+{
+	int n;
+	uint64_t total = 0, count = 0;
+
+	for (n = 0; n < SNIC_LAT_HIST_BUCKETS; n++)
+		total += hist[n];
+
+	if (total == 0)
+		return 0;
+
+	for (n = 0; n < SNIC_LAT_HIST_BUCKETS; n++) {
+		count += hist[n];
+		if (count * 100 >= total * pct)
+			return snic_lat_hist_value(n);
+	}
+
+	return snic_lat_hist_value(SNIC_LAT_HIST_BUCKETS - 1);
+}
+
+
 #define snic_get_mac(dst, src) do {			\
 		dst[0] = src[5];		\
 		dst[1] = src[4];		\